@@ -0,0 +1,103 @@
+#ifndef _BASELINE_FORMAT_H_
+#define _BASELINE_FORMAT_H_
+
+/**
+ * The renderer of the status as it was before formats were compiled, for
+ * benchmarks to compare format_render() against. Every call scans the format
+ * string and allocates the output and its intermediate strings.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/text.h"
+#include "../include/utils.h"
+
+/**
+ * Build the output message according to the specified format options by
+ * replacing the tokens of the format string. Lengths are display widths in
+ * columns (see utf8_width()).
+ *
+ * @param char* artist The artist name
+ * @param char* title The track title
+ * @param int max_artist_length The maximum length of the artist in the output
+ * @param int max_title_length The maximum length of the title in the output
+ * @param int max_length The maximum length of the output string
+ * @param char* format The format string specifying the output. This can contain
+ *                     the %artist% and %title% tokens which will be replaced by
+ *                     the artist and title specified in the arguments.
+ * @param char* trunc The string to use to indicate that the artist, title, or
+ *                    output was truncated. This will be how the artist, title
+ *                    or output ends and will honor the max length constraints.
+ *
+ * @returns char* The format string with %artist% replaced by the song artist,
+ *                %title% replaced by the song title. If max_length is INT_MAX,
+ *                artist will be truncated if it is longer than
+ *                max_artist_length, and title will be truncated if it is longer
+ *                than max_title_length. If max_length is not INT_MAX, the
+ *                artist and title will only be truncated if the entire output
+ *                string is shorter than max_length, otherwise it will be
+ *                truncated as normal. In truncating a string, the end of the
+ *                string will be replaced with trunc while sataisfying the
+ *                max length constraints. Returns NULL if trunc is longer than
+ *                a max length it has to be applied to (see
+ *                format_options_valid()).
+ */
+static inline char *baseline_format_output(
+    const char *artist, const char *title, const int max_artist_length,
+    const int max_title_length, const int max_length, const char *format,
+    const char *trunc) {
+    // Get total number of each token
+    const int NUM_OF_ARTIST_TOK = num_of_matches(format, "%artist%");
+    const int NUM_OF_TITLE_TOK = num_of_matches(format, "%title%");
+
+    // Get width difference caused by a single replacement
+    const int ARTIST_REPL_DIFF =
+        utf8_width(artist, strlen(artist)) - strlen("%artist%");
+    const int TITLE_REPL_DIFF =
+        utf8_width(title, strlen(title)) - strlen("%title%");
+
+    // Calculate the total untruncated width of the output
+    const int TOTAL_UNTRUNC_LENGTH = utf8_width(format, strlen(format)) +
+                                     NUM_OF_ARTIST_TOK * ARTIST_REPL_DIFF +
+                                     NUM_OF_TITLE_TOK * TITLE_REPL_DIFF;
+
+    char *output;
+
+    // Truncate artist and title only if total untruncated length > max_length
+    // and max_length was specified
+    if (max_length == INT_MAX || TOTAL_UNTRUNC_LENGTH > max_length) {
+        // Truncate artist and track title using the truncation string
+        char *trunc_title = str_trunc(title, max_title_length, trunc);
+        char *trunc_artist = str_trunc(artist, max_artist_length, trunc);
+
+        if (trunc_title == NULL || trunc_artist == NULL) {
+            free(trunc_title);
+            free(trunc_artist);
+            return NULL;
+        }
+
+        // Replace all tokens with their values
+        char *temp = str_replace_all(format, "%artist%", trunc_artist);
+        char *temp2 = str_replace_all(temp, "%title%", trunc_title);
+
+        // Truncate output to max length, NULL if it can't be
+        output = str_trunc(temp2, max_length, trunc);
+
+        free(temp);
+        free(temp2);
+        free(trunc_title);
+        free(trunc_artist);
+    } else {
+        // Replace all tokens with their values
+        char *temp = str_replace_all(format, "%artist%", artist);
+        output = str_replace_all(temp, "%title%", title);
+
+        free(temp);
+    }
+
+    return output;
+}
+
+#endif
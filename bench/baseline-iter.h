@@ -0,0 +1,124 @@
+#ifndef _BASELINE_ITER_H_
+#define _BASELINE_ITER_H_
+
+/**
+ * The DBus iterator helpers of utils.c as they were before the single pass
+ * decoder, views and type code checks, for benchmarks to compare against.
+ * Strings are copied with malloc() and signatures are checked by formatting
+ * them with dbus_message_iter_get_signature().
+ */
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/utils.h"
+
+static inline char *baseline_iter_get_string(DBusMessageIter *iter) {
+    int type = dbus_message_iter_get_arg_type(iter);
+
+    char *str;
+
+    // Make sure it is a string
+    if (type == DBUS_TYPE_STRING) {
+        DBusBasicValue value;
+        dbus_message_iter_get_basic(iter, &value);
+
+        // +1 for null char
+        size_t size = (strlen(value.str) + 1) * sizeof(char);
+        str = (char *)malloc(size);
+        strcpy(str, value.str);
+
+        return str;
+    }
+
+    return NULL;
+}
+
+static inline dbus_bool_t baseline_recurse_iter_of_signature(
+    DBusMessageIter *iter, DBusMessageIter *subiter, const char *signature) {
+    char *iter_signature = dbus_message_iter_get_signature(iter);
+
+    // Check if iter signature matches
+    if (strcmp(iter_signature, signature) == 0) {
+        // Initialize subiter in container pointer to by iter
+        dbus_message_iter_recurse(iter, subiter);
+        dbus_free(iter_signature);
+        return TRUE;
+    } else {
+        dbus_free(iter_signature);
+        return FALSE;
+    }
+}
+
+static inline dbus_bool_t baseline_iter_go_to_key(
+    DBusMessageIter *element_iter, DBusMessageIter *entry_iter,
+    const char *key) {
+    const int iter_type = dbus_message_iter_get_arg_type(element_iter);
+    char *iter_signature = dbus_message_iter_get_signature(element_iter);
+
+    // Make sure iter is on dict entry and signature matches string-variant
+    // entry
+    if (iter_type != DBUS_TYPE_DICT_ENTRY ||
+        strcmp(iter_signature, "{sv}") != 0) {
+        dbus_free(iter_signature);
+        return FALSE;
+    }
+
+    dbus_free(iter_signature);
+
+    int current_type;
+
+    // Iterate through dict elements
+    while ((current_type = dbus_message_iter_get_arg_type(element_iter)) !=
+           DBUS_TYPE_INVALID) {
+        // Try to recurse into dict container
+        recurse_iter_of_type(element_iter, entry_iter, DBUS_TYPE_DICT_ENTRY);
+
+        // Get dict entry key
+        DBusBasicValue value;
+        dbus_message_iter_get_basic(entry_iter, &value);
+        const char *k = value.str;
+
+        // Check if dict key matches key argument
+        if (strcmp(k, key) == 0) {
+            // Move iter to value of dict entry and return
+            dbus_message_iter_next(entry_iter);
+            return TRUE;
+        }
+
+        // Go to next dict entry
+        dbus_message_iter_next(element_iter);
+    }
+
+    // No dict entry with specified key found
+    return FALSE;
+}
+
+static inline dbus_bool_t baseline_iter_try_step_to_key(
+    DBusMessageIter *element_iter, const char *key) {
+    DBusMessageIter kv_iter;
+
+    // Try to initialize kv_iter at value associated with key
+    if (!baseline_iter_go_to_key(element_iter, &kv_iter, key)) return FALSE;
+
+    *element_iter = kv_iter;
+
+    return TRUE;
+}
+
+static inline dbus_bool_t baseline_iter_try_step_into_signature(
+    DBusMessageIter *iter, const char *signature) {
+    DBusMessageIter sub_iter;
+
+    // Try to initialize sub_iter insider container pointed to by iter if
+    // signature matches
+    if (!baseline_recurse_iter_of_signature(iter, &sub_iter, signature))
+        return FALSE;
+
+    *iter = sub_iter;
+
+    return TRUE;
+}
+
+#endif
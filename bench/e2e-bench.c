@@ -0,0 +1,935 @@
+#include <dbus-1.0/dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Limits of the shared buffers the processes record into
+#define MAX_EVENTS 100000
+#define MAX_BARS 16
+#define MAX_PLAYERS 64
+#define ARRIVAL_TEXT_SIZE 40
+
+// Events whose hook did not reach a bar within this long are counted as
+// missed
+#define MAX_LATENCY_NS (1000LL * 1000 * 1000)
+
+static const char *SPOTIFY_BUS_NAME = "org.mpris.MediaPlayer2.spotify";
+static const char *MPRIS_PATH = "/org/mpris/MediaPlayer2";
+static const char *PLAYER_IFACE = "org.mpris.MediaPlayer2.Player";
+
+typedef enum {
+    EVENT_TRACK,
+    EVENT_PAUSE,
+    EVENT_PLAY,
+    EVENT_EXIT,
+    EVENT_LAUNCH,
+    EVENT_CTL_NEXT,
+    EVENT_CTL_PAUSE,
+    EVENT_CTL_PLAY,
+    NUM_OF_EVENT_KINDS
+} EventKind;
+
+static const char *EVENT_NAMES[] = {
+    "track change",         "pause",
+    "play",                 "spotify exit",
+    "spotify launch",       "spotifyctl next",
+    "spotifyctl playpause", "spotifyctl playpause"};
+
+// Something that should make the listener send a message to every bar
+typedef struct {
+    long long time_ns;
+    EventKind kind;
+} Event;
+
+// A message read by a fake bar
+typedef struct {
+    long long time_ns;
+    char text[ARRIVAL_TEXT_SIZE];
+} Arrival;
+
+// Shared between the processes of the harness
+typedef struct {
+    Event events[MAX_EVENTS];
+    int num_of_events;
+    int num_of_arrivals[MAX_BARS];
+} SharedState;
+
+typedef struct {
+    int players;
+    int bars;
+    int events;
+    double rate;
+    int restart_every;
+    int controls;
+    int status_runs;
+    dbus_bool_t push;
+} Options;
+
+static SharedState *shared;
+// Arrivals of every bar, max_arrivals per bar
+static Arrival *arrivals;
+static int max_arrivals;
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void sleep_ns(const long long ns) {
+    struct timespec ts = {ns / (1000 * 1000 * 1000), ns % (1000 * 1000 * 1000)};
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+static void add_event(const EventKind kind) {
+    if (shared->num_of_events == MAX_EVENTS) return;
+
+    Event *event = &shared->events[shared->num_of_events];
+    event->time_ns = now_ns();
+    event->kind = kind;
+    __atomic_store_n(&shared->num_of_events, shared->num_of_events + 1,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Fake polybar: read newline-terminated messages from a FIFO and record when
+ * each one arrived
+ */
+static void run_bar(const int bar, const char *dir) {
+    char path[PATH_MAX];
+    char buf[8192];
+    size_t len = 0;
+
+    snprintf(path, sizeof(path), "%s/polybar_mqueue.%d", dir, (int)getpid());
+
+    // Opening for reading and writing does not block and never sees EOF
+    if (mkfifo(path, 0600) == -1) _exit(1);
+    const int fd = open(path, O_RDWR);
+    if (fd == -1) _exit(1);
+
+    while (TRUE) {
+        const ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        const long long time_ns = now_ns();
+
+        if (n <= 0) {
+            if (errno == EINTR) continue;
+            _exit(1);
+        }
+        len += n;
+
+        char *start = buf;
+        char *end;
+        while ((end = memchr(start, '\n', buf + len - start)) != NULL) {
+            const int i = shared->num_of_arrivals[bar];
+
+            if (i < max_arrivals) {
+                Arrival *arrival = &arrivals[bar * max_arrivals + i];
+                const size_t text_len = end - start < ARRIVAL_TEXT_SIZE - 1
+                                            ? end - start
+                                            : ARRIVAL_TEXT_SIZE - 1;
+
+                arrival->time_ns = time_ns;
+                memcpy(arrival->text, start, text_len);
+                arrival->text[text_len] = '\0';
+                __atomic_store_n(&shared->num_of_arrivals[bar], i + 1,
+                                 __ATOMIC_RELEASE);
+            }
+
+            start = end + 1;
+        }
+
+        len = buf + len - start;
+        memmove(buf, start, len);
+        if (len == sizeof(buf)) len = 0;
+    }
+}
+
+// State of the fake spotify
+static int track = 0;
+static dbus_bool_t playing = TRUE;
+
+static void append_string_entry(DBusMessageIter *dict, const char *key,
+                                const char *value) {
+    DBusMessageIter entry;
+    DBusMessageIter variant;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "s", &variant);
+    dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_metadata_entry(DBusMessageIter *dict, const int id) {
+    DBusMessageIter entry;
+    DBusMessageIter variant;
+    DBusMessageIter metadata;
+    DBusMessageIter artist_entry;
+    DBusMessageIter artist_variant;
+    DBusMessageIter artists;
+    const char *key = "Metadata";
+    const char *artist_key = "xesam:artist";
+    const char *artist = "Fake Artist";
+    char trackid[64];
+    char title[64];
+
+    snprintf(trackid, sizeof(trackid), "/com/spotify/track/%d", id);
+    snprintf(title, sizeof(title), "Track %d", id);
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a{sv}",
+                                     &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{sv}",
+                                     &metadata);
+
+    append_string_entry(&metadata, "mpris:trackid", trackid);
+    append_string_entry(&metadata, "xesam:title", title);
+    append_string_entry(&metadata, "xesam:album", "Fake Album");
+
+    dbus_message_iter_open_container(&metadata, DBUS_TYPE_DICT_ENTRY, NULL,
+                                     &artist_entry);
+    dbus_message_iter_append_basic(&artist_entry, DBUS_TYPE_STRING,
+                                   &artist_key);
+    dbus_message_iter_open_container(&artist_entry, DBUS_TYPE_VARIANT, "as",
+                                     &artist_variant);
+    dbus_message_iter_open_container(&artist_variant, DBUS_TYPE_ARRAY, "s",
+                                     &artists);
+    dbus_message_iter_append_basic(&artists, DBUS_TYPE_STRING, &artist);
+    dbus_message_iter_close_container(&artist_variant, &artists);
+    dbus_message_iter_close_container(&artist_entry, &artist_variant);
+    dbus_message_iter_close_container(&metadata, &artist_entry);
+
+    dbus_message_iter_close_container(&variant, &metadata);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_properties(DBusMessage *msg, const dbus_bool_t metadata,
+                              const dbus_bool_t status) {
+    DBusMessageIter iter;
+    DBusMessageIter dict;
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    if (metadata) append_metadata_entry(&dict, track);
+    if (status)
+        append_string_entry(&dict, "PlaybackStatus",
+                            playing ? "Playing" : "Paused");
+    dbus_message_iter_close_container(&iter, &dict);
+}
+
+/**
+ * Emit PropertiesChanged with the metadata and/or status of the fake player
+ */
+static void emit_changed(DBusConnection *connection, const dbus_bool_t metadata,
+                         const dbus_bool_t status) {
+    DBusMessage *msg = dbus_message_new_signal(
+        MPRIS_PATH, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+    DBusMessageIter iter;
+    DBusMessageIter invalidated;
+
+    dbus_message_append_args(msg, DBUS_TYPE_STRING, &PLAYER_IFACE,
+                             DBUS_TYPE_INVALID);
+    append_properties(msg, metadata, status);
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+                                     &invalidated);
+    dbus_message_iter_close_container(&iter, &invalidated);
+
+    dbus_connection_send(connection, msg, NULL);
+    dbus_connection_flush(connection);
+    dbus_message_unref(msg);
+}
+
+/**
+ * Answer the Properties and Player methods spotifyctl and the listener call
+ */
+static DBusHandlerResult serve_player(DBusConnection *connection,
+                                      DBusMessage *msg, void *user_data) {
+    dbus_bool_t metadata = FALSE;
+    dbus_bool_t status = FALSE;
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+
+    if (dbus_message_is_method_call(msg, DBUS_INTERFACE_PROPERTIES,
+                                    "GetAll")) {
+        append_properties(reply, TRUE, TRUE);
+    } else if (dbus_message_is_method_call(msg, PLAYER_IFACE, "PlayPause")) {
+        playing = !playing;
+        status = TRUE;
+    } else if (dbus_message_is_method_call(msg, PLAYER_IFACE, "Play")) {
+        playing = TRUE;
+        status = TRUE;
+    } else if (dbus_message_is_method_call(msg, PLAYER_IFACE, "Pause")) {
+        playing = FALSE;
+        status = TRUE;
+    } else if (dbus_message_is_method_call(msg, PLAYER_IFACE, "Next") ||
+               dbus_message_is_method_call(msg, PLAYER_IFACE, "Previous")) {
+        track++;
+        metadata = TRUE;
+    } else {
+        dbus_message_unref(reply);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+
+    // Like spotify, announce the change caused by a control
+    if (metadata || status) emit_changed(connection, metadata, status);
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+ * Dispatch messages of every player until the monotonic time deadline_ns
+ */
+static void pump_until(DBusConnection *connections[], const int players,
+                       const long long deadline_ns) {
+    long long remaining_ns;
+
+    while ((remaining_ns = deadline_ns - now_ns()) > 0) {
+        for (int p = 1; p < players; p++)
+            while (dbus_connection_read_write_dispatch(connections[p], 0) &&
+                   dbus_connection_get_dispatch_status(connections[p]) ==
+                       DBUS_DISPATCH_DATA_REMAINS)
+                ;
+
+        int timeout_ms = remaining_ns / (1000 * 1000);
+        if (timeout_ms == 0) timeout_ms = 1;
+        if (players > 1 && timeout_ms > 1) timeout_ms = 1;
+
+        dbus_connection_read_write_dispatch(connections[0], timeout_ms);
+    }
+}
+
+/**
+ * Fake spotify, along with players - 1 other MPRIS players that change tracks
+ * at the same rate and must be ignored by the listener. Runs the script once
+ * start_fd is readable, then serves controls until it is killed.
+ */
+static void run_players(const Options *opts, const int start_fd,
+                        const int done_fd) {
+    DBusConnection *connections[MAX_PLAYERS];
+    DBusError err;
+    char byte;
+
+    dbus_error_init(&err);
+
+    for (int p = 0; p < opts->players; p++) {
+        char name[64];
+
+        connections[p] = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+        if (connections[p] == NULL) {
+            fprintf(stderr, "Fake player failed to connect: %s\n",
+                    err.message);
+            _exit(1);
+        }
+
+        if (p == 0) {
+            snprintf(name, sizeof(name), "%s", SPOTIFY_BUS_NAME);
+            dbus_connection_add_filter(connections[p], serve_player, NULL,
+                                       NULL);
+        } else {
+            snprintf(name, sizeof(name), "org.mpris.MediaPlayer2.fake%d", p);
+        }
+
+        dbus_bus_request_name(connections[p], name, 0, &err);
+        if (dbus_error_is_set(&err)) {
+            fprintf(stderr, "Fake player failed to take %s: %s\n", name,
+                    err.message);
+            _exit(1);
+        }
+    }
+
+    // Serve the listener's startup sync until the script is started
+    fcntl(start_fd, F_SETFL, O_NONBLOCK);
+    while (read(start_fd, &byte, 1) != 1)
+        pump_until(connections, opts->players, now_ns() + 1000 * 1000);
+
+    const long long period_ns = 1e9 / opts->rate;
+    long long deadline_ns = now_ns();
+    dbus_bool_t running = TRUE;
+
+    for (int e = 0; e < opts->events; e++) {
+        deadline_ns += period_ns;
+        pump_until(connections, opts->players, deadline_ns);
+
+        // The other players change tracks first, so their signals are queued
+        // ahead of spotify's
+        for (int p = 1; p < opts->players; p++)
+            emit_changed(connections[p], TRUE, TRUE);
+
+        if (!running) {
+            // Relaunch right after quitting
+            playing = TRUE;
+            add_event(EVENT_LAUNCH);
+            dbus_bus_request_name(connections[0], SPOTIFY_BUS_NAME, 0, NULL);
+            running = TRUE;
+        } else if (opts->restart_every > 0 &&
+                   e % opts->restart_every == opts->restart_every - 1) {
+            add_event(EVENT_EXIT);
+            dbus_bus_release_name(connections[0], SPOTIFY_BUS_NAME, NULL);
+            running = FALSE;
+        } else if (e % 10 == 9) {
+            playing = !playing;
+            add_event(playing ? EVENT_PLAY : EVENT_PAUSE);
+            emit_changed(connections[0], FALSE, TRUE);
+        } else {
+            track++;
+            add_event(EVENT_TRACK);
+            emit_changed(connections[0], TRUE, FALSE);
+        }
+    }
+
+    // Leave spotify running and playing for the controls
+    deadline_ns += period_ns;
+    pump_until(connections, opts->players, deadline_ns);
+    if (!running) {
+        playing = TRUE;
+        add_event(EVENT_LAUNCH);
+        dbus_bus_request_name(connections[0], SPOTIFY_BUS_NAME, 0, NULL);
+    } else if (!playing) {
+        playing = TRUE;
+        add_event(EVENT_PLAY);
+        emit_changed(connections[0], FALSE, TRUE);
+    }
+
+    if (write(done_fd, "", 1) != 1) _exit(1);
+
+    while (TRUE) pump_until(connections, opts->players, now_ns() + 1000000000);
+}
+
+static pid_t spawn(char *const argv[], const int out_fd) {
+    const pid_t pid = fork();
+
+    if (pid == 0) {
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(out_fd, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+/**
+ * Start a private bus and point DBUS_SESSION_BUS_ADDRESS at it
+ *
+ * @param int null_fd Where to send the output of the bus
+ *
+ * @returns pid_t The pid of the bus, or -1 if it could not be started
+ */
+static pid_t start_bus(const int null_fd) {
+    int fds[2];
+    char address[1024];
+    char fd_arg[32];
+    ssize_t len = 0;
+    ssize_t n;
+
+    if (pipe(fds) == -1) return -1;
+
+    snprintf(fd_arg, sizeof(fd_arg), "--print-address=%d", fds[1]);
+    char *const argv[] = {"dbus-daemon", "--session", "--nofork",
+                          "--nopidfile", fd_arg,      NULL};
+    const pid_t pid = spawn(argv, null_fd);
+    close(fds[1]);
+
+    // The address is printed once the bus is ready
+    while (len < sizeof(address) - 1 &&
+           (n = read(fds[0], address + len, sizeof(address) - 1 - len)) > 0) {
+        len += n;
+        if (memchr(address, '\n', len) != NULL) break;
+    }
+    close(fds[0]);
+
+    address[len] = '\0';
+    address[strcspn(address, "\n")] = '\0';
+
+    if (address[0] == '\0') {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    setenv("DBUS_SESSION_BUS_ADDRESS", address, 1);
+
+    return pid;
+}
+
+static const char *expected_message(const EventKind kind,
+                                    const dbus_bool_t push) {
+    switch (kind) {
+        case EVENT_TRACK:
+        case EVENT_CTL_NEXT:
+            return push ? "action:#spotify.send." : "hook:module/spotify2";
+        case EVENT_PAUSE:
+        case EVENT_CTL_PAUSE:
+            return "hook:module/playpause3";
+        case EVENT_EXIT:
+            return "hook:module/spotify1";
+        default:
+            return "hook:module/playpause2";
+    }
+}
+
+/**
+ * Find the first message arriving at a bar after an event that the event
+ * should have caused, starting at arrival *next. Returns -1 if there is none.
+ */
+static long long find_arrival(const int bar, int *next, const Event *event,
+                              const dbus_bool_t push) {
+    const char *expected = expected_message(event->kind, push);
+    const int num = __atomic_load_n(&shared->num_of_arrivals[bar],
+                                    __ATOMIC_ACQUIRE);
+
+    for (int a = *next; a < num; a++) {
+        const Arrival *arrival = &arrivals[bar * max_arrivals + a];
+        const long long latency_ns = arrival->time_ns - event->time_ns;
+
+        if (latency_ns < 0) continue;
+        if (latency_ns > MAX_LATENCY_NS) break;
+
+        // Events coalesced into one update share its message, so the message
+        // is left for the next event
+        if (strncmp(arrival->text, expected, strlen(expected)) == 0) {
+            *next = a;
+            return latency_ns;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Wait until every bar received the message caused by the last event, and the
+ * rest of the messages sent along with it
+ */
+static void wait_for_bars(const Options *opts) {
+    const Event *event = &shared->events[shared->num_of_events - 1];
+    const long long deadline_ns = now_ns() + MAX_LATENCY_NS;
+
+    for (int b = 0; b < opts->bars; b++) {
+        int from = 0;
+        int num;
+
+        while (find_arrival(b, &from, event, opts->push) == -1 &&
+               now_ns() < deadline_ns)
+            sleep_ns(100 * 1000);
+
+        do {
+            num = __atomic_load_n(&shared->num_of_arrivals[b],
+                                  __ATOMIC_ACQUIRE);
+            sleep_ns(10 * 1000 * 1000);
+        } while (num != __atomic_load_n(&shared->num_of_arrivals[b],
+                                        __ATOMIC_ACQUIRE));
+    }
+}
+
+static void run_controls(const Options *opts, const char *spotifyctl,
+                         const int null_fd, long long exec_ns[]) {
+    for (int c = 0; c < opts->controls; c++) {
+        // Alternate between a track change, a pause and a play
+        const EventKind kind = c % 3 == 0   ? EVENT_CTL_NEXT
+                               : c % 3 == 1 ? EVENT_CTL_PAUSE
+                                            : EVENT_CTL_PLAY;
+        char *const argv[] = {(char *)spotifyctl, "-q",
+                              kind == EVENT_CTL_NEXT ? "next" : "playpause",
+                              NULL};
+
+        add_event(kind);
+        const long long start_ns = now_ns();
+        const pid_t pid = spawn(argv, null_fd);
+
+        waitpid(pid, NULL, 0);
+        exec_ns[c] = now_ns() - start_ns;
+
+        wait_for_bars(opts);
+    }
+}
+
+static int compare_ns(const void *a, const void *b) {
+    const long long x = *(const long long *)a;
+    const long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *name, long long ns[], const int num,
+                            const int missed) {
+    if (num == 0) {
+        printf("%-24s %8d %8d\n", name, 0, missed);
+        return;
+    }
+
+    qsort(ns, num, sizeof(long long), compare_ns);
+
+    printf("%-24s %8d %8d %10.1f %10.1f %10.1f\n", name, num, missed,
+           ns[num / 2] / 1e3, ns[num * 99 / 100] / 1e3, ns[num - 1] / 1e3);
+}
+
+/**
+ * Run spotifyctl status over and over like the polybar module does on an
+ * interval, and report the runs per second and the time of a run
+ */
+static void run_status(const Options *opts, const char *name,
+                       char *const argv[], const int null_fd,
+                       long long exec_ns[]) {
+    const int num = opts->status_runs;
+    const long long start_ns = now_ns();
+
+    for (int r = 0; r < num; r++) {
+        const long long run_start_ns = now_ns();
+        const pid_t pid = spawn(argv, null_fd);
+
+        waitpid(pid, NULL, 0);
+        exec_ns[r] = now_ns() - run_start_ns;
+    }
+
+    const double runs_per_s = num * 1e9 / (now_ns() - start_ns);
+
+    qsort(exec_ns, num, sizeof(long long), compare_ns);
+
+    printf("%-24s %8d %10.0f %10.1f %10.1f %10.1f\n", name, num, runs_per_s,
+           exec_ns[num / 2] / 1e3, exec_ns[num * 99 / 100] / 1e3,
+           exec_ns[num - 1] / 1e3);
+}
+
+/**
+ * Get the output of a single spotifyctl status run
+ */
+static void read_status(char *const argv[], char *buf, const size_t size) {
+    int fds[2];
+    ssize_t len = 0;
+    ssize_t n;
+
+    buf[0] = '\0';
+    if (pipe(fds) == -1) return;
+
+    const pid_t pid = spawn(argv, fds[1]);
+    close(fds[1]);
+
+    while (len < (ssize_t)size - 1 &&
+           (n = read(fds[0], buf + len, size - 1 - len)) > 0)
+        len += n;
+
+    // Compare the statuses without the newline they end with
+    while (len > 0 && buf[len - 1] == '\n') len--;
+    buf[len] = '\0';
+
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * Time spotifyctl status reading the snapshot of the listener, then asking
+ * spotify over DBus once the snapshot is removed
+ */
+static void run_status_paths(const Options *opts, const char *spotifyctl,
+                             const char *dir, const int null_fd) {
+    char *const argv[] = {(char *)spotifyctl, "status", NULL};
+    long long *exec_ns = calloc(opts->status_runs, sizeof(long long));
+    char snapshot[PATH_MAX];
+    char snapshot_status[256];
+    char dbus_status[256];
+
+    snprintf(snapshot, sizeof(snapshot), "%s/spotify-listener.snapshot", dir);
+
+    printf("\n%-24s %8s %10s %10s %10s %10s\n", "spotifyctl status", "count",
+           "runs/s", "p50 us", "p99 us", "max us");
+
+    read_status(argv, snapshot_status, sizeof(snapshot_status));
+    run_status(opts, "snapshot", argv, null_fd, exec_ns);
+
+    // Readers fall back to DBus when the file is missing, even though the
+    // listener keeps its mapping
+    unlink(snapshot);
+
+    read_status(argv, dbus_status, sizeof(dbus_status));
+    run_status(opts, "dbus (no snapshot)", argv, null_fd, exec_ns);
+
+    if (strcmp(snapshot_status, dbus_status) != 0) {
+        printf("e2e-bench: the snapshot shows '%s' but spotify says '%s'\n",
+               snapshot_status, dbus_status);
+    }
+
+    free(exec_ns);
+}
+
+static void report(const Options *opts, long long exec_ns[]) {
+    long long *latencies =
+        malloc(sizeof(long long) * MAX_EVENTS * opts->bars);
+    int next[MAX_BARS] = {0};
+
+    printf("%-24s %8s %8s %10s %10s %10s\n", "signal to bar", "count",
+           "missed", "p50 us", "p99 us", "max us");
+
+    for (int kind = 0; kind < NUM_OF_EVENT_KINDS; kind++) {
+        int num = 0;
+        int missed = 0;
+
+        // playpause controls are reported together
+        if (kind == EVENT_CTL_PLAY) continue;
+
+        for (int b = 0; b < opts->bars; b++) {
+            next[b] = 0;
+
+            for (int e = 0; e < shared->num_of_events; e++) {
+                const Event *event = &shared->events[e];
+                long long latency_ns;
+
+                if (event->kind != kind &&
+                    !(kind == EVENT_CTL_PAUSE && event->kind == EVENT_CTL_PLAY))
+                    continue;
+
+                latency_ns = find_arrival(b, &next[b], event, opts->push);
+                if (latency_ns >= 0) {
+                    latencies[num++] = latency_ns;
+                } else {
+                    missed++;
+                }
+            }
+        }
+
+        if (num + missed > 0)
+            print_latencies(EVENT_NAMES[kind], latencies, num, missed);
+    }
+
+    if (opts->controls > 0) {
+        printf("\n%-24s %8s %8s %10s %10s %10s\n", "control round trip",
+               "count", "", "p50 us", "p99 us", "max us");
+        print_latencies("spotifyctl run", exec_ns, opts->controls, 0);
+    }
+
+    free(latencies);
+}
+
+static void print_usage() {
+    puts("usage: e2e-bench [options] [-- listener options]");
+    puts("");
+    puts("  Runs spotify-listener and spotifyctl on a private bus against a");
+    puts("  fake spotify and fake polybar FIFOs, and reports the latency from");
+    puts("  a signal being emitted to its message arriving at the bars.");
+    puts("");
+    puts("  Options:");
+    puts("    --players N       Number of MPRIS players, including spotify");
+    puts("                        Default: 1");
+    puts("    --bars N          Number of polybar FIFOs");
+    puts("                        Default: 1");
+    puts("    --events N        Number of scripted events");
+    puts("                        Default: 200");
+    puts("    --rate N          Events per second");
+    puts("                        Default: 20");
+    puts("    --restart-every N Quit or relaunch spotify every N events, 0 to");
+    puts("                      never restart it");
+    puts("                        Default: 50");
+    puts("    --controls N      Number of spotifyctl commands to run");
+    puts("                        Default: 30");
+    puts("    --status-runs N   Number of spotifyctl status runs with the");
+    puts("                      status snapshot and then without it");
+    puts("                        Default: 200");
+}
+
+int main(int argc, char *argv[]) {
+    Options opts = {1, 1, 200, 20, 50, 30, 200, FALSE};
+    char dir[] = "/tmp/spotify-e2e-bench.XXXXXX";
+    // Leaves room for the names of the executables
+    char bin_dir[PATH_MAX - 32];
+    char listener[PATH_MAX];
+    char spotifyctl[PATH_MAX];
+    char *listener_argv[64];
+    int listener_argc = 0;
+    pid_t bar_pids[MAX_BARS];
+    int start_pipe[2];
+    int done_pipe[2];
+    char byte;
+    int status = 1;
+
+    // The executables are built next to the bench
+    snprintf(bin_dir, sizeof(bin_dir), "%s", argv[0]);
+    const char *bin_dir_name = dirname(bin_dir);
+    snprintf(listener, sizeof(listener), "%s/spotify-listener", bin_dir_name);
+    snprintf(spotifyctl, sizeof(spotifyctl), "%s/spotifyctl", bin_dir_name);
+
+    listener_argv[listener_argc++] = listener;
+    listener_argv[listener_argc++] = "--ipc-dir";
+    listener_argv[listener_argc++] = dir;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            for (i++; i < argc && listener_argc < 63; i++) {
+                // Any status formatting option implies --push
+                if (strncmp(argv[i], "--push", 6) == 0 ||
+                    strncmp(argv[i], "--max-", 6) == 0 ||
+                    strcmp(argv[i], "--format") == 0 ||
+                    strcmp(argv[i], "--trunc") == 0)
+                    opts.push = TRUE;
+                listener_argv[listener_argc++] = argv[i];
+            }
+        } else if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+            opts.players = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bars") == 0 && i + 1 < argc) {
+            opts.bars = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+            opts.events = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            opts.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--restart-every") == 0 && i + 1 < argc) {
+            opts.restart_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--controls") == 0 && i + 1 < argc) {
+            opts.controls = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--status-runs") == 0 && i + 1 < argc) {
+            opts.status_runs = atoi(argv[++i]);
+        } else {
+            print_usage();
+            return strcmp(argv[i], "help") == 0 ? 0 : 1;
+        }
+    }
+    listener_argv[listener_argc] = NULL;
+
+    if (opts.players < 1 || opts.players > MAX_PLAYERS || opts.bars < 1 ||
+        opts.bars > MAX_BARS || opts.events < 0 ||
+        opts.events + opts.controls + 1 > MAX_EVENTS || opts.rate <= 0 ||
+        opts.restart_every < 0 || opts.controls < 0 ||
+        opts.status_runs < 0) {
+        print_usage();
+        return 1;
+    }
+
+    if (access(listener, X_OK) == -1 || access(spotifyctl, X_OK) == -1) {
+        fprintf(stderr, "e2e-bench: %s and %s must be built first\n", listener,
+                spotifyctl);
+        return 1;
+    }
+
+    // Every update sends up to 4 messages to each bar
+    max_arrivals = (opts.events + opts.controls) * 4 + 64;
+    shared = mmap(NULL, sizeof(SharedState), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    arrivals = mmap(NULL, sizeof(Arrival) * max_arrivals * opts.bars,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED || arrivals == MAP_FAILED) return 1;
+
+    if (mkdtemp(dir) == NULL || pipe(start_pipe) == -1 ||
+        pipe(done_pipe) == -1)
+        return 1;
+
+    const int null_fd = open("/dev/null", O_WRONLY);
+    const pid_t bus_pid = start_bus(null_fd);
+    if (bus_pid == -1) {
+        puts("e2e-bench: dbus-daemon is not available, skipping");
+        rmdir(dir);
+        return 0;
+    }
+
+    // Keep the status snapshot away from a real listener. The bus is started
+    // first, as it creates its own files in the runtime directory.
+    setenv("XDG_RUNTIME_DIR", dir, 1);
+
+    for (int b = 0; b < opts.bars; b++) {
+        bar_pids[b] = fork();
+        if (bar_pids[b] == 0) run_bar(b, dir);
+    }
+
+    // Wait for the bars to create their FIFOs
+    for (int b = 0; b < opts.bars; b++) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/polybar_mqueue.%d", dir,
+                 (int)bar_pids[b]);
+        while (access(path, F_OK) == -1) sleep_ns(1000 * 1000);
+    }
+
+    const pid_t players_pid = fork();
+    if (players_pid == 0) run_players(&opts, start_pipe[0], done_pipe[1]);
+
+    // Wait for spotify to take its name so the listener syncs with it
+    DBusConnection *connection = dbus_bus_get(DBUS_BUS_SESSION, NULL);
+    while (connection != NULL &&
+           !dbus_bus_name_has_owner(connection, SPOTIFY_BUS_NAME, NULL))
+        sleep_ns(1000 * 1000);
+
+    const pid_t listener_pid = spawn(listener_argv, null_fd);
+
+    // The listener is ready once it synced every bar with spotify
+    const long long ready_deadline_ns = now_ns() + 5 * MAX_LATENCY_NS;
+    for (int b = 0; b < opts.bars; b++) {
+        while (__atomic_load_n(&shared->num_of_arrivals[b],
+                               __ATOMIC_ACQUIRE) == 0 &&
+               now_ns() < ready_deadline_ns)
+            sleep_ns(1000 * 1000);
+    }
+
+    if (now_ns() >= ready_deadline_ns) {
+        fputs("e2e-bench: spotify-listener did not sync with the bars\n",
+              stderr);
+    } else {
+        long long *exec_ns = calloc(opts.controls + 1, sizeof(long long));
+
+        printf("%d players, %d bars, %d events at %.0f/s\n\n", opts.players,
+               opts.bars, opts.events, opts.rate);
+
+        if (write(start_pipe[1], "", 1) == 1 &&
+            read(done_pipe[0], &byte, 1) == 1) {
+            wait_for_bars(&opts);
+            run_controls(&opts, spotifyctl, null_fd, exec_ns);
+
+            // Let the last messages arrive
+            sleep_ns(100 * 1000 * 1000);
+            report(&opts, exec_ns);
+            if (opts.status_runs > 0)
+                run_status_paths(&opts, spotifyctl, dir, null_fd);
+            status = 0;
+        }
+
+        free(exec_ns);
+    }
+
+    kill(listener_pid, SIGTERM);
+    kill(players_pid, SIGTERM);
+    waitpid(listener_pid, NULL, 0);
+    waitpid(players_pid, NULL, 0);
+
+    for (int b = 0; b < opts.bars; b++) {
+        char path[PATH_MAX];
+
+        kill(bar_pids[b], SIGTERM);
+        waitpid(bar_pids[b], NULL, 0);
+        snprintf(path, sizeof(path), "%s/polybar_mqueue.%d", dir,
+                 (int)bar_pids[b]);
+        unlink(path);
+    }
+
+    if (connection != NULL) dbus_connection_unref(connection);
+    kill(bus_pid, SIGTERM);
+    waitpid(bus_pid, NULL, 0);
+
+    char snapshot[PATH_MAX];
+    snprintf(snapshot, sizeof(snapshot), "%s/spotify-listener.snapshot", dir);
+    unlink(snapshot);
+    rmdir(dir);
+
+    return status;
+}
@@ -0,0 +1,156 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/format.h"
+#include "../include/mpris.h"
+#include "baseline-format.h"
+
+typedef struct {
+    const char *name;
+    const char *format;
+    const char *artist;
+    const char *title;
+    int max_artist_length;
+    int max_title_length;
+    int max_length;
+    const char *trunc;
+} BenchCase;
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static char *repeat(const char *str, const int times) {
+    const size_t len = strlen(str);
+    char *res = calloc(len * times + 1, sizeof(char));
+
+    for (int i = 0; i < times; i++) memcpy(res + i * len, str, len);
+
+    return res;
+}
+
+static int run_case(const BenchCase *bench, const long iterations) {
+    static FormatCache cache;
+    StatusFormat fmt;
+    TrackState track;
+    char output[FORMAT_OUTPUT_SIZE];
+
+    track_state_clear(&track);
+    strncpy(track.artists, bench->artist, TRACK_TEXT_SIZE - 1);
+    strncpy(track.title, bench->title, TRACK_TEXT_SIZE - 1);
+    track.fields = TRACK_HAS_ARTISTS | TRACK_HAS_TITLE;
+    format_cache_clear(&cache);
+
+    if (!format_compile(&fmt, bench->format, bench->max_artist_length,
+                        bench->max_title_length, bench->max_length,
+                        bench->trunc)) {
+        printf("%-24s failed to compile\n", bench->name);
+        return 1;
+    }
+
+    // Both must render the exact same output, whether the indexes of the
+    // artist and title are built or taken from the cache
+    char *expected = baseline_format_output(
+        track.artists, track.title, bench->max_artist_length,
+        bench->max_title_length, bench->max_length, bench->format, bench->trunc);
+    format_render(&fmt, &track, &cache, output, sizeof(output));
+    if (strcmp(expected, output) == 0)
+        format_render(&fmt, &track, &cache, output, sizeof(output));
+
+    if (strcmp(expected, output) != 0) {
+        printf("%-24s MISMATCH\n  baseline: '%s'\n  format_render: '%s'\n",
+               bench->name, expected, output);
+        free(expected);
+        format_free(&fmt);
+        return 1;
+    }
+    free(expected);
+
+    long long start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        char *res = baseline_format_output(
+            track.artists, track.title, bench->max_artist_length,
+            bench->max_title_length, bench->max_length, bench->format,
+            bench->trunc);
+        free(res);
+    }
+    const double old_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        format_render(&fmt, &track, &cache, output, sizeof(output));
+    const double new_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        format_render(&fmt, &track, NULL, output, sizeof(output));
+    const double uncached_ns = (double)(now_ns() - start) / iterations;
+
+    format_free(&fmt);
+
+    // Compiling includes allocating the tokens
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        format_compile(&fmt, bench->format, bench->max_artist_length,
+                       bench->max_title_length, bench->max_length,
+                       bench->trunc);
+        format_free(&fmt);
+    }
+    const double compile_ns = (double)(now_ns() - start) / iterations;
+
+    printf("%-24s %12.1f %12.1f %12.1f %12.1f %8.1fx\n", bench->name, old_ns,
+           new_ns, uncached_ns, compile_ns, old_ns / new_ns);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    int failed = 0;
+
+    char *long_artist = repeat("Artist Name ", 30);
+    char *long_title = repeat("A Very Long Track Title ", 20);
+    char *many_tokens = repeat("%artist% - %title% | ", 15);
+    char *cjk_artist = repeat("宇多田ヒカル", 10);
+    char *cjk_title = repeat("誰かの願いが叶うころ ", 8);
+
+    const BenchCase cases[] = {
+        {"default", "%artist%: %title%", "Eminem", "Sing For The Moment",
+         INT_MAX, INT_MAX, INT_MAX, "..."},
+        {"truncated", "%artist%: %title%", "Eminem", "Sing For The Moment", 10,
+         10, 20, "..."},
+        {"fits max length", "%artist%: %title%", "Eminem",
+         "Sing For The Moment", 10, 10, 30, "..."},
+        {"long strings", "%artist%: %title%", long_artist, long_title, 30, 40,
+         60, "..."},
+        {"long untruncated", "%artist%: %title%", long_artist, long_title,
+         INT_MAX, INT_MAX, INT_MAX, "..."},
+        {"many tokens", many_tokens, "Eminem", "Sing For The Moment", INT_MAX,
+         INT_MAX, INT_MAX, "..."},
+        {"many tokens truncated", many_tokens, long_artist, long_title, 20, 20,
+         200, "~"},
+        {"cjk truncated", "%artist%: %title%", cjk_artist, cjk_title, 30, 40,
+         60, "…"},
+    };
+
+    printf("%-24s %12s %12s %12s %12s %9s\n", "case", "output ns/op",
+           "render ns/op", "uncached ns", "compile ns", "speedup");
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+        failed |= run_case(&cases[c], iterations);
+
+    free(long_artist);
+    free(long_title);
+    free(many_tokens);
+    free(cjk_artist);
+    free(cjk_title);
+
+    return failed;
+}
@@ -0,0 +1,454 @@
+#include <dbus-1.0/dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/polybar-ipc.h"
+#include "../include/utils.h"
+
+#define MAX_BARS 64
+
+// Connections a fake bar serves at once
+#define MAX_CONNECTIONS 8
+
+// Updates sent before measuring, so every FIFO is open and registered
+#define WARMUP_UPDATES 10
+
+// The messages of a play/pause update
+static const char *UPDATE[] = {"hook:module/playpause2",
+                               "hook:module/previous2", "hook:module/next2",
+                               "hook:module/spotify2"};
+#define UPDATE_MSGS (sizeof(UPDATE) / sizeof(UPDATE[0]))
+
+// The backends of polybar-ipc, and the baseline of opening every FIFO for
+// every message and sleeping 10 ms after it, like the listener did before
+static const char *BACKEND_NAMES[] = {"write", "io_uring", "fopen+sleep"};
+#define BACKEND_IO_URING 1
+#define BACKEND_FOPEN 2
+#define NUM_OF_BACKENDS 3
+
+// Updates measured with the baseline, which takes 40 ms per update and bar
+#define FOPEN_UPDATES 3
+
+typedef struct {
+    int updates;
+    int max_bars;
+    IpcTransport transport;
+} Options;
+
+// Syscalls made while sending the measured updates
+typedef struct {
+    long total;
+    // write() or io_uring_enter() calls
+    long submits;
+} SyscallCount;
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/**
+ * Fake polybar: read messages from a FIFO as soon as they are written
+ */
+static void run_fifo_bar(const char *dir, const int ready_fd) {
+    char path[PATH_MAX];
+    char buf[4096];
+
+    snprintf(path, sizeof(path), "%s/polybar_mqueue.%d", dir, (int)getpid());
+
+    // Opening for reading and writing does not block and never sees EOF
+    if (mkfifo(path, 0600) == -1) _exit(1);
+    const int fd = open(path, O_RDWR);
+    if (fd == -1 || write(ready_fd, "", 1) != 1) _exit(1);
+
+    while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+        ;
+    _exit(0);
+}
+
+/**
+ * Answer every complete request in a buffer with an empty OK response
+ *
+ * @returns size_t The number of bytes of the requests that were answered
+ */
+static size_t answer_requests(const int fd, const char *buf, const size_t len) {
+    // "polyipc", version 0, no payload, OK
+    static const char OK[POLYBAR_SOCKET_HEADER_LEN] = "polyipc";
+    size_t used = 0;
+    uint32_t size;
+
+    while (len - used >= POLYBAR_SOCKET_HEADER_LEN) {
+        memcpy(&size, buf + used + 8, sizeof(size));
+        if (len - used < POLYBAR_SOCKET_HEADER_LEN + size) break;
+
+        if (write(fd, OK, sizeof(OK)) != sizeof(OK)) break;
+        used += POLYBAR_SOCKET_HEADER_LEN + size;
+    }
+
+    return used;
+}
+
+/**
+ * Fake polybar: answer requests on an IPC socket as soon as they are written,
+ * keeping connections open
+ */
+static void run_socket_bar(const char *dir, const int ready_fd) {
+    struct sockaddr_un addr;
+    struct pollfd fds[MAX_CONNECTIONS + 1];
+    char bufs[MAX_CONNECTIONS + 1][4096];
+    size_t lens[MAX_CONNECTIONS + 1];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ipc.%d.sock", dir,
+             (int)getpid());
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, MAX_CONNECTIONS) == -1 ||
+        write(ready_fd, "", 1) != 1)
+        _exit(1);
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (int c = 1; c <= MAX_CONNECTIONS; c++) fds[c].fd = -1;
+
+    while (poll(fds, MAX_CONNECTIONS + 1, -1) >= 0 || errno == EINTR) {
+        for (int c = 1; c <= MAX_CONNECTIONS; c++) {
+            if (fds[c].fd == -1 || !(fds[c].revents & (POLLIN | POLLHUP)))
+                continue;
+
+            const ssize_t len = read(fds[c].fd, bufs[c] + lens[c],
+                                     sizeof(bufs[c]) - lens[c]);
+            if (len <= 0) {
+                close(fds[c].fd);
+                fds[c].fd = -1;
+                continue;
+            }
+
+            lens[c] += len;
+            const size_t used = answer_requests(fds[c].fd, bufs[c], lens[c]);
+            memmove(bufs[c], bufs[c] + used, lens[c] - used);
+            lens[c] -= used;
+        }
+
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        const int fd = accept(listen_fd, NULL, NULL);
+        for (int c = 1; c <= MAX_CONNECTIONS && fd != -1; c++) {
+            if (fds[c].fd != -1) continue;
+
+            fds[c].fd = fd;
+            fds[c].events = POLLIN;
+            lens[c] = 0;
+            break;
+        }
+    }
+    _exit(0);
+}
+
+static dbus_bool_t start_bars(const char *dir, const Options *opts,
+                              const int bars, pid_t pids[]) {
+    int ready[2];
+    char byte;
+
+    if (pipe(ready) == -1) return FALSE;
+
+    for (int b = 0; b < bars; b++) {
+        pids[b] = fork();
+        if (pids[b] != 0) continue;
+
+        if (opts->transport == IPC_TRANSPORT_SOCKET) {
+            run_socket_bar(dir, ready[1]);
+        } else {
+            run_fifo_bar(dir, ready[1]);
+        }
+    }
+
+    close(ready[1]);
+
+    int started = 0;
+    while (started < bars && read(ready[0], &byte, 1) == 1) started++;
+    close(ready[0]);
+
+    return started == bars;
+}
+
+static void stop_bars(const char *dir, const int bars, const pid_t pids[]) {
+    char path[PATH_MAX];
+
+    for (int b = 0; b < bars; b++) {
+        kill(pids[b], SIGTERM);
+        waitpid(pids[b], NULL, 0);
+
+        snprintf(path, sizeof(path), "%s/polybar_mqueue.%d", dir, (int)pids[b]);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/ipc.%d.sock", dir, (int)pids[b]);
+        unlink(path);
+    }
+}
+
+/**
+ * Send an update the way the listener did before polybar-ipc: scan the
+ * directory for FIFOs, then open the FIFO for every message, write it, close
+ * it and sleep 10 ms so that polybar reads the messages one at a time
+ */
+static void send_fopen_update(const char *dir) {
+    char **paths;
+    size_t num_of_paths;
+
+    get_polybar_ipc_paths(dir, "polybar_mqueue", &paths, &num_of_paths);
+
+    for (size_t p = 0; p < num_of_paths; p++) {
+        for (size_t m = 0; m < UPDATE_MSGS; m++) {
+            FILE *fp = fopen(paths[p], "w");
+
+            if (fp != NULL) {
+                fputs(UPDATE[m], fp);
+                fclose(fp);
+            }
+
+            msleep(10);
+        }
+
+        free(paths[p]);
+    }
+
+    free(paths);
+}
+
+/**
+ * Get the number of updates measured with a backend
+ */
+static int backend_updates(const Options *opts, const int backend) {
+    if (backend == BACKEND_FOPEN && opts->updates > FOPEN_UPDATES)
+        return FOPEN_UPDATES;
+
+    return opts->updates;
+}
+
+/**
+ * Send updates to every bar in the directory with a backend
+ *
+ * @returns dbus_bool_t FALSE if the backend is not available
+ */
+static dbus_bool_t send_updates(const char *dir, const Options *opts,
+                                const int backend, long long *elapsed_ns) {
+    const int updates = backend_updates(opts, backend);
+
+    if (backend == BACKEND_FOPEN) {
+        // The baseline only knows FIFOs, and has nothing to warm up
+        if (opts->transport != IPC_TRANSPORT_FIFO) return FALSE;
+
+        syscall(SYS_getppid);
+        const long long start_ns = now_ns();
+
+        for (int u = 0; u < updates; u++) send_fopen_update(dir);
+
+        *elapsed_ns = now_ns() - start_ns;
+        syscall(SYS_getppid);
+
+        return TRUE;
+    }
+
+    if (!ipc_use_io_uring(backend == BACKEND_IO_URING) &&
+        backend == BACKEND_IO_URING)
+        return FALSE;
+
+    // The fake bars create their sockets in the same directory
+    ipc_endpoints_init(
+        dir, opts->transport == IPC_TRANSPORT_SOCKET ? dir : NULL);
+
+    // Every message is sent on every update, like the first update a bar
+    // gets, rather than only the ones that change a module
+    for (int u = 0; u < WARMUP_UPDATES; u++)
+        ipc_send_messages(UPDATE, UPDATE_MSGS, IPC_REFRESH_ALL, 0);
+
+    // Marks the start of the measured updates for the tracer
+    syscall(SYS_getppid);
+    const long long start_ns = now_ns();
+
+    for (int u = 0; u < updates; u++)
+        ipc_send_messages(UPDATE, UPDATE_MSGS, IPC_REFRESH_ALL, 0);
+
+    *elapsed_ns = now_ns() - start_ns;
+    syscall(SYS_getppid);
+
+    ipc_endpoints_free();
+    ipc_use_io_uring(FALSE);
+
+    return TRUE;
+}
+
+/**
+ * Count the syscalls made to send the updates, by sending them from a child
+ * traced with ptrace. The syscalls between the two getppid() markers of
+ * send_updates() are counted.
+ */
+static dbus_bool_t count_syscalls(const char *dir, const Options *opts,
+                                  const int backend, SyscallCount *count) {
+    struct __ptrace_syscall_info info;
+    int status;
+    int markers = 0;
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        long long elapsed_ns;
+
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        _exit(send_updates(dir, opts, backend, &elapsed_ns) ? 0 : 1);
+    }
+
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+        return FALSE;
+
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD);
+
+    count->total = 0;
+    count->submits = 0;
+
+    while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 &&
+           waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) continue;
+
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0 ||
+            info.op != PTRACE_SYSCALL_INFO_ENTRY)
+            continue;
+
+        if (info.entry.nr == SYS_getppid) {
+            markers++;
+            continue;
+        }
+
+        if (markers != 1) continue;
+
+        count->total++;
+        if (info.entry.nr == SYS_write || info.entry.nr == SYS_io_uring_enter)
+            count->submits++;
+    }
+
+    waitpid(pid, &status, 0);
+
+    return markers == 2;
+}
+
+/**
+ * Double the number of bars, but always end with the largest number
+ */
+static int next_bars(const int bars, const Options *opts) {
+    if (bars == opts->max_bars) return bars + 1;
+
+    return bars * 2 < opts->max_bars ? bars * 2 : opts->max_bars;
+}
+
+static void print_usage() {
+    puts("usage: ipc-bench [options]");
+    puts("");
+    puts("  Sends play/pause updates (4 messages) to 1 to N fake bars with the");
+    puts("  write() and io_uring backends of polybar-ipc, and reports the wall");
+    puts("  time and syscalls per update. Writes to sockets include the reads");
+    puts("  of their acknowledgements. With FIFOs, the updates are also sent");
+    puts("  like the listener did before polybar-ipc (fopen+sleep): opening");
+    puts("  the FIFO for every message and sleeping 10 ms after it. Only 3");
+    puts("  updates are measured this way, since each takes 40 ms per bar.");
+    puts("");
+    puts("  Options:");
+    puts("    --updates N       Number of updates per run");
+    puts("                        Default: 200");
+    puts("    --max-bars N      Largest number of bars, at most 64");
+    puts("                        Default: 64");
+    puts("    --transport T     How the fake bars take messages: fifo or");
+    puts("                      socket (polybar 3.6+)");
+    puts("                        Default: fifo");
+}
+
+int main(int argc, char *argv[]) {
+    Options opts = {200, MAX_BARS, IPC_TRANSPORT_FIFO};
+    pid_t bar_pids[MAX_BARS];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--updates") == 0 && i + 1 < argc) {
+            opts.updates = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-bars") == 0 && i + 1 < argc) {
+            opts.max_bars = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "fifo") == 0 ||
+                    strcmp(argv[i + 1], "socket") == 0)) {
+            opts.transport = strcmp(argv[++i], "socket") == 0
+                                 ? IPC_TRANSPORT_SOCKET
+                                 : IPC_TRANSPORT_FIFO;
+        } else {
+            print_usage();
+            return strcmp(argv[i], "help") == 0 ? 0 : 1;
+        }
+    }
+
+    if (opts.updates < 1 || opts.max_bars < 1 || opts.max_bars > MAX_BARS) {
+        print_usage();
+        return 1;
+    }
+
+    // Bars that are killed while a FIFO is held open must not kill the bench
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-6s %-12s %12s %12s %12s\n", "bars", "backend", "us/update",
+           "syscalls", "writes");
+
+    for (int bars = 1; bars <= opts.max_bars; bars = next_bars(bars, &opts)) {
+        char dir[] = "/tmp/spotify-ipc-bench.XXXXXX";
+
+        if (mkdtemp(dir) == NULL || !start_bars(dir, &opts, bars, bar_pids)) {
+            fputs("ipc-bench: failed to start the fake bars\n", stderr);
+            return 1;
+        }
+
+        for (int backend = 0; backend < NUM_OF_BACKENDS; backend++) {
+            const int updates = backend_updates(&opts, backend);
+            long long elapsed_ns;
+            SyscallCount count;
+
+            if (!send_updates(dir, &opts, backend, &elapsed_ns)) {
+                printf("%-6d %-12s %12s\n", bars, BACKEND_NAMES[backend],
+                       "unavailable");
+                continue;
+            }
+
+            printf("%-6d %-12s %12.1f", bars, BACKEND_NAMES[backend],
+                   elapsed_ns / 1e3 / updates);
+
+            // Syscalls are per update, "writes" are the write() or
+            // io_uring_enter() calls among them
+            if (count_syscalls(dir, &opts, backend, &count)) {
+                printf(" %12.1f %12.1f\n", (double)count.total / updates,
+                       (double)count.submits / updates);
+            } else {
+                printf(" %12s %12s\n", "n/a", "n/a");
+            }
+        }
+
+        stop_bars(dir, bars, bar_pids);
+        rmdir(dir);
+    }
+
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include <dbus-1.0/dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/format.h"
+#include "../include/ipc-writer.h"
+#include "../include/log.h"
+#include "../include/mpris.h"
+#include "../include/polybar-ipc.h"
+#include "../include/snapshot.h"
+#include "../include/spotify-listener.h"
+#include "../include/utils.h"
+#include "spotify-signals.h"
+
+// Largest number of signals read from a trace
+#define MAX_SIGNALS 100000
+
+// Options and state of the listener, defined in spotify-listener.c
+extern long COALESCE_WINDOW_MS;
+extern dbus_bool_t PUSH_STATUS;
+extern dbus_bool_t IPC_USE_IO_URING;
+extern int STATUS_MAX_ARTIST_LENGTH;
+extern int STATUS_MAX_TITLE_LENGTH;
+extern int STATUS_MAX_LENGTH;
+extern const char *STATUS_FORMAT;
+extern const char *STATUS_TRUNC;
+extern StatusFormat status_format;
+extern TrackState current_track;
+
+// glibc's allocator, which the wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+// Number of allocations made by the process, including libdbus and the writer
+// and log threads of the listener
+static unsigned long allocs = 0;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/**
+ * Handle every signal like the dispatch loop of the listener does, closing the
+ * coalescing window after each one and waiting for the writer thread to
+ * deliver the update to the bar
+ *
+ * @returns long long The nanoseconds spent in the handlers, without waiting
+ *                    for the writer thread
+ */
+static long long handle_signals(DBusMessage *messages[], const size_t num) {
+    long long handler_ns = 0;
+
+    for (size_t m = 0; m < num; m++) {
+        const long long start = now_ns();
+
+        properties_changed_handler(NULL, messages[m], NULL);
+        coalesce_flush_due();
+
+        handler_ns += now_ns() - start;
+        ipc_writer_flush();
+    }
+
+    return handler_ns;
+}
+
+/**
+ * Replay the signals, first to warm up (i.e. open the FIFO, start the threads
+ * and set up libdbus' caches), then while counting allocations
+ *
+ * @returns int 0 if no allocation was made after the warm up, otherwise 1
+ */
+static int run(const char *name, DBusMessage *messages[], const size_t num,
+               const long passes) {
+    track_state_clear(&current_track);
+    handle_signals(messages, num);
+    log_flush();
+
+    long long handler_ns = 0;
+    const unsigned long start_allocs =
+        __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+
+    for (long p = 0; p < passes; p++)
+        handler_ns += handle_signals(messages, num);
+    log_flush();
+
+    const double ns = (double)handler_ns / passes / num;
+    const unsigned long run_allocs =
+        __atomic_load_n(&allocs, __ATOMIC_RELAXED) - start_allocs;
+
+    printf("%-24s %10zu %12.1f %12lu\n", name, num, ns, run_allocs);
+
+    return run_allocs != 0;
+}
+
+// print_usage() is the listener's
+static void print_bench_usage() {
+    puts("usage: listener-bench [options]");
+    puts("");
+    puts("  Feeds PropertiesChanged signals through the listener's");
+    puts("  properties_changed_handler() and coalesce_flush_due(), which update");
+    puts("  a fake bar and the status snapshot, and counts the heap allocations");
+    puts("  made after a warm up, including those of the writer thread. Fails");
+    puts("  if there are any. The time per signal does not include delivery.");
+    puts("");
+    puts("  Options:");
+    puts("    --trace FILE      Replay the signals of a trace recorded with");
+    puts("                      spotify-listener --record instead of made up");
+    puts("                      track changes, pauses and plays");
+    puts("    --passes N        Number of times every signal is replayed");
+    puts("                        Default: 20");
+}
+
+int main(int argc, char *argv[]) {
+    static DBusMessage *messages[MAX_SIGNALS];
+    char dir[] = "/tmp/listener-bench.XXXXXX";
+    char fifo_path[PATH_MAX];
+    const char *trace_path = NULL;
+    long passes = 20;
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+            passes = atol(argv[++i]);
+        } else {
+            print_bench_usage();
+            return strcmp(argv[i], "help") == 0 ? 0 : 1;
+        }
+    }
+
+    const size_t num = signals_load(trace_path, messages, MAX_SIGNALS);
+
+    if (num == 0 || passes < 1) {
+        fputs("listener-bench: no PropertiesChanged signals to replay\n",
+              stderr);
+        return 1;
+    }
+
+    // The bar and the snapshot of the listener live in a directory of our own
+    if (mkdtemp(dir) == NULL) {
+        fputs("listener-bench: failed to create a temporary directory\n",
+              stderr);
+        return 1;
+    }
+    setenv("XDG_RUNTIME_DIR", dir, 1);
+    snprintf(fifo_path, sizeof(fifo_path), "%s/polybar_mqueue.%d", dir,
+             (int)getpid());
+
+    // Opening a FIFO for reading and writing does not block, and keeps it
+    // readable until the reader is stopped
+    const int fifo_fd =
+        mkfifo(fifo_path, 0600) == 0 ? open(fifo_path, O_RDWR) : -1;
+    if (fifo_fd == -1) {
+        fputs("listener-bench: failed to create the bar's FIFO\n", stderr);
+        rmdir(dir);
+        return 1;
+    }
+
+    // Read every message as soon as it is sent, like polybar does
+    fflush(stdout);
+    const pid_t reader_pid = fork();
+    if (reader_pid == 0) {
+        char buf[IPC_MAX_MSG_LEN];
+
+        while (read(fifo_fd, buf, sizeof(buf)) != 0 || errno == EINTR)
+            ;
+        _exit(0);
+    }
+    close(fifo_fd);
+
+    // Every update is sent on its own, and only errors are logged so the
+    // records of the updates don't bury the results
+    COALESCE_WINDOW_MS = 0;
+    log_set_level(LOG_LEVEL_ERROR);
+    log_start();
+    format_compile(&status_format, STATUS_FORMAT, STATUS_MAX_ARTIST_LENGTH,
+                   STATUS_MAX_TITLE_LENGTH, STATUS_MAX_LENGTH, STATUS_TRUNC);
+    ipc_use_io_uring(IPC_USE_IO_URING);
+    ipc_endpoints_init(dir, NULL);
+    ipc_writer_start();
+    snapshot_writer_open();
+
+    printf("%-24s %10s %12s %12s\n", "listener", "signals", "ns/signal",
+           "allocs");
+
+    PUSH_STATUS = FALSE;
+    failed |= run("status hook", messages, num, passes);
+    PUSH_STATUS = TRUE;
+    failed |= run("pushed status", messages, num, passes);
+
+    if (failed)
+        puts("listener-bench: the listener allocated memory after warming up");
+
+    ipc_writer_stop();
+    log_stop();
+    snapshot_writer_close();
+    ipc_endpoints_free();
+    format_free(&status_format);
+    ipc_use_io_uring(FALSE);
+
+    kill(reader_pid, SIGTERM);
+    waitpid(reader_pid, NULL, 0);
+    unlink(fifo_path);
+    rmdir(dir);
+
+    for (size_t m = 0; m < num; m++) dbus_message_unref(messages[m]);
+
+    return failed;
+}
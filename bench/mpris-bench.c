@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/mpris.h"
+#include "../include/utils.h"
+#include "baseline-iter.h"
+#include "spotify-signals.h"
+
+// Largest number of signals read from a trace
+#define MAX_SIGNALS 100000
+
+static const char *PLAYER_INTERFACE = "org.mpris.MediaPlayer2.Player";
+
+/**
+ * What the listener needs from a signal: the track ID, if it is spotify's,
+ * and the playback status
+ */
+typedef struct {
+    char trackid[TRACK_ID_SIZE];
+    char status[TRACK_STATUS_SIZE];
+} Decoded;
+
+typedef dbus_bool_t (*DecodeFunc)(DBusMessage *message, Decoded *decoded);
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/**
+ * Decode a signal like properties_changed_handler() did before the single pass
+ * decoder: walk the changed properties once for Metadata and the track ID,
+ * once more if it is not there, and once more for PlaybackStatus, copying
+ * every string
+ */
+static dbus_bool_t decode_baseline(DBusMessage *message, Decoded *decoded) {
+    DBusMessageIter iter;
+    DBusMessageIter sub_iter;
+
+    decoded->trackid[0] = '\0';
+    decoded->status[0] = '\0';
+    dbus_message_iter_init(message, &iter);
+
+    char *interface_name = baseline_iter_get_string(&iter);
+
+    if (interface_name != NULL &&
+        strcmp(interface_name, PLAYER_INTERFACE) != 0) {
+        free(interface_name);
+        return FALSE;
+    }
+    free(interface_name);
+
+    dbus_message_iter_next(&iter);
+
+    if (!(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
+          baseline_iter_try_step_to_key(&sub_iter, "Metadata") &&
+          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
+          baseline_iter_try_step_into_signature(&sub_iter, "a{sv}") &&
+          baseline_iter_try_step_to_key(&sub_iter, "mpris:trackid") &&
+          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
+          dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING) &&
+        !(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
+          baseline_iter_try_step_to_key(&sub_iter, "PlaybackStatus") &&
+          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
+          dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING)) {
+        return FALSE;
+    }
+
+    char *trackid = baseline_iter_get_string(&sub_iter);
+    if (trackid != NULL && strncmp(trackid, "/com/spotify", 12) == 0)
+        snprintf(decoded->trackid, TRACK_ID_SIZE, "%s", trackid);
+    free(trackid);
+
+    if (!(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
+          baseline_iter_try_step_to_key(&sub_iter, "PlaybackStatus") &&
+          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
+          dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING)) {
+        return FALSE;
+    }
+
+    char *status = baseline_iter_get_string(&sub_iter);
+    snprintf(decoded->status, TRACK_STATUS_SIZE, "%s", status);
+    free(status);
+
+    return TRUE;
+}
+
+/**
+ * Step a copy of the changed properties to the value of a Metadata key, the
+ * way the handler had to before the single pass decoder to read one more field
+ */
+static dbus_bool_t baseline_metadata_value(DBusMessageIter *changed_iter,
+                                           const char *key,
+                                           DBusMessageIter *value_iter) {
+    return recurse_iter_of_type(changed_iter, value_iter, DBUS_TYPE_ARRAY) &&
+           baseline_iter_try_step_to_key(value_iter, "Metadata") &&
+           iter_try_step_into_type(value_iter, DBUS_TYPE_VARIANT) &&
+           baseline_iter_try_step_into_signature(value_iter, "a{sv}") &&
+           baseline_iter_try_step_to_key(value_iter, key) &&
+           iter_try_step_into_type(value_iter, DBUS_TYPE_VARIANT);
+}
+
+/**
+ * Decode the same fields as mpris_decode_properties() with the handler's walks
+ * before the single pass decoder, one walk and one malloc'd copy per field
+ */
+static dbus_bool_t decode_baseline_fields(DBusMessage *message,
+                                          Decoded *decoded) {
+    static const char *STRING_KEYS[] = {"xesam:title", "xesam:album",
+                                        "mpris:artUrl"};
+    DBusMessageIter iter;
+    DBusMessageIter value_iter;
+    DBusMessageIter artist_iter;
+    DBusBasicValue value;
+
+    if (!decode_baseline(message, decoded)) return FALSE;
+
+    dbus_message_iter_init(message, &iter);
+    dbus_message_iter_next(&iter);
+
+    for (size_t k = 0; k < sizeof(STRING_KEYS) / sizeof(STRING_KEYS[0]); k++) {
+        if (baseline_metadata_value(&iter, STRING_KEYS[k], &value_iter))
+            free(baseline_iter_get_string(&value_iter));
+    }
+
+    if (baseline_metadata_value(&iter, "xesam:artist", &value_iter) &&
+        baseline_recurse_iter_of_signature(&value_iter, &artist_iter, "as")) {
+        while (dbus_message_iter_get_arg_type(&artist_iter) ==
+               DBUS_TYPE_STRING) {
+            free(baseline_iter_get_string(&artist_iter));
+            dbus_message_iter_next(&artist_iter);
+        }
+    }
+
+    if (baseline_metadata_value(&iter, "mpris:length", &value_iter) &&
+        dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_UINT64)
+        dbus_message_iter_get_basic(&value_iter, &value);
+
+    if (baseline_metadata_value(&iter, "xesam:trackNumber", &value_iter) &&
+        dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_INT32)
+        dbus_message_iter_get_basic(&value_iter, &value);
+
+    return TRUE;
+}
+
+/**
+ * Decode a signal like properties_changed_handler() does now, in a single
+ * walk of the changed properties into a TrackState
+ */
+static dbus_bool_t decode_single_pass(DBusMessage *message,
+                                      Decoded *decoded) {
+    DBusMessageIter iter;
+    StringView interface_name;
+    TrackState track;
+
+    decoded->trackid[0] = '\0';
+    decoded->status[0] = '\0';
+    dbus_message_iter_init(message, &iter);
+
+    if (iter_get_string_view(&iter, &interface_name) &&
+        !string_view_equals(&interface_name, PLAYER_INTERFACE))
+        return FALSE;
+
+    dbus_message_iter_next(&iter);
+
+    track_state_clear(&track);
+    if (!mpris_decode_properties(&iter, &track) ||
+        !(track.fields & (TRACK_HAS_TRACKID | TRACK_HAS_STATUS)))
+        return FALSE;
+
+    if ((track.fields & TRACK_HAS_TRACKID) &&
+        strncmp(track.trackid, "/com/spotify", 12) == 0)
+        strcpy(decoded->trackid, track.trackid);
+    if (track.fields & TRACK_HAS_STATUS)
+        strcpy(decoded->status, track.status);
+
+    return TRUE;
+}
+
+/**
+ * Check that both decoders agree on every signal they both decode
+ */
+static int check(DBusMessage *messages[], const size_t num) {
+    size_t decoded = 0;
+
+    for (size_t m = 0; m < num; m++) {
+        Decoded baseline;
+        Decoded single_pass;
+
+        if (!decode_baseline(messages[m], &baseline)) continue;
+
+        if (!decode_single_pass(messages[m], &single_pass) ||
+            strcmp(baseline.trackid, single_pass.trackid) != 0 ||
+            strcmp(baseline.status, single_pass.status) != 0) {
+            printf("mpris-bench: decoders disagree on signal %zu\n", m);
+            return 1;
+        }
+
+        decoded++;
+    }
+
+    if (decoded == 0) {
+        puts("mpris-bench: no signal has a track ID or status");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Make up a track change to a track that has no album, art URL, length or
+ * track number, which spotify sends for local files
+ */
+static DBusMessage *new_track_without_album() {
+    const char *interface = PLAYER_INTERFACE;
+    const char *metadata_key = "Metadata";
+    const char *trackid = "/com/spotify/local/Eminem/Stan.mp3";
+    const char *title = "Stan";
+    DBusMessageIter iter;
+    DBusMessageIter changed_iter;
+    DBusMessageIter entry_iter;
+    DBusMessageIter variant_iter;
+    DBusMessageIter metadata_iter;
+    DBusMessageIter invalidated_iter;
+
+    DBusMessage *msg = dbus_message_new_signal(
+        "/org/mpris/MediaPlayer2", DBUS_INTERFACE_PROPERTIES,
+        "PropertiesChanged");
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &changed_iter);
+    dbus_message_iter_open_container(&changed_iter, DBUS_TYPE_DICT_ENTRY,
+                                     NULL, &entry_iter);
+    dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+                                   &metadata_key);
+    dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, "a{sv}",
+                                     &variant_iter);
+    dbus_message_iter_open_container(&variant_iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &metadata_iter);
+    signals_append_entry(&metadata_iter, "mpris:trackid", DBUS_TYPE_STRING,
+                         &trackid);
+    signals_append_strings(&metadata_iter, "xesam:artist", "Eminem");
+    signals_append_entry(&metadata_iter, "xesam:title", DBUS_TYPE_STRING,
+                         &title);
+    dbus_message_iter_close_container(&variant_iter, &metadata_iter);
+    dbus_message_iter_close_container(&entry_iter, &variant_iter);
+    dbus_message_iter_close_container(&changed_iter, &entry_iter);
+    dbus_message_iter_close_container(&iter, &changed_iter);
+
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+                                     &invalidated_iter);
+    dbus_message_iter_close_container(&iter, &invalidated_iter);
+
+    return msg;
+}
+
+/**
+ * Decode the changed properties of a signal and merge them into track like
+ * properties_changed_handler() does
+ */
+static void merge_signal(DBusMessage *message, TrackState *track) {
+    DBusMessageIter iter;
+    TrackState changed;
+
+    dbus_message_iter_init(message, &iter);
+    dbus_message_iter_next(&iter);
+
+    track_state_clear(&changed);
+    mpris_decode_properties(&iter, &changed);
+    track_state_merge(track, &changed);
+}
+
+/**
+ * Check that a new Metadata dictionary replaces the one of the previous track
+ * rather than being merged into it, while the status is kept
+ */
+static int check_merge() {
+    const unsigned int stale_fields = TRACK_HAS_ALBUM | TRACK_HAS_ART_URL |
+                                      TRACK_HAS_LENGTH | TRACK_HAS_TRACKNUMBER;
+    DBusMessage *first = signals_new_properties_changed(0, "Playing");
+    DBusMessage *second = new_track_without_album();
+    TrackState track;
+    int failed = 0;
+
+    track_state_clear(&track);
+    merge_signal(first, &track);
+    failed |= (track.fields & stale_fields) != stale_fields;
+
+    merge_signal(second, &track);
+    failed |= (track.fields & stale_fields) != 0;
+    failed |= track.album[0] != '\0' || track.art_url[0] != '\0' ||
+              track.length != 0 || track.tracknumber != 0;
+    failed |= strcmp(track.title, "Stan") != 0 ||
+              strcmp(track.artists, "Eminem") != 0;
+    failed |= !(track.fields & TRACK_HAS_STATUS) ||
+              strcmp(track.status, "Playing") != 0;
+
+    if (failed)
+        puts("mpris-bench: a track kept the metadata of the one before it");
+
+    dbus_message_unref(first);
+    dbus_message_unref(second);
+
+    return failed;
+}
+
+static double run(DecodeFunc decode, DBusMessage *messages[], const size_t num,
+                  const long passes) {
+    Decoded decoded;
+
+    // Warm up
+    for (size_t m = 0; m < num; m++) decode(messages[m], &decoded);
+
+    const long long start = now_ns();
+
+    for (long p = 0; p < passes; p++) {
+        for (size_t m = 0; m < num; m++) decode(messages[m], &decoded);
+    }
+
+    return (double)(now_ns() - start) / passes / num;
+}
+
+static void print_usage() {
+    puts("usage: mpris-bench [options]");
+    puts("");
+    puts("  Decodes PropertiesChanged signals with the handler's walks before");
+    puts("  the single pass decoder (malloc'd copies, formatted signatures),");
+    puts("  both for the track ID and status only and for every field of a");
+    puts("  TrackState, and with mpris_decode_properties(), and reports");
+    puts("  nanoseconds per signal.");
+    puts("");
+    puts("  Options:");
+    puts("    --trace FILE      Decode the signals of a trace recorded with");
+    puts("                      spotify-listener --record instead of made up");
+    puts("                      track changes, pauses and plays");
+    puts("    --passes N        Number of times every signal is decoded");
+    puts("                        Default: 2000");
+}
+
+int main(int argc, char *argv[]) {
+    static DBusMessage *messages[MAX_SIGNALS];
+    const char *trace_path = NULL;
+    long passes = 2000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+            passes = atol(argv[++i]);
+        } else {
+            print_usage();
+            return strcmp(argv[i], "help") == 0 ? 0 : 1;
+        }
+    }
+
+    const size_t num = signals_load(trace_path, messages, MAX_SIGNALS);
+
+    if (num == 0 || passes < 1) {
+        fputs("mpris-bench: no PropertiesChanged signals to decode\n", stderr);
+        return 1;
+    }
+
+    if (check(messages, num) || check_merge()) return 1;
+
+    const double baseline_ns = run(decode_baseline, messages, num, passes);
+    const double fields_ns = run(decode_baseline_fields, messages, num, passes);
+    const double single_pass_ns =
+        run(decode_single_pass, messages, num, passes);
+
+    // The handler used to read only the track ID and status, so the single
+    // pass, which reads every field of a TrackState, is compared with walks
+    // reading the same fields too
+    printf("%-28s %10s %12s %10s\n", "decoder", "signals", "ns/signal",
+           "vs 1 pass");
+    printf("%-28s %10zu %12.1f %9.2fx\n", "baseline, trackid + status",
+           num, baseline_ns, baseline_ns / single_pass_ns);
+    printf("%-28s %10zu %12.1f %9.2fx\n", "baseline, same 7 fields", num,
+           fields_ns, fields_ns / single_pass_ns);
+    printf("%-28s %10zu %12.1f %9.2fx\n", "mpris single pass", num,
+           single_pass_ns, 1.0);
+
+    for (size_t m = 0; m < num; m++) dbus_message_unref(messages[m]);
+
+    return 0;
+}
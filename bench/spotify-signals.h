@@ -0,0 +1,183 @@
+#ifndef _SPOTIFY_SIGNALS_H_
+#define _SPOTIFY_SIGNALS_H_
+
+/**
+ * PropertiesChanged signals of spotify for benchmarks to replay, either read
+ * from a trace recorded with spotify-listener --record, or made up like the
+ * ones spotify sends: the whole Metadata dictionary along with PlaybackStatus
+ * on every track change, pause and play.
+ */
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/trace.h"
+
+// Tracks made up when no trace is given, each with a change, pause and play
+#define SPOTIFY_SIGNALS_TRACKS 64
+
+static inline void signals_append_entry(DBusMessageIter *dict_iter,
+                                        const char *key, const int type,
+                                        const void *value) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter variant_iter;
+    const char signature[2] = {(char)type, '\0'};
+
+    dbus_message_iter_open_container(dict_iter, DBUS_TYPE_DICT_ENTRY, NULL,
+                                     &entry_iter);
+    dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, signature,
+                                     &variant_iter);
+    dbus_message_iter_append_basic(&variant_iter, type, value);
+    dbus_message_iter_close_container(&entry_iter, &variant_iter);
+    dbus_message_iter_close_container(dict_iter, &entry_iter);
+}
+
+static inline void signals_append_strings(DBusMessageIter *dict_iter,
+                                          const char *key, const char *value) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter variant_iter;
+    DBusMessageIter array_iter;
+
+    dbus_message_iter_open_container(dict_iter, DBUS_TYPE_DICT_ENTRY, NULL,
+                                     &entry_iter);
+    dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, "as",
+                                     &variant_iter);
+    dbus_message_iter_open_container(&variant_iter, DBUS_TYPE_ARRAY, "s",
+                                     &array_iter);
+    dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_STRING, &value);
+    dbus_message_iter_close_container(&variant_iter, &array_iter);
+    dbus_message_iter_close_container(&entry_iter, &variant_iter);
+    dbus_message_iter_close_container(dict_iter, &entry_iter);
+}
+
+/**
+ * Make up the PropertiesChanged signal spotify sends for a track
+ */
+static inline DBusMessage *signals_new_properties_changed(const int track,
+                                                          const char *status) {
+    const char *interface = "org.mpris.MediaPlayer2.Player";
+    char trackid[64];
+    char title[64];
+    char url[64];
+    const char *trackid_ptr = trackid;
+    const char *title_ptr = title;
+    const char *url_ptr = url;
+    const char *art_url = "https://i.scdn.co/image/ab67616d0000b273";
+    const char *album = "The Eminem Show";
+    const dbus_uint64_t length = 216000000 + track;
+    const double rating = 0.5;
+    const dbus_int32_t disc = 1;
+    const dbus_int32_t number = track + 1;
+    DBusMessageIter iter;
+    DBusMessageIter changed_iter;
+    DBusMessageIter entry_iter;
+    DBusMessageIter variant_iter;
+    DBusMessageIter metadata_iter;
+    DBusMessageIter invalidated_iter;
+
+    snprintf(trackid, sizeof(trackid), "/com/spotify/track/%022d", track);
+    snprintf(title, sizeof(title), "Sing For The Moment (Take %d)", track);
+    snprintf(url, sizeof(url), "https://open.spotify.com/track/%022d", track);
+
+    DBusMessage *msg = dbus_message_new_signal(
+        "/org/mpris/MediaPlayer2", DBUS_INTERFACE_PROPERTIES,
+        "PropertiesChanged");
+    dbus_message_set_sender(msg, ":1.42");
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &changed_iter);
+
+    dbus_message_iter_open_container(&changed_iter, DBUS_TYPE_DICT_ENTRY,
+                                     NULL, &entry_iter);
+    const char *metadata_key = "Metadata";
+    dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+                                   &metadata_key);
+    dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, "a{sv}",
+                                     &variant_iter);
+    dbus_message_iter_open_container(&variant_iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &metadata_iter);
+    signals_append_entry(&metadata_iter, "mpris:trackid", DBUS_TYPE_STRING,
+                         &trackid_ptr);
+    signals_append_entry(&metadata_iter, "mpris:length", DBUS_TYPE_UINT64,
+                         &length);
+    signals_append_entry(&metadata_iter, "mpris:artUrl", DBUS_TYPE_STRING,
+                         &art_url);
+    signals_append_entry(&metadata_iter, "xesam:album", DBUS_TYPE_STRING,
+                         &album);
+    signals_append_strings(&metadata_iter, "xesam:albumArtist", "Eminem");
+    signals_append_strings(&metadata_iter, "xesam:artist", "Eminem");
+    signals_append_entry(&metadata_iter, "xesam:autoRating", DBUS_TYPE_DOUBLE,
+                         &rating);
+    signals_append_entry(&metadata_iter, "xesam:discNumber", DBUS_TYPE_INT32,
+                         &disc);
+    signals_append_entry(&metadata_iter, "xesam:title", DBUS_TYPE_STRING,
+                         &title_ptr);
+    signals_append_entry(&metadata_iter, "xesam:trackNumber", DBUS_TYPE_INT32,
+                         &number);
+    signals_append_entry(&metadata_iter, "xesam:url", DBUS_TYPE_STRING,
+                         &url_ptr);
+    dbus_message_iter_close_container(&variant_iter, &metadata_iter);
+    dbus_message_iter_close_container(&entry_iter, &variant_iter);
+    dbus_message_iter_close_container(&changed_iter, &entry_iter);
+
+    signals_append_entry(&changed_iter, "PlaybackStatus", DBUS_TYPE_STRING,
+                         &status);
+    dbus_message_iter_close_container(&iter, &changed_iter);
+
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+                                     &invalidated_iter);
+    dbus_message_iter_close_container(&iter, &invalidated_iter);
+
+    return msg;
+}
+
+/**
+ * Get the PropertiesChanged signals of a trace, or make some up
+ *
+ * @param const char* trace_path A trace recorded with --record, or NULL to
+ *                               make up a track change, pause and play for
+ *                               SPOTIFY_SIGNALS_TRACKS tracks
+ * @param DBusMessage** messages Set to the signals, which must be unreffed
+ * @param size_t max The size of messages
+ *
+ * @returns size_t The number of signals, 0 if the trace could not be read
+ */
+static inline size_t signals_load(const char *trace_path,
+                                  DBusMessage *messages[], const size_t max) {
+    static const char *STATUSES[] = {"Playing", "Paused", "Playing"};
+    TraceReader reader;
+    DBusMessage *msg;
+    long long time_us;
+    size_t num = 0;
+
+    if (trace_path == NULL) {
+        for (int t = 0; t < SPOTIFY_SIGNALS_TRACKS; t++) {
+            for (int s = 0; s < 3 && num < max; s++) {
+                messages[num++] =
+                    signals_new_properties_changed(t, STATUSES[s]);
+            }
+        }
+        return num;
+    }
+
+    if (!trace_reader_open(&reader, trace_path)) return 0;
+
+    while (num < max && (msg = trace_reader_next(&reader, &time_us)) != NULL) {
+        if (dbus_message_is_signal(msg, DBUS_INTERFACE_PROPERTIES,
+                                   "PropertiesChanged"))
+            messages[num++] = msg;
+        else
+            dbus_message_unref(msg);
+    }
+
+    trace_reader_close(&reader);
+
+    return num;
+}
+
+#endif
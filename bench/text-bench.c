@@ -0,0 +1,184 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/format.h"
+#include "../include/mpris.h"
+#include "../include/text.h"
+#include "../include/utils.h"
+#include "baseline-format.h"
+
+typedef struct {
+    const char *name;
+    const char *text;
+} Corpus;
+
+// Track titles and artists in the scripts seen in the wild
+static const Corpus CORPORA[] = {
+    {"ascii", "Sing For The Moment - Eminem, Dido, Rihanna (Remastered 2009)"},
+    {"latin", "Beyoncé, Sigur Rós - Déjà Vu (Café del Mar Señorita Mix) ÆØÅ"},
+    {"combining", "Cafe\xcc\x81 Ro\xcc\x81s Ze\xcc\x81ro n\xcc\x83 "
+                  "a\xcc\x8a\xcc\x81 Spın\xcc\x88" "al Tap"},
+    {"cyrillic", "Кино - Группа крови (Виктор Цой), Земфира - Искала"},
+    {"arabic", "فَيْرُوز - كِيفَك إنْتَ، عمرو دياب - تملي معاك"},
+    {"cjk", "米津玄師 - Lemon、宇多田ヒカル - 花束を君に、周杰倫 - 晴天"},
+    {"hangul", "방탄소년단 - 봄날 (Spring Day), 아이유 - 좋은 날"},
+    {"emoji", "🔥 Lit 🔥 Party Mix 🎉🎶 👍🏽 👨‍👩‍👧 ❤️ Love 💯"},
+    {"mixed", "Dua Lipa × BLACKPINK - Kiss and Make Up 💋 (키스) 接吻 Поцелуй "
+              "قبلة Bésame"},
+};
+
+static const size_t NUM_OF_CORPORA = sizeof(CORPORA) / sizeof(CORPORA[0]);
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static int fail(const char *corpus, const char *check, const int width) {
+    printf("%-12s FAILED: %s (width %d)\n", corpus, check, width);
+    return 1;
+}
+
+/**
+ * Check that every cut of the corpus ends on a character boundary, fits in
+ * its width, is as long as possible, and that the index agrees with a scan
+ */
+static int check_cuts(const Corpus *corpus, const TextIndex *index) {
+    const char *str = corpus->text;
+    const size_t len = strlen(str);
+    const int width = utf8_width(str, len);
+
+    if (index->width != width)
+        return fail(corpus->name, "index width", index->width);
+
+    for (int w = -1; w <= width + 2; w++) {
+        const TextCut cut = utf8_cut(str, len, w);
+        const TextCut indexed = text_index_cut(index, w);
+
+        if (cut.len != indexed.len || cut.width != indexed.width)
+            return fail(corpus->name, "index disagrees with scan", w);
+        if (cut.len < len && (str[cut.len] & 0xC0) == 0x80)
+            return fail(corpus->name, "cut splits a character", w);
+        if (cut.width > w && w >= 0)
+            return fail(corpus->name, "cut wider than max", w);
+        if (cut.width != utf8_width(str, cut.len))
+            return fail(corpus->name, "cut width", w);
+
+        if (cut.len < len && w >= 0) {
+            // The next character must not fit
+            size_t next = 1;
+            while (cut.len + next < len &&
+                   (str[cut.len + next] & 0xC0) == 0x80)
+                next++;
+
+            if (cut.width + utf8_width(str + cut.len, next) <= w)
+                return fail(corpus->name, "cut not maximal", w);
+        }
+    }
+
+    for (int w = 1; w <= width + 2; w++) {
+        char *trunc = str_trunc(str, w, "…");
+
+        if (trunc == NULL) return fail(corpus->name, "str_trunc", w);
+        if (utf8_width(trunc, strlen(trunc)) > w) {
+            free(trunc);
+            return fail(corpus->name, "str_trunc wider than max", w);
+        }
+        free(trunc);
+    }
+
+    return 0;
+}
+
+/**
+ * Check that a status rendered from the corpus fits in every max length, both
+ * with the indexes left in the cache by the previous corpus and with its own
+ */
+static int check_render(const Corpus *corpus) {
+    static FormatCache cache;
+    StatusFormat fmt;
+    TrackState track;
+    char output[FORMAT_OUTPUT_SIZE];
+
+    track_state_clear(&track);
+    strncpy(track.artists, corpus->text, TRACK_TEXT_SIZE - 1);
+    strncpy(track.title, corpus->text, TRACK_TEXT_SIZE - 1);
+    track.fields = TRACK_HAS_ARTISTS | TRACK_HAS_TITLE;
+
+    for (int w = 3; w <= 80; w++) {
+        if (!format_compile(&fmt, "%artist%: %title%", 20, 20, w, "..."))
+            return fail(corpus->name, "format_compile", w);
+
+        const size_t len =
+            format_render(&fmt, &track, &cache, output, sizeof(output));
+        char *expected = baseline_format_output(
+            track.artists, track.title, 20, 20, w, "%artist%: %title%", "...");
+        const int matches = strcmp(expected, output) == 0;
+
+        free(expected);
+        format_free(&fmt);
+
+        if (!matches)
+            return fail(corpus->name, "format_render != baseline", w);
+        if (utf8_width(output, len) > w)
+            return fail(corpus->name, "render wider than max", w);
+    }
+
+    return 0;
+}
+
+static int run_corpus(const Corpus *corpus, const long iterations) {
+    static TextIndex index;
+    const char *str = corpus->text;
+    const size_t len = strlen(str);
+    const int width = utf8_width(str, len);
+    volatile size_t sink = 0;
+
+    text_index_build(&index, str, len);
+
+    if (check_cuts(corpus, &index) || check_render(corpus)) return 1;
+
+    long long start = now_ns();
+    for (long i = 0; i < iterations; i++) sink += utf8_width(str, len);
+    const double width_ns = (double)(now_ns() - start) / iterations;
+
+    // Cut to every width, like truncating for bars of different sizes
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        sink += utf8_cut(str, len, i % (width + 1)).len;
+    const double scan_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) text_index_build(&index, str, len);
+    const double build_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        sink += text_index_cut(&index, i % (width + 1)).len;
+    const double index_ns = (double)(now_ns() - start) / iterations;
+
+    printf("%-12s %5zu %5d %10.1f %10.1f %10.1f %10.1f %8.1fx\n", corpus->name,
+           len, width, width_ns, scan_ns, build_ns, index_ns,
+           scan_ns / index_ns);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    int failed = 0;
+
+    printf("%-12s %5s %5s %10s %10s %10s %10s %9s\n", "corpus", "bytes", "cols",
+           "width ns", "scan ns", "build ns", "index ns", "speedup");
+
+    for (size_t c = 0; c < NUM_OF_CORPORA; c++)
+        failed |= run_corpus(&CORPORA[c], iterations);
+
+    return failed;
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/utils.h"
+#include "baseline-iter.h"
+
+// Sizes of the dicts keys are looked up in, from a short Metadata dictionary
+// to one with many custom keys
+static const int DICT_SIZES[] = {4, 16, 64, 256};
+#define NUM_OF_DICT_SIZES (sizeof(DICT_SIZES) / sizeof(DICT_SIZES[0]))
+
+// glibc's allocator, which the wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+// Number of allocations made by the process, including libdbus
+static unsigned long allocs = 0;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+typedef struct {
+    const char *str;
+    const char *find;
+    const char *repl;
+    int max_len;
+    const char *trunc;
+    DBusMessage *msg;
+    const char *key;
+} BenchArgs;
+
+typedef void (*BenchFunc)(const BenchArgs *args);
+
+static long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static char *repeat(const char *str, const int times) {
+    const size_t len = strlen(str);
+    char *res = calloc(len * times + 1, sizeof(char));
+
+    for (int i = 0; i < times; i++) memcpy(res + i * len, str, len);
+
+    return res;
+}
+
+static void run(const char *name, BenchFunc func, const BenchArgs *args,
+                const long iterations) {
+    // Warm up
+    func(args);
+
+    const unsigned long start_allocs = allocs;
+    const long long start = now_ns();
+
+    for (long i = 0; i < iterations; i++) func(args);
+
+    const double ns = (double)(now_ns() - start) / iterations;
+    const double allocs_per_op = (double)(allocs - start_allocs) / iterations;
+
+    printf("%-40s %12.1f %12.2f\n", name, ns, allocs_per_op);
+}
+
+static void bench_str_replace_all(const BenchArgs *args) {
+    free(str_replace_all(args->str, args->find, args->repl));
+}
+
+static void bench_str_trunc(const BenchArgs *args) {
+    free(str_trunc(args->str, args->max_len, args->trunc));
+}
+
+static void bench_num_of_matches(const BenchArgs *args) {
+    volatile int n = num_of_matches(args->str, args->find);
+    (void)n;
+}
+
+static void bench_join_path(const BenchArgs *args) {
+    free(join_path(args->str, args->find));
+}
+
+/**
+ * Initialize iter at the first entry of the a{sv} dict in args->msg
+ */
+static void init_dict_iter(const BenchArgs *args, DBusMessageIter *iter) {
+    DBusMessageIter msg_iter;
+
+    dbus_message_iter_init(args->msg, &msg_iter);
+    dbus_message_iter_recurse(&msg_iter, iter);
+}
+
+static void bench_iter_go_to_key(const BenchArgs *args) {
+    DBusMessageIter element_iter;
+    DBusMessageIter entry_iter;
+
+    init_dict_iter(args, &element_iter);
+    iter_go_to_key(&element_iter, &entry_iter, args->key);
+}
+
+static void bench_baseline_iter_go_to_key(const BenchArgs *args) {
+    DBusMessageIter element_iter;
+    DBusMessageIter entry_iter;
+
+    init_dict_iter(args, &element_iter);
+    baseline_iter_go_to_key(&element_iter, &entry_iter, args->key);
+}
+
+static void bench_recurse_iter_of_signature(const BenchArgs *args) {
+    DBusMessageIter iter;
+    DBusMessageIter element_iter;
+
+    dbus_message_iter_init(args->msg, &iter);
+    recurse_iter_of_signature(&iter, &element_iter, "a{sv}");
+}
+
+static void bench_baseline_recurse_iter_of_signature(const BenchArgs *args) {
+    DBusMessageIter iter;
+    DBusMessageIter element_iter;
+
+    dbus_message_iter_init(args->msg, &iter);
+    baseline_recurse_iter_of_signature(&iter, &element_iter, "a{sv}");
+}
+
+static void bench_iter_get_string(const BenchArgs *args) {
+    DBusMessageIter element_iter;
+    DBusMessageIter entry_iter;
+    DBusMessageIter value_iter;
+
+    init_dict_iter(args, &element_iter);
+    iter_go_to_key(&element_iter, &entry_iter, args->key);
+    dbus_message_iter_recurse(&entry_iter, &value_iter);
+    free(iter_get_string(&value_iter));
+}
+
+/**
+ * Build a message with a single a{sv} dict of num_of_entries string entries
+ * with the keys key0, key1, ..., and value as every value
+ */
+static DBusMessage *new_dict_message(const int num_of_entries,
+                                     const char *value) {
+    DBusMessage *msg = dbus_message_new_signal(
+        "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties",
+        "PropertiesChanged");
+    DBusMessageIter iter;
+    DBusMessageIter dict_iter;
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &dict_iter);
+
+    for (int i = 0; i < num_of_entries; i++) {
+        DBusMessageIter entry_iter;
+        DBusMessageIter variant_iter;
+        char key[32];
+        const char *key_ptr = key;
+
+        snprintf(key, sizeof(key), "key%d", i);
+
+        dbus_message_iter_open_container(&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry_iter);
+        dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+                                       &key_ptr);
+        dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, "s",
+                                         &variant_iter);
+        dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_STRING,
+                                       &value);
+        dbus_message_iter_close_container(&entry_iter, &variant_iter);
+        dbus_message_iter_close_container(&dict_iter, &entry_iter);
+    }
+
+    dbus_message_iter_close_container(&iter, &dict_iter);
+
+    return msg;
+}
+
+/**
+ * Check the helpers against known outputs before timing them
+ */
+static int check(DBusMessage *dict) {
+    int failed = 0;
+    char *res;
+    DBusMessageIter element_iter;
+    DBusMessageIter entry_iter;
+    DBusMessageIter value_iter;
+    const BenchArgs args = {.msg = dict};
+
+    res = str_replace_all("%artist%: %title% %title%", "%title%", "x");
+    failed |= strcmp(res, "%artist%: x x") != 0;
+    free(res);
+
+    res = str_replace_all("%artist%", "%title%", "x");
+    failed |= strcmp(res, "%artist%") != 0;
+    free(res);
+
+    res = str_trunc("Sing For The Moment", 10, "...");
+    failed |= strcmp(res, "Sing Fo...") != 0;
+    free(res);
+
+    failed |= num_of_matches("%a% %a%%a%", "%a%") != 3;
+
+    res = join_path("/tmp", "polybar_mqueue.1");
+    failed |= strcmp(res, "/tmp/polybar_mqueue.1") != 0;
+    free(res);
+
+    res = join_path("/tmp/", "polybar_mqueue.1");
+    failed |= strcmp(res, "/tmp/polybar_mqueue.1") != 0;
+    free(res);
+
+    init_dict_iter(&args, &element_iter);
+    failed |= !iter_go_to_key(&element_iter, &entry_iter, "key7");
+    dbus_message_iter_recurse(&entry_iter, &value_iter);
+    res = iter_get_string(&value_iter);
+    failed |= res == NULL || strcmp(res, "Value") != 0;
+    free(res);
+
+    init_dict_iter(&args, &element_iter);
+    failed |= iter_go_to_key(&element_iter, &entry_iter, "missing");
+
+    if (failed) puts("utils-bench: helpers returned unexpected results");
+
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const long iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+    char *long_title = repeat("A Very Long Track Title ", 20);
+    char *cjk_title = repeat("花束を君に 周杰倫 晴天 ", 20);
+    char *many_tokens = repeat("%artist% - %title% | ", 50);
+    char *long_format = repeat("Some literal text without any tokens. ", 20);
+
+    DBusMessage *small_dict = new_dict_message(8, "Value");
+    DBusMessage *large_dict = new_dict_message(256, long_title);
+    DBusMessage *huge_dict = new_dict_message(4096, "Value");
+
+    if (check(small_dict)) return 1;
+
+    printf("%-40s %12s %12s\n", "benchmark", "ns/op", "allocs/op");
+
+    run("str_replace_all default",
+        bench_str_replace_all,
+        &(BenchArgs){.str = "%artist%: %title%", .find = "%artist%",
+                     .repl = "Eminem"},
+        iterations);
+    run("str_replace_all long title",
+        bench_str_replace_all,
+        &(BenchArgs){.str = "%artist%: %title%", .find = "%title%",
+                     .repl = long_title},
+        iterations);
+    run("str_replace_all many tokens",
+        bench_str_replace_all,
+        &(BenchArgs){.str = many_tokens, .find = "%title%",
+                     .repl = "Sing For The Moment"},
+        iterations / 10);
+    run("str_replace_all no match",
+        bench_str_replace_all,
+        &(BenchArgs){.str = long_format, .find = "%title%", .repl = ""},
+        iterations);
+
+    run("str_trunc short",
+        bench_str_trunc,
+        &(BenchArgs){.str = "Sing For The Moment", .max_len = 10,
+                     .trunc = "..."},
+        iterations);
+    run("str_trunc long title",
+        bench_str_trunc,
+        &(BenchArgs){.str = long_title, .max_len = 40, .trunc = "..."},
+        iterations);
+    run("str_trunc long title untruncated",
+        bench_str_trunc,
+        &(BenchArgs){.str = long_title, .max_len = 1000, .trunc = "..."},
+        iterations);
+    run("str_trunc cjk title",
+        bench_str_trunc,
+        &(BenchArgs){.str = cjk_title, .max_len = 40, .trunc = "…"},
+        iterations);
+
+    run("num_of_matches default",
+        bench_num_of_matches,
+        &(BenchArgs){.str = "%artist%: %title%", .find = "%artist%"},
+        iterations);
+    run("num_of_matches many tokens",
+        bench_num_of_matches,
+        &(BenchArgs){.str = many_tokens, .find = "%artist%"}, iterations);
+
+    run("join_path",
+        bench_join_path,
+        &(BenchArgs){.str = "/tmp", .find = "polybar_mqueue.123456"},
+        iterations);
+    run("join_path trailing slash",
+        bench_join_path,
+        &(BenchArgs){.str = "/tmp/", .find = "polybar_mqueue.123456"},
+        iterations);
+
+    run("iter_go_to_key 8 entries first",
+        bench_iter_go_to_key, &(BenchArgs){.msg = small_dict, .key = "key0"},
+        iterations);
+    run("iter_go_to_key 8 entries last",
+        bench_iter_go_to_key, &(BenchArgs){.msg = small_dict, .key = "key7"},
+        iterations);
+    run("iter_go_to_key 256 entries last",
+        bench_iter_go_to_key,
+        &(BenchArgs){.msg = large_dict, .key = "key255"}, iterations / 10);
+    run("iter_go_to_key 4096 entries missing",
+        bench_iter_go_to_key,
+        &(BenchArgs){.msg = huge_dict, .key = "missing"}, iterations / 100);
+
+    // Look up the last key of growing dicts with the type code checks and
+    // with the signature formatted and compared on every lookup, as before
+    for (size_t d = 0; d < NUM_OF_DICT_SIZES; d++) {
+        const int size = DICT_SIZES[d];
+        const long dict_iterations = iterations * 4 / size;
+        DBusMessage *dict = new_dict_message(size, "Value");
+        char key[32];
+        char name[64];
+
+        snprintf(key, sizeof(key), "key%d", size - 1);
+
+        snprintf(name, sizeof(name), "iter_go_to_key %d entries", size);
+        run(name, bench_iter_go_to_key, &(BenchArgs){.msg = dict, .key = key},
+            dict_iterations);
+        snprintf(name, sizeof(name), "  baseline (get_signature)");
+        run(name, bench_baseline_iter_go_to_key,
+            &(BenchArgs){.msg = dict, .key = key}, dict_iterations);
+
+        snprintf(name, sizeof(name), "recurse_iter_of_signature %d", size);
+        run(name, bench_recurse_iter_of_signature,
+            &(BenchArgs){.msg = dict}, iterations);
+        snprintf(name, sizeof(name), "  baseline (get_signature)");
+        run(name, bench_baseline_recurse_iter_of_signature,
+            &(BenchArgs){.msg = dict}, iterations);
+
+        dbus_message_unref(dict);
+    }
+
+    run("iter_get_string 8 entries",
+        bench_iter_get_string, &(BenchArgs){.msg = small_dict, .key = "key7"},
+        iterations);
+    run("iter_get_string 256 entries long value",
+        bench_iter_get_string,
+        &(BenchArgs){.msg = large_dict, .key = "key255"}, iterations / 10);
+
+    dbus_message_unref(small_dict);
+    dbus_message_unref(large_dict);
+    dbus_message_unref(huge_dict);
+    free(long_title);
+    free(cjk_title);
+    free(many_tokens);
+    free(long_format);
+
+    return 0;
+}
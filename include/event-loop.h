@@ -0,0 +1,134 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <signal.h>
+#include <stdint.h>
+
+/**
+ * Called when a file descriptor added to the event loop is ready
+ *
+ * @param int fd The file descriptor
+ * @param uint32_t events The epoll events that are ready (e.g. EPOLLIN)
+ * @param void* user_data The data given when the descriptor was added
+ */
+typedef void (*EventHandler)(int fd, uint32_t events, void *user_data);
+
+/**
+ * Called after the messages of a DBus connection were dispatched
+ *
+ * @param DBusConnection* connection The connection
+ */
+typedef void (*DispatchHandler)(DBusConnection *connection);
+
+/**
+ * Create the epoll instance of the event loop. Every source of the listener
+ * (the DBus connection, timers, inotify, signals) is waited on by a single
+ * epoll_wait() call in event_loop_run().
+ *
+ * @returns dbus_bool_t TRUE if the loop was created, otherwise FALSE.
+ */
+dbus_bool_t event_loop_init();
+
+/**
+ * Watch a file descriptor. Descriptors are level-triggered unless EPOLLET is
+ * passed. The descriptor is not closed by the loop.
+ *
+ * @param int fd The file descriptor
+ * @param uint32_t events The epoll events to wait for (e.g. EPOLLIN)
+ * @param EventHandler handler Called whenever the descriptor is ready
+ * @param void* user_data Passed to the handler
+ *
+ * @returns dbus_bool_t TRUE if the descriptor is watched, otherwise FALSE.
+ */
+dbus_bool_t event_loop_add_fd(int fd, uint32_t events, EventHandler handler,
+                              void *user_data);
+
+/**
+ * Stop watching a file descriptor. This may be called from a handler.
+ *
+ * @param int fd The file descriptor
+ */
+void event_loop_remove_fd(int fd);
+
+/**
+ * Create a timer (a timerfd) that is watched by the loop. The timer starts
+ * disarmed, see event_loop_arm_timer(). Its expirations are read by the loop
+ * before the handler is called.
+ *
+ * @param EventHandler handler Called whenever the timer expires
+ * @param void* user_data Passed to the handler
+ *
+ * @returns int The file descriptor of the timer, -1 on failure. It is closed
+ *              by event_loop_remove_fd() or event_loop_free().
+ */
+int event_loop_add_timer(EventHandler handler, void *user_data);
+
+/**
+ * Arm or disarm a timer created by event_loop_add_timer(). Unlike the other
+ * functions of the loop, this may be called from any thread.
+ *
+ * @param int timer_fd The file descriptor of the timer
+ * @param long delay_ms The number of milliseconds until the timer expires, 0
+ *                      to expire as soon as possible, or -1 to disarm it
+ * @param long interval_ms The number of milliseconds between expirations
+ *                         after the first one, 0 for a one-shot timer
+ *
+ * @returns dbus_bool_t TRUE if the timer was set, otherwise FALSE.
+ */
+dbus_bool_t event_loop_arm_timer(int timer_fd, long delay_ms,
+                                 long interval_ms);
+
+/**
+ * Receive signals through a signalfd watched by the loop instead of signal
+ * handlers. The signals must already be blocked in every thread (i.e. with
+ * sigprocmask() before any thread is started).
+ *
+ * @param const sigset_t* signals The signals to receive
+ * @param EventHandler handler Called whenever a signal is pending, and must
+ *                             read the struct signalfd_siginfo from the fd
+ * @param void* user_data Passed to the handler
+ *
+ * @returns int The file descriptor of the signalfd, -1 on failure. It is
+ *              closed by event_loop_remove_fd() or event_loop_free().
+ */
+int event_loop_add_signals(const sigset_t *signals, EventHandler handler,
+                           void *user_data);
+
+/**
+ * Let the loop drive a DBus connection. The watches and timeouts of the
+ * connection are added to the loop with dbus_connection_set_watch_functions()
+ * and dbus_connection_set_timeout_functions(), and every message that was read
+ * is dispatched before the loop waits again.
+ *
+ * @param DBusConnection* connection The connection
+ * @param DispatchHandler handler Called after messages were dispatched, NULL
+ *                                if none
+ *
+ * @returns dbus_bool_t TRUE if the connection was attached, otherwise FALSE.
+ */
+dbus_bool_t event_loop_attach_dbus(DBusConnection *connection,
+                                   DispatchHandler handler);
+
+/**
+ * Wait for and handle events until event_loop_stop() is called or the DBus
+ * connection is closed
+ *
+ * @returns dbus_bool_t TRUE if the loop was stopped, FALSE if it failed or the
+ *                      DBus connection was closed.
+ */
+dbus_bool_t event_loop_run();
+
+/**
+ * Make event_loop_run() return once the current events were handled. This may
+ * be called from a handler.
+ */
+void event_loop_stop();
+
+/**
+ * Detach the DBus connection, close the timers and signalfds of the loop and
+ * the epoll instance.
+ */
+void event_loop_free();
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+
+#include "mpris.h"
+#include "text.h"
+
+// Maximum nesting of conditional segments in a format
+#define FORMAT_MAX_DEPTH 8
+
+// Size of a buffer that can hold any rendered status
+#define FORMAT_OUTPUT_SIZE 4096
+
+typedef enum {
+    // Literal text
+    FORMAT_TOKEN_TEXT,
+    // %artist%, %title%, %album%, %tracknumber%, %length% and %status%
+    FORMAT_TOKEN_ARTIST,
+    FORMAT_TOKEN_TITLE,
+    FORMAT_TOKEN_ALBUM,
+    FORMAT_TOKEN_TRACKNUMBER,
+    FORMAT_TOKEN_LENGTH,
+    FORMAT_TOKEN_STATUS,
+    // %[ and %], enclosing a segment that is only shown if none of its tokens
+    // are empty
+    FORMAT_TOKEN_COND_BEGIN,
+    FORMAT_TOKEN_COND_END
+} FormatTokenType;
+
+typedef struct {
+    FormatTokenType type;
+    // The literal text of a FORMAT_TOKEN_TEXT, pointing into the format string
+    const char *text;
+    size_t len;
+    // Display width of the literal text in columns
+    int width;
+    // Index of the matching FORMAT_TOKEN_COND_END of a FORMAT_TOKEN_COND_BEGIN
+    size_t end;
+} FormatToken;
+
+/**
+ * A format string compiled once into a list of tokens along with the
+ * truncation options, so that rendering never has to scan the format string.
+ */
+typedef struct {
+    // Grown while compiling, so a format can have any number of tokens
+    FormatToken *tokens;
+    size_t num_of_tokens;
+    size_t max_tokens;
+    int max_artist_length;
+    int max_title_length;
+    int max_length;
+    const char *trunc;
+    size_t trunc_len;
+    int trunc_width;
+} StatusFormat;
+
+/**
+ * A copy of the artist or title last truncated with format_render() and the
+ * TextIndex of it
+ */
+typedef struct {
+    dbus_bool_t valid;
+    size_t len;
+    char str[TRACK_TEXT_SIZE];
+    TextIndex index;
+} FormatIndexedValue;
+
+/**
+ * Keeps the TextIndex of the artist and title between renders, so that they
+ * are only indexed again when the track changes
+ */
+typedef struct {
+    FormatIndexedValue artist;
+    FormatIndexedValue title;
+} FormatCache;
+
+/**
+ * Compile a format string and the truncation options into a StatusFormat,
+ * which must be freed with format_free().
+ *
+ * The format can contain the %artist%, %title%, %album%, %tracknumber%,
+ * %length% (m:ss or h:mm:ss) and %status% tokens. Text between %[ and %] is a
+ * conditional segment, which is left out if any token directly inside of it
+ * is empty. Segments can be nested. Anything else, including unknown tokens,
+ * is kept as is.
+ *
+ * All lengths are display widths in columns (see utf8_width()), and strings
+ * are only ever cut between whole characters.
+ *
+ * @param StatusFormat* fmt The StatusFormat to compile into
+ * @param char* format The format string, which must outlive fmt
+ * @param int max_artist_length The maximum length of the artist in the output
+ * @param int max_title_length The maximum length of the title in the output
+ * @param int max_length The maximum length of the output string
+ * @param char* trunc The string to use to indicate truncation, which must
+ *                    outlive fmt
+ *
+ * @returns dbus_bool_t TRUE if the format was compiled. FALSE if its
+ *                      conditional segments are not balanced or nested more
+ *                      than FORMAT_MAX_DEPTH deep, trunc is longer than a max
+ *                      length, or out of memory, in which case fmt does not
+ *                      have to be freed.
+ */
+dbus_bool_t format_compile(StatusFormat *fmt, const char *format,
+                           const int max_artist_length,
+                           const int max_title_length, const int max_length,
+                           const char *trunc);
+
+/**
+ * Free the tokens of a format compiled with format_compile()
+ *
+ * @param StatusFormat* fmt The compiled format
+ */
+void format_free(StatusFormat *fmt);
+
+/**
+ * Empty a FormatCache
+ *
+ * @param FormatCache* cache The cache to empty
+ */
+void format_cache_clear(FormatCache *cache);
+
+/**
+ * Render a track with a compiled format in a single pass over its tokens,
+ * without allocating. Artist and title are only truncated if the whole output
+ * is longer than max_length, or if max_length is INT_MAX.
+ *
+ * @param StatusFormat* fmt The compiled format
+ * @param TrackState* track The track to render
+ * @param FormatCache* cache The indexes of the artist and title of the last
+ *                           render, which are reused if they have not changed
+ *                           and replaced otherwise. NULL to index them again.
+ * @param char* buf The buffer to render into
+ * @param size_t size The size of the buffer. The output is cut off at the last
+ *                    whole UTF-8 character that fits.
+ *
+ * @returns size_t The length of the rendered string
+ */
+size_t format_render(const StatusFormat *fmt, const TrackState *track,
+                     FormatCache *cache, char *buf, const size_t size);
+
+/**
+ * Check that the trunc string fits in every max length, so that the artist,
+ * title and output can always be truncated.
+ *
+ * @param int max_artist_length The maximum length of the artist in the output
+ * @param int max_title_length The maximum length of the title in the output
+ * @param int max_length The maximum length of the output string
+ * @param char* trunc The string to use to indicate truncation
+ *
+ * @returns dbus_bool_t TRUE if trunc is no longer than any of the max lengths,
+ *                      otherwise FALSE.
+ */
+dbus_bool_t format_options_valid(const int max_artist_length,
+                                 const int max_title_length,
+                                 const int max_length, const char *trunc);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _IPC_URING_H_
+#define _IPC_URING_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Number of writes submitted with a single io_uring_enter() call. More writes
+// are split into several batches.
+#define IPC_URING_ENTRIES 64
+
+// Number of descriptors that can be registered with the ring
+#define IPC_URING_MAX_FILES 64
+
+/**
+ * A write of a message to a FIFO
+ */
+typedef struct {
+    int fd;
+    // Index of fd in the registered files of the ring, -1 if not registered
+    int file_slot;
+    const char *buf;
+    size_t len;
+    // Set to the number of bytes written, or -errno if the write failed
+    ssize_t result;
+} IpcWrite;
+
+/**
+ * Set up an io_uring instance with raw syscalls (no liburing) for writing
+ * messages to polybar's FIFOs.
+ *
+ * @returns dbus_bool_t TRUE if io_uring and its write operation are supported
+ *                      (Linux 5.6+), otherwise FALSE.
+ */
+dbus_bool_t ipc_uring_init();
+
+/**
+ * Register a descriptor with the ring, so that writes to it don't have to
+ * look it up and take a reference to it every time. Must be unregistered
+ * before it is closed.
+ *
+ * @param int fd The descriptor
+ *
+ * @returns int The slot of the descriptor, or -1 if it could not be registered
+ *              (in which case it can still be written to unregistered)
+ */
+int ipc_uring_register_fd(int fd);
+
+/**
+ * Unregister a descriptor registered with ipc_uring_register_fd()
+ *
+ * @param int file_slot The slot of the descriptor
+ */
+void ipc_uring_unregister_fd(int file_slot);
+
+/**
+ * Submit every write at once and wait for all of them to complete. For
+ * non-blocking FIFOs this takes a single io_uring_enter() call per
+ * IPC_URING_ENTRIES writes, instead of a write() call per write.
+ *
+ * @param IpcWrite* writes The writes, whose results are set
+ * @param size_t num_of_writes The number of writes
+ *
+ * @returns dbus_bool_t TRUE if every write was submitted, FALSE if the ring
+ *                      failed. Writes that could not be submitted then have a
+ *                      result of -EAGAIN, so they can be retried without the
+ *                      ring.
+ */
+dbus_bool_t ipc_uring_write(IpcWrite writes[], size_t num_of_writes);
+
+/**
+ * Unregister every descriptor and tear down the ring
+ */
+void ipc_uring_free();
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _IPC_WRITER_H_
+#define _IPC_WRITER_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+
+#include "polybar-ipc.h"
+
+// Number of updates that can wait to be delivered. Updates are dropped (and
+// counted) rather than blocking the caller when the queue is full.
+#define IPC_QUEUE_SIZE 64
+
+// Maximum number of messages in a single update
+#define IPC_UPDATE_MAX_MSGS 4
+
+/**
+ * Start the thread that delivers updates to polybar in the background. From
+ * then on, the endpoints of polybar-ipc must only be used by that thread until
+ * ipc_writer_stop() is called. Until it is started (or if it could not be),
+ * updates are delivered right away by the caller.
+ *
+ * @returns dbus_bool_t TRUE if the thread was started, otherwise FALSE.
+ */
+dbus_bool_t ipc_writer_start();
+
+/**
+ * Queue an update for every known polybar IPC endpoint. The messages are
+ * copied into a bounded single-producer single-consumer queue without taking a
+ * lock, and the background thread refreshes the set of endpoints and writes
+ * them with ipc_send_messages(), so a slow bar never delays reading the next
+ * DBus message. Only a single thread may queue updates.
+ *
+ * Updates that don't fit in the queue are counted in METRIC_UPDATES_DROPPED.
+ *
+ * @param const char** messages An array of messages to send
+ * @param size_t num_of_msgs The number of messages in the array, at most
+ *                           IPC_UPDATE_MAX_MSGS
+ * @param unsigned int refresh The messages that are sent even if their module
+ *                             already shows them, see ipc_send_messages()
+ * @param long long origin_us The monotonic time in microseconds of the event
+ *                            that caused the messages, or 0 if unknown
+ *
+ * @returns dbus_bool_t TRUE if the update was queued (or delivered, if the
+ *                      thread is not running), otherwise FALSE.
+ */
+dbus_bool_t ipc_writer_send(const char *messages[], size_t num_of_msgs,
+                            unsigned int refresh, long long origin_us);
+
+/**
+ * Queue a refresh of the set of polybar IPC endpoints, which also retries the
+ * messages of bars that could not accept them before. Nothing is queued if the
+ * queue is full, since every update refreshes the set anyway.
+ *
+ * @returns dbus_bool_t TRUE if the refresh was queued or is not needed
+ */
+dbus_bool_t ipc_writer_refresh();
+
+/**
+ * Retry the messages that bars did not accept yet (see ipc_endpoints_pending())
+ * on a timer, since otherwise they would wait for the next update. After
+ * every delivery, the timer is armed while messages are still queued, with a
+ * delay that doubles from 10 ms up to a second as long as bars don't accept
+ * any of them, and disarmed once they were all accepted. Retrying stops when
+ * the thread is stopped.
+ *
+ * @param int timer_fd A timer created by event_loop_add_timer() whose handler
+ *                     calls ipc_writer_refresh(), or -1 to stop retrying
+ */
+void ipc_writer_set_retry_timer(int timer_fd);
+
+/**
+ * Check whether the queue is full, in which case the next update would be
+ * dropped. Must only be called by the thread that queues updates.
+ *
+ * @returns dbus_bool_t TRUE if no more updates can be queued right now
+ */
+dbus_bool_t ipc_writer_full();
+
+/**
+ * Get the largest number of updates that were waiting in the queue at once
+ *
+ * @returns size_t The largest depth of the queue since the thread was started
+ */
+size_t ipc_writer_max_depth();
+
+/**
+ * Block until every update queued so far was delivered
+ */
+void ipc_writer_flush();
+
+/**
+ * Deliver every queued update and stop the background thread. Updates sent
+ * after this are delivered by the caller again.
+ */
+void ipc_writer_stop();
+
+#endif
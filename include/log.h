@@ -0,0 +1,87 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+
+// Number of records that can wait to be written. Records are dropped (and
+// counted) rather than blocking the caller when the ring is full.
+#define LOG_RING_SIZE 256
+
+// Maximum length of the message and fields of a record. Longer records are
+// cut off.
+#define LOG_MAX_RECORD_LEN 512
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+/**
+ * Get the level named by a string
+ *
+ * @param const char* name "error", "warn", "info" or "debug"
+ * @param LogLevel* level Set to the level if the name is valid
+ *
+ * @returns dbus_bool_t TRUE if the name is valid, otherwise FALSE.
+ */
+dbus_bool_t log_parse_level(const char *name, LogLevel *level);
+
+/**
+ * Set the most verbose level that is logged. Records of more verbose levels
+ * are discarded without being formatted. The default level is LOG_LEVEL_INFO.
+ *
+ * @param LogLevel level The most verbose level to log
+ */
+void log_set_level(LogLevel level);
+
+/**
+ * Check whether records of a level are logged
+ *
+ * @param LogLevel level The level of the record
+ *
+ * @returns dbus_bool_t TRUE if records of the level are logged
+ */
+dbus_bool_t log_enabled(LogLevel level);
+
+/**
+ * Start the thread that writes records in the background. Until it is started
+ * (or if it could not be), records are written right away by the caller.
+ *
+ * @returns dbus_bool_t TRUE if the thread was started, otherwise FALSE.
+ */
+dbus_bool_t log_start();
+
+/**
+ * Log a record as a logfmt line, e.g.
+ *
+ *     ts=2020-01-01T00:00:00.000Z level=info msg="Song is playing" bars=2
+ *
+ * Warnings and errors are written to stderr, and everything else to stdout.
+ * Once log_start() was called, the record is formatted into an in-memory ring
+ * and written by a background thread, so a slow reader of the output (e.g.
+ * journald) never blocks the caller. This never allocates.
+ *
+ * @param LogLevel level The level of the record
+ * @param const char* msg A description of the event, which is quoted
+ * @param const char* fields A printf format of space separated key=value
+ *                           fields to append, NULL if none. Values with spaces
+ *                           must be quoted by the format.
+ * @param ... The arguments of the fields format
+ */
+void log_record(LogLevel level, const char *msg, const char *fields, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Block until every record logged so far was written
+ */
+void log_flush();
+
+/**
+ * Write every pending record and stop the background thread. Records logged
+ * after this are written by the caller again.
+ */
+void log_stop();
+
+#endif
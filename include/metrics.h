@@ -0,0 +1,131 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stdint.h>
+
+// Values below 2^HISTOGRAM_SUB_BUCKET_BITS are recorded exactly. Larger values
+// are recorded with a relative error of at most 2^-HISTOGRAM_SUB_BUCKET_BITS,
+// i.e. 6.25%.
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+// Values of 2^HISTOGRAM_MAX_VALUE_BITS or more (about 12 days in
+// microseconds) are recorded as the largest value that fits
+#define HISTOGRAM_MAX_VALUE_BITS 40
+#define HISTOGRAM_NUM_OF_BUCKETS                                         \
+    ((HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+     HISTOGRAM_SUB_BUCKETS)
+
+// Counters of the listener. Every counter only ever increases.
+typedef enum {
+    // Signals dispatched to the listener
+    METRIC_SIGNALS_RECEIVED,
+    // Signals that were not about spotify and were ignored
+    METRIC_SIGNALS_FILTERED,
+    // Signals that were about spotify and were handled
+    METRIC_SIGNALS_HANDLED,
+    // Hook and action messages written to polybar
+    METRIC_HOOKS_SENT,
+    // Messages that could not be delivered to a bar
+    METRIC_IPC_FAILURES,
+    // Polybar IPC endpoints that were found
+    METRIC_BARS_DISCOVERED,
+    // Updates dropped because the queue of the IPC writer thread was full
+    METRIC_UPDATES_DROPPED,
+    // Messages not sent to a bar because its module already showed them
+    METRIC_HOOKS_AVOIDED,
+    NUM_OF_METRIC_COUNTERS
+} MetricCounter;
+
+// Latency histograms of the listener, in microseconds
+typedef enum {
+    // Time spent handling a signal
+    METRIC_HANDLER_TIME,
+    // Time from the signal that caused an update to a message of the update
+    // being written to a bar
+    METRIC_SIGNAL_TO_WRITE,
+    NUM_OF_METRIC_HISTOGRAMS
+} MetricHistogram;
+
+/**
+ * A histogram of non-negative values with logarithmically sized buckets, each
+ * split into HISTOGRAM_SUB_BUCKETS linear sub-buckets (like HdrHistogram). This
+ * has a fixed size, so recording a value never allocates.
+ */
+typedef struct {
+    uint64_t buckets[HISTOGRAM_NUM_OF_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+/**
+ * Record a value in a histogram. Values may be recorded from several threads
+ * at once.
+ *
+ * @param Histogram* histogram The histogram to record the value in
+ * @param long long value The value, negative values are recorded as 0
+ */
+void histogram_record(Histogram *histogram, long long value);
+
+/**
+ * Get a percentile of the values recorded in a histogram
+ *
+ * @param const Histogram* histogram The histogram
+ * @param double quantile The quantile of the percentile between 0 and 1 (e.g.
+ *                        0.99 for the 99th percentile)
+ *
+ * @returns uint64_t The largest value that falls in the same bucket as the
+ *                   percentile, but no more than the largest value recorded.
+ *                   0 if no value was recorded.
+ */
+uint64_t histogram_percentile(const Histogram *histogram, double quantile);
+
+/**
+ * Increment one of the listener's counters
+ *
+ * @param MetricCounter counter The counter to increment
+ * @param uint64_t amount The amount to add to the counter
+ */
+void metrics_count(MetricCounter counter, uint64_t amount);
+
+/**
+ * Get the value of one of the listener's counters
+ *
+ * @param MetricCounter counter The counter
+ *
+ * @returns uint64_t The value of the counter
+ */
+uint64_t metrics_get(MetricCounter counter);
+
+/**
+ * Record a latency in one of the listener's histograms
+ *
+ * @param MetricHistogram histogram The histogram to record in
+ * @param long long value_us The latency in microseconds
+ */
+void metrics_record(MetricHistogram histogram, long long value_us);
+
+/**
+ * Get one of the listener's histograms
+ *
+ * @param MetricHistogram histogram The histogram
+ *
+ * @returns const Histogram* The histogram, which keeps being updated
+ */
+const Histogram *metrics_histogram(MetricHistogram histogram);
+
+/**
+ * Write every counter and histogram in the Prometheus text exposition format
+ * (e.g. for node_exporter's textfile collector). The metrics are written to a
+ * temporary file that is renamed over path, so readers never see a partially
+ * written file.
+ *
+ * @param const char* path The path of the file to write
+ *
+ * @returns dbus_bool_t TRUE if the file was written, otherwise FALSE.
+ */
+dbus_bool_t metrics_write_prometheus(const char *path);
+
+#endif
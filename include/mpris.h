@@ -0,0 +1,109 @@
+#ifndef _MPRIS_H_
+#define _MPRIS_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+
+// Sizes of the fixed string fields of TrackState including the null char.
+// Longer values are cut off at the last whole UTF-8 character that fits.
+#define TRACK_ID_SIZE 128
+#define TRACK_STATUS_SIZE 16
+#define TRACK_TEXT_SIZE 512
+#define TRACK_URL_SIZE 256
+
+// Flags indicating which fields of a TrackState are set
+typedef enum {
+    TRACK_HAS_TRACKID = 1 << 0,
+    TRACK_HAS_STATUS = 1 << 1,
+    TRACK_HAS_TITLE = 1 << 2,
+    TRACK_HAS_ARTISTS = 1 << 3,
+    TRACK_HAS_ALBUM = 1 << 4,
+    TRACK_HAS_LENGTH = 1 << 5,
+    TRACK_HAS_ART_URL = 1 << 6,
+    TRACK_HAS_TRACKNUMBER = 1 << 7
+} TrackField;
+
+// Fields decoded from the Metadata dictionary, which a player always sends as
+// a whole
+#define TRACK_METADATA_FIELDS                                             \
+    (TRACK_HAS_TRACKID | TRACK_HAS_TITLE | TRACK_HAS_ARTISTS |            \
+     TRACK_HAS_ALBUM | TRACK_HAS_LENGTH | TRACK_HAS_ART_URL |             \
+     TRACK_HAS_TRACKNUMBER)
+
+/**
+ * State of the player decoded from org.mpris.MediaPlayer2.Player properties.
+ * Only the fields flagged in `fields` are valid.
+ */
+typedef struct {
+    unsigned int fields;
+    char trackid[TRACK_ID_SIZE];
+    char status[TRACK_STATUS_SIZE];
+    char title[TRACK_TEXT_SIZE];
+    // Artists joined with ", "
+    char artists[TRACK_TEXT_SIZE];
+    char album[TRACK_TEXT_SIZE];
+    // Track length in microseconds
+    long long length;
+    char art_url[TRACK_URL_SIZE];
+    // Position of the track on its album
+    int tracknumber;
+} TrackState;
+
+/**
+ * Create a method call of org.freedesktop.DBus.Properties.GetAll for the
+ * org.mpris.MediaPlayer2.Player interface of a player. The reply can be decoded
+ * with mpris_decode_properties().
+ *
+ * @param const char* destination The bus name of the player
+ *
+ * @returns DBusMessage* The method call which must be unreffed by the caller,
+ *                       or NULL if out of memory.
+ */
+DBusMessage *mpris_new_get_all_call(const char *destination);
+
+/**
+ * Clear all fields of a TrackState
+ *
+ * @param TrackState* track The TrackState to clear
+ */
+void track_state_clear(TrackState *track);
+
+/**
+ * Copy every field that is set in src into dst, leaving the other fields of
+ * dst untouched. If src has any Metadata field, it holds a new Metadata
+ * dictionary, so the Metadata fields of dst that src does not have are
+ * cleared rather than kept from the previous track.
+ *
+ * @param TrackState* dst The TrackState to update
+ * @param const TrackState* src The TrackState containing the changed fields
+ */
+void track_state_merge(TrackState *dst, const TrackState *src);
+
+/**
+ * Decode a Metadata dictionary into a TrackState in a single walk of the
+ * dictionary. Unknown keys and keys of unexpected types are skipped.
+ *
+ * @param DBusMessageIter* iter The iterator pointing at the a{sv} Metadata
+ *                              dictionary
+ * @param TrackState* track The TrackState to set the decoded fields in
+ *
+ * @returns dbus_bool_t Returns TRUE if iter was pointing at an array of
+ *                      dictionary entries, otherwise FALSE.
+ */
+dbus_bool_t mpris_decode_metadata(DBusMessageIter *iter, TrackState *track);
+
+/**
+ * Decode a dictionary of org.mpris.MediaPlayer2.Player properties (i.e. the
+ * changed properties of a PropertiesChanged signal or the reply of GetAll)
+ * into a TrackState in a single walk of the dictionary, including the nested
+ * Metadata dictionary.
+ *
+ * @param DBusMessageIter* iter The iterator pointing at the a{sv} properties
+ *                              dictionary
+ * @param TrackState* track The TrackState to set the decoded fields in
+ *
+ * @returns dbus_bool_t Returns TRUE if iter was pointing at an array of
+ *                      dictionary entries, otherwise FALSE.
+ */
+dbus_bool_t mpris_decode_properties(DBusMessageIter *iter, TrackState *track);
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef _POLYBAR_IPC_H_
+#define _POLYBAR_IPC_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "polybar-socket.h"
+
+// Maximum number of messages queued for a bar that can't accept them yet. The
+// oldest message is dropped when a bar falls further behind.
+#define IPC_MAX_PENDING 8
+
+// Maximum length of a single message including its trailing newline. This is
+// large enough for a rendered status pushed to a module, and small enough for
+// a message to be written to a FIFO atomically.
+#define IPC_MAX_MSG_LEN 1024
+
+// Number of requests written to a socket before waiting for the bar to
+// acknowledge them
+#define IPC_SOCKET_MAX_IN_FLIGHT 4
+
+// Size of the buffer for the responses of a bar that were not parsed yet
+#define IPC_SOCKET_ACKS_LEN 1024
+
+// Number of modules whose last message is remembered for every bar
+#define IPC_MAX_MODULES 8
+
+// Maximum length of the name of a remembered module including the null char
+#define IPC_MODULE_NAME_LEN 64
+
+// Refresh mask that sends every message, see ipc_send_messages()
+#define IPC_REFRESH_ALL (~0u)
+
+/**
+ * The last message queued for a module of a bar (e.g. hook:module/playpause2
+ * for the playpause module), which the module shows once the bar handled it
+ */
+typedef struct {
+    char name[IPC_MODULE_NAME_LEN];
+    // FNV-1a hash of the message, 0 if it is not known what the module shows
+    uint64_t message_hash;
+} ModuleState;
+
+/**
+ * How messages are delivered to a bar
+ */
+typedef enum {
+    // A polybar_mqueue.<pid> FIFO, one message at a time
+    IPC_TRANSPORT_FIFO,
+    // An ipc.<pid>.sock socket (polybar 3.6+), with pipelined requests
+    IPC_TRANSPORT_SOCKET
+} IpcTransport;
+
+/**
+ * A polybar IPC endpoint (i.e. a polybar_mqueue.<pid> FIFO or an
+ * ipc.<pid>.sock socket)
+ */
+typedef struct {
+    char *path;
+    IpcTransport transport;
+    // PID of the polybar that created the endpoint, 0 if unknown
+    pid_t pid;
+    // Non-blocking write end of the FIFO or connection to the socket, which is
+    // held open between messages, -1 if closed
+    int fd;
+    // Slot of fd in the files registered with io_uring, -1 if not registered
+    int file_slot;
+    // Ring of newline-terminated messages that have not been written yet,
+    // along with the monotonic time in microseconds of the event that caused
+    // each message (0 if unknown)
+    char pending[IPC_MAX_PENDING][IPC_MAX_MSG_LEN];
+    long long pending_origin_us[IPC_MAX_PENDING];
+    size_t pending_head;
+    size_t num_of_pending;
+    // TRUE if the bar did not read its last message in time, in which case
+    // other bars will not wait for it
+    dbus_bool_t stalled;
+    // Bytes of the next write, set when the endpoint is ready for one
+    const char *out;
+    size_t out_len;
+    // Sockets only: the first num_of_in_flight pending messages were written
+    // and wait for an acknowledgement, the next num_of_sending are in out
+    size_t num_of_in_flight;
+    size_t num_of_sending;
+    char frames[IPC_SOCKET_MAX_IN_FLIGHT *
+                (POLYBAR_SOCKET_HEADER_LEN + IPC_MAX_MSG_LEN)];
+    char acks[IPC_SOCKET_ACKS_LEN];
+    size_t acks_len;
+    // What every module of the bar shows, so that messages that would not
+    // change it are not sent
+    ModuleState modules[IPC_MAX_MODULES];
+    size_t num_of_modules;
+} PolybarEndpoint;
+
+/**
+ * Initialize the set of known polybar IPC endpoints. The directories are
+ * scanned once, and inotify watches are placed on them so that the set can be
+ * kept up to date incrementally without scanning them again. A socket
+ * directory that does not exist yet is watched for from its parent.
+ *
+ * Bars that have both a FIFO and a socket (polybar 3.6+) are only sent
+ * messages through the socket.
+ *
+ * @param const char* ipc_dir The directory in which polybar creates its IPC
+ *                            FIFOs
+ * @param const char* socket_dir The directory in which polybar creates its IPC
+ *                               sockets, or NULL to only use FIFOs
+ *
+ * @returns dbus_bool_t Returns TRUE if the directories were successfully
+ *                      scanned, otherwise FALSE. If the inotify watches could
+ *                      not be placed, the directories will be rescanned on
+ *                      every refresh instead.
+ */
+dbus_bool_t ipc_endpoints_init(const char *ipc_dir, const char *socket_dir);
+
+/**
+ * Apply any pending inotify create/delete events to the set of known polybar
+ * IPC endpoints. This never blocks and does not read the directory unless the
+ * inotify queue overflowed.
+ *
+ * @returns dbus_bool_t Returns TRUE if the set is up to date, otherwise FALSE.
+ */
+dbus_bool_t ipc_endpoints_refresh();
+
+/**
+ * Get the inotify descriptor watching the IPC directories, which becomes
+ * readable when bars are started or stopped. Only ipc_endpoints_refresh() may
+ * read from it.
+ *
+ * @returns int The descriptor, or -1 if the directory is not watched
+ */
+int ipc_endpoints_fd();
+
+/**
+ * Choose whether messages are written to the bars with io_uring, in a single
+ * submission for every bar, or with a write() call per bar. The descriptors
+ * of the bars are registered with the ring as they are opened. If io_uring
+ * fails later on, write() is used from then on.
+ *
+ * @param dbus_bool_t enable TRUE to use io_uring, FALSE to use write() and
+ *                           tear down the ring
+ *
+ * @returns dbus_bool_t TRUE if the backend is in use, FALSE if io_uring is not
+ *                      available (in which case write() is used).
+ */
+dbus_bool_t ipc_use_io_uring(dbus_bool_t enable);
+
+/**
+ * Get the set of known polybar IPC endpoints. The array is owned by this
+ * module and is only valid until the next call to ipc_endpoints_refresh().
+ *
+ * @param PolybarEndpoint** ptr_endpoints A pointer that will be set to the
+ *                                        array of endpoints
+ *
+ * @returns size_t The number of endpoints in the array
+ */
+size_t ipc_get_endpoints(PolybarEndpoint **ptr_endpoints);
+
+/**
+ * Send messages to every known polybar IPC endpoint. The messages are framed
+ * with newlines and queued on every bar, then written to each bar's held-open,
+ * non-blocking FIFO. Since polybar treats everything it reads from its FIFO at
+ * once as a single message, a message is only written to a bar once the bar has
+ * read the previous one, rather than sleeping for a fixed interval.
+ *
+ * Bars with a socket are sent the messages as requests of polybar's socket
+ * protocol (see polybar_socket_encode()) over a held-open connection. Up to
+ * IPC_SOCKET_MAX_IN_FLIGHT requests are written at once, and messages stay
+ * queued until the bar acknowledges them. Requests that were not acknowledged
+ * when the bar closes the connection are sent again on a new one.
+ *
+ * Messages that a bar can't accept right now (e.g. its pipe is full or it is
+ * reopening its FIFO) stay queued and are retried on the next call, see
+ * ipc_endpoints_pending(). Endpoints
+ * whose polybar process no longer exists are unlinked and forgotten, so a
+ * crashed bar can never block delivery to the others.
+ *
+ * Every hook makes polybar re-run a script, so a message is not sent to a bar
+ * if the same message was the last one queued for its module on that bar
+ * (hook:module/<name><N> and action:#<name>.<action> are for module <name>),
+ * unless its bit is set in the refresh mask. Such messages are counted in
+ * METRIC_HOOKS_AVOIDED. Bars that were just found are sent every message.
+ *
+ * Every message written to a FIFO or acknowledged by a socket is counted in
+ * METRIC_HOOKS_SENT, and the time since origin_us in METRIC_SIGNAL_TO_WRITE.
+ * Messages that are dropped or rejected are counted in METRIC_IPC_FAILURES.
+ *
+ * @param const char** messages An array of messages to send
+ * @param size_t num_of_msgs The number of messages in the array
+ * @param unsigned int refresh Bit m is set if message m must be sent even if
+ *                             its module already shows it (e.g. a hook whose
+ *                             script prints something else now), or
+ *                             IPC_REFRESH_ALL to send every message
+ * @param long long origin_us The monotonic time in microseconds of the event
+ *                            that caused the messages, or 0 if unknown
+ *
+ * @returns dbus_bool_t Returns TRUE if all messages were written or queued for
+ *                      every bar, otherwise FALSE.
+ */
+dbus_bool_t ipc_send_messages(const char *messages[], size_t num_of_msgs,
+                              unsigned int refresh, long long origin_us);
+
+/**
+ * Count the messages that bars did not accept (or acknowledge) yet, which are
+ * only retried by the next call to ipc_send_messages()
+ *
+ * @returns size_t The number of messages queued for every bar
+ */
+size_t ipc_endpoints_pending();
+
+/**
+ * Remove the inotify watches and free all known polybar IPC endpoints.
+ */
+void ipc_endpoints_free();
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef _POLYBAR_SOCKET_H_
+#define _POLYBAR_SOCKET_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Every request and response starts with a header of "polyipc", a version
+// byte, the length of the payload and its type
+#define POLYBAR_SOCKET_HEADER_LEN 13
+
+/**
+ * Type of a request sent to polybar, or of its response
+ */
+typedef enum {
+    POLYBAR_SOCKET_CMD = 0,     // A bar command (e.g. hide)
+    POLYBAR_SOCKET_ACTION = 1,  // A module action (e.g. #spotify.hook.0)
+    POLYBAR_SOCKET_OK = 0,      // The request was accepted
+    POLYBAR_SOCKET_ERR = 255    // The request failed, the payload says why
+} PolybarSocketType;
+
+/**
+ * Get the directory polybar 3.6+ creates its IPC sockets in, which is
+ * $XDG_RUNTIME_DIR/polybar, or /tmp/polybar-<uid> if XDG_RUNTIME_DIR is not
+ * set.
+ *
+ * @returns char* The directory, which must be freed
+ */
+char *polybar_socket_dir();
+
+/**
+ * Connect to a polybar IPC socket without blocking
+ *
+ * @param const char* path The path of the socket
+ *
+ * @returns int The non-blocking descriptor of the connection, or -1 with errno
+ *              set if the socket could not be connected to
+ */
+int polybar_socket_connect(const char *path);
+
+/**
+ * Frame a message in the format written to polybar's FIFOs as a request of
+ * the socket protocol. "hook:module/<name><N>" becomes the action
+ * "#<name>.hook.<N - 1>", "action:<action>" becomes the action and
+ * "cmd:<command>" becomes the command.
+ *
+ * @param const char* message The message, optionally ending with a newline
+ * @param char* frame The buffer to write the request to
+ * @param size_t size The size of the buffer
+ *
+ * @returns size_t The length of the request, or 0 if the message has no
+ *                 equivalent request or does not fit in the buffer
+ */
+size_t polybar_socket_encode(const char *message, char *frame, size_t size);
+
+/**
+ * Parse the response at the start of a buffer
+ *
+ * @param const char* buf The received bytes
+ * @param size_t len The number of received bytes
+ * @param PolybarSocketType* type Set to the type of the response
+ * @param const char** payload Set to the payload of the response
+ * @param size_t* payload_len Set to the length of the payload
+ *
+ * @returns ssize_t The length of the response, 0 if more bytes are needed, or
+ *                  -1 if the bytes are not a response
+ */
+ssize_t polybar_socket_decode(const char *buf, size_t len,
+                              PolybarSocketType *type, const char **payload,
+                              size_t *payload_len);
+
+#endif
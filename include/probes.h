@@ -0,0 +1,43 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/**
+ * USDT (statically defined tracing) probes of the "spotify" provider, for
+ * tracing the listener and spotifyctl with bpftrace or perf without a verbose
+ * build. A probe is a single nop until a tracer attaches to it, and its
+ * arguments must already be at hand so nothing is computed for it. See
+ * contrib/bpftrace for scripts using them, or list them with
+ *
+ *     bpftrace -l 'usdt:/usr/bin/spotify-listener:*'
+ *
+ * The probes are only compiled in if <sys/sdt.h> (systemtap-sdt-dev or
+ * systemtap-sdt-devel) is installed, and can be left out with -DNO_PROBES.
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE0(name) DTRACE_PROBE(spotify, name)
+#define PROBE1(name, a) DTRACE_PROBE1(spotify, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(spotify, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(spotify, name, a, b, c)
+#else
+#define PROBE0(name) \
+    do {             \
+    } while (0)
+#define PROBE1(name, a) \
+    do {                \
+    } while (0)
+#define PROBE2(name, a, b) \
+    do {                   \
+    } while (0)
+#define PROBE3(name, a, b, c) \
+    do {                      \
+    } while (0)
+#endif
+
+#endif
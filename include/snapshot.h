@@ -0,0 +1,82 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "mpris.h"
+
+// Identifies a status snapshot file ("SPOT")
+#define SNAPSHOT_MAGIC 0x53504f54
+
+// Must be incremented whenever the layout of StatusSnapshot (including
+// TrackState) changes, so that old readers fall back to DBus
+#define SNAPSHOT_VERSION 2
+
+/**
+ * State of spotify published by spotify-listener in a shared memory file. The
+ * listener is the only writer and updates it under a sequence lock, so readers
+ * never block the listener and never need a DBus connection.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    // Incremented before and after every update, so it is odd while the
+    // snapshot is being written
+    unsigned int seq;
+    // PID of the listener publishing the snapshot
+    pid_t writer_pid;
+    // TRUE if spotify is running, in which case track is valid
+    dbus_bool_t running;
+    TrackState track;
+} StatusSnapshot;
+
+/**
+ * Get the path of the status snapshot file. This is
+ * $XDG_RUNTIME_DIR/spotify-listener.snapshot, or
+ * /dev/shm/spotify-listener-<uid>.snapshot if XDG_RUNTIME_DIR is not set.
+ *
+ * @param char* path The buffer to write the path to
+ * @param size_t size The size of the buffer
+ *
+ * @returns dbus_bool_t TRUE if the path fit in the buffer, otherwise FALSE.
+ */
+dbus_bool_t snapshot_path(char *path, size_t size);
+
+/**
+ * Create (or take over) the status snapshot file and map it for writing.
+ *
+ * @returns dbus_bool_t TRUE if the snapshot is ready to be published to,
+ *                      otherwise FALSE.
+ */
+dbus_bool_t snapshot_writer_open();
+
+/**
+ * Publish the state of spotify to the status snapshot. This does nothing if
+ * the snapshot was not opened.
+ *
+ * @param const TrackState* track The last known state of the player
+ * @param dbus_bool_t running TRUE if spotify is running
+ */
+void snapshot_publish(const TrackState *track, dbus_bool_t running);
+
+/**
+ * Unmap and remove the status snapshot file, so that readers fall back to
+ * DBus.
+ */
+void snapshot_writer_close();
+
+/**
+ * Read a consistent copy of the status snapshot without blocking the writer.
+ *
+ * @param StatusSnapshot* snapshot The struct to copy the snapshot into
+ *
+ * @returns dbus_bool_t TRUE if a consistent snapshot was read. FALSE if the
+ *                      file is missing, has a different version, its listener
+ *                      is no longer running or it was being rewritten for too
+ *                      long.
+ */
+dbus_bool_t snapshot_read(StatusSnapshot *snapshot);
+
+#endif
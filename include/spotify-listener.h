@@ -3,17 +3,197 @@
 
 #include <dbus-1.0/dbus/dbus.h>
 #include <stdarg.h>
+#include <stdint.h>
+
+// Current state of spotify. UNKNOWN is the state before the listener synced
+// with spotify, so that the first update is always sent to polybar.
+typedef enum { PLAYING, PAUSED, EXITED, UNKNOWN } SpotifyState;
+
+// Counters describing the work done by the listener
+typedef struct {
+    // Number of messages that woke up the listener
+    unsigned long wakeups;
+    // Number of PropertiesChanged signals that were decoded
+    unsigned long parsed;
+    // Number of state changes reported by spotify
+    unsigned long events;
+    // Number of state changes that were merged into a later one
+    unsigned long collapsed;
+    // Number of times polybar was updated
+    unsigned long updates;
+    // Number of times spotify was launched while the listener was running
+    unsigned long launches;
+    // Microseconds from spotify taking its bus name to polybar being updated,
+    // for the last launch and the slowest launch
+    long long last_launch_latency_us;
+    long long max_launch_latency_us;
+} ListenerStats;
 
 /**
- * Send the specified messages to polybar through IPC
+ * Send the specified messages to polybar through IPC. The messages are queued
+ * for the IPC writer thread, see ipc_writer_send().
  *
  * @param int numOfMsgs Number of variadic messages that will be given as args
+ *                      (at most IPC_UPDATE_MAX_MSGS)
  * @param ... char* strings to send
  *
- * @returns dbus_bool_t TRUE if messages successfully sent, FALSE otherwise.
+ * @returns dbus_bool_t TRUE if messages successfully queued, FALSE otherwise.
  */
 dbus_bool_t send_ipc_polybar(int numOfMsgs, ...);
 
+/**
+ * Remember the unique bus name of spotify
+ *
+ * @param const char* senderid The unique name of spotify's connection
+ *
+ * @returns dbus_bool_t TRUE if senderid was not NULL, otherwise FALSE.
+ */
+dbus_bool_t spotify_update_sender(const char *senderid);
+
+/**
+ * Restrict the PropertiesChanged match rule to signals sent by the specified
+ * unique name, replacing the match rule of the previous owner. This must be
+ * called whenever spotify's well-known name changes owner.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ * @param const char* owner The unique name owning
+ *                          org.mpris.MediaPlayer2.spotify, or NULL/"" if
+ *                          spotify is not running, in which case no
+ *                          PropertiesChanged match is armed.
+ *
+ * @returns dbus_bool_t TRUE if the match rules were updated
+ */
+dbus_bool_t spotify_watch_owner(DBusConnection *connection, const char *owner);
+
+/**
+ * Look up the unique name that currently owns org.mpris.MediaPlayer2.spotify
+ * and arm the PropertiesChanged match rule for it. This blocks until the bus
+ * replies.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ *
+ * @returns dbus_bool_t TRUE if spotify is running, FALSE otherwise
+ */
+dbus_bool_t spotify_resolve_owner(DBusConnection *connection);
+
+/**
+ * Update the stored track and polybar from the reply of a GetAll call on
+ * spotify's org.mpris.MediaPlayer2.Player interface. If the reply does not
+ * contain a known PlaybackStatus, spotify is treated as paused.
+ *
+ * @param DBusMessage* reply The reply of the GetAll call
+ *
+ * @returns dbus_bool_t TRUE if polybar was updated, otherwise FALSE.
+ */
+dbus_bool_t spotify_apply_player_state(DBusMessage *reply);
+
+/**
+ * Query the full player state of spotify that was just launched without
+ * blocking. Polybar is updated as soon as the reply arrives (see
+ * spotify_launch_reply()). Any query for a previous owner is cancelled.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ *
+ * @returns dbus_bool_t TRUE if the query was sent, otherwise FALSE.
+ */
+dbus_bool_t spotify_query_launch(DBusConnection *connection);
+
+/**
+ * DBus pending call notify function for the GetAll call sent when spotify is
+ * launched. Updates polybar and records the launch-to-visible latency.
+ *
+ * @param DBusPendingCall* pending The pending GetAll call
+ * @param void* user_data Not used.
+ */
+void spotify_launch_reply(DBusPendingCall *pending, void *user_data);
+
+/**
+ * Query the full player state of spotify with a blocking GetAll call and
+ * update polybar right away, so that the bar is correct without waiting for
+ * spotify to send a signal. If spotify is not running, the modules are hidden.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ *
+ * @returns dbus_bool_t TRUE if polybar was updated, otherwise FALSE.
+ */
+dbus_bool_t spotify_sync_state(DBusConnection *connection);
+
+/**
+ * Get the state of spotify described by a PlaybackStatus
+ *
+ * @param const char* status The PlaybackStatus of spotify
+ *
+ * @returns SpotifyState PLAYING or PAUSED, or UNKNOWN if the status is neither
+ *                       "Playing" nor "Paused"
+ */
+SpotifyState spotify_state_from_status(const char *status);
+
+/**
+ * Update the current stored spotify state and polybar to the specified state
+ * by calling spotify_playing(), spotify_paused() or spotify_exited().
+ *
+ * @param SpotifyState state The new state of spotify
+ *
+ * @returns dbus_bool_t TRUE if polybar was updated, otherwise FALSE.
+ */
+dbus_bool_t spotify_set_state(SpotifyState state);
+
+/**
+ * DBus filter function that counts every message dispatched to the listener.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ * @param DBusMessage* message The message being dispatched
+ * @param void *user_data Not used.
+ *
+ * @returns DBusHandlerResult Always DBUS_HANDLER_RESULT_NOT_YET_HANDLED so the
+ *                            message reaches the other handlers.
+ */
+DBusHandlerResult wakeup_counter(DBusConnection *connection,
+                                 DBusMessage *message, void *user_data);
+
+/**
+ * DBus filter function that counts every signal that was not handled by the
+ * other handlers. Must be added after all other filters.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ * @param DBusMessage* message The message being dispatched
+ * @param void *user_data Not used.
+ *
+ * @returns DBusHandlerResult Always DBUS_HANDLER_RESULT_NOT_YET_HANDLED.
+ */
+DBusHandlerResult unhandled_counter(DBusConnection *connection,
+                                    DBusMessage *message, void *user_data);
+
+/**
+ * DBus filter that records the PropertiesChanged and NameOwnerChanged signals
+ * to the trace opened with trace_writer_open(), before they are handled.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ * @param DBusMessage* message The message being dispatched
+ * @param void *user_data Not used.
+ *
+ * @returns DBusHandlerResult Always DBUS_HANDLER_RESULT_NOT_YET_HANDLED so the
+ *                            message reaches the other handlers.
+ */
+DBusHandlerResult trace_recorder(DBusConnection *connection,
+                                 DBusMessage *message, void *user_data);
+
+/**
+ * Feed every message of a trace recorded with --record through the handlers,
+ * with polybar messages sent to a temporary FIFO, and print the number of
+ * messages replayed per second and the time taken to handle each message.
+ *
+ * @param const char* path The path of the trace file
+ *
+ * @returns int The exit code of the listener
+ */
+int replay_trace(const char *path);
+
+/**
+ * Print the listener's counters
+ */
+void print_stats();
+
 /**
  * DBus handler function for PropertiesChanged signals. This is automatically
  * called by DBus when a PropertiesChanged signal is broadcasted.
@@ -40,9 +220,12 @@ DBusHandlerResult properties_changed_handler(DBusConnection *connection,
  * @param void *user_data Pointer to extra user data for handler functions. Not
  *                        used.
  *
+ * When spotify's bus name gets a new owner (i.e. spotify was launched), its
+ * full state is queried right away instead of waiting for its first signal.
+ *
  * @returns DBusHandlerResult The result of handling the signal. This returns
- * DBUS_HANDLER_RESULT_HANDLED if it was a signal from spotify indicating a
- * disconnection, otherwise returns DBUS_HANDLER_RESULT_NOT_YET_HANDLED.
+ * DBUS_HANDLER_RESULT_HANDLED if it was a signal about spotify's bus name,
+ * otherwise returns DBUS_HANDLER_RESULT_NOT_YET_HANDLED.
  */
 DBusHandlerResult name_owner_changed_handler(DBusConnection *connection,
                                              DBusMessage *message,
@@ -57,6 +240,65 @@ DBusHandlerResult name_owner_changed_handler(DBusConnection *connection,
  */
 void free_user_data(void *memory);
 
+/**
+ * Called by the event loop after DBus messages were dispatched. Arms the
+ * coalescing timer for the window the messages opened, or closes the window
+ * right away if the coalescing window is 0.
+ *
+ * @param DBusConnection* connection The DBusConnection object
+ */
+void messages_dispatched(DBusConnection *connection);
+
+/**
+ * Event loop handler of the coalescing timer, which updates polybar once the
+ * coalescing window is closed.
+ *
+ * @param int fd The timerfd
+ * @param uint32_t events Not used.
+ * @param void* user_data Not used.
+ */
+void coalesce_timer_expired(int fd, uint32_t events, void *user_data);
+
+/**
+ * Event loop handler of the metrics timer, which writes the metrics file.
+ *
+ * @param int fd The timerfd
+ * @param uint32_t events Not used.
+ * @param void* user_data Not used.
+ */
+void metrics_timer_expired(int fd, uint32_t events, void *user_data);
+
+/**
+ * Event loop handler of the inotify descriptor of the polybar IPC directory,
+ * which has the IPC writer thread pick up the bars that were started or
+ * stopped.
+ *
+ * @param int fd The inotify descriptor
+ * @param uint32_t events Not used.
+ * @param void* user_data Not used.
+ */
+void bars_changed(int fd, uint32_t events, void *user_data);
+
+/**
+ * Event loop handler of the IPC retry timer, which has the IPC writer thread
+ * retry the messages that bars did not accept yet.
+ *
+ * @param int fd The timerfd
+ * @param uint32_t events Not used.
+ * @param void* user_data Not used.
+ */
+void ipc_retry_timer_expired(int fd, uint32_t events, void *user_data);
+
+/**
+ * Event loop handler of the signalfd receiving SIGINT, SIGTERM and SIGHUP,
+ * which stops the event loop so the listener exits cleanly.
+ *
+ * @param int fd The signalfd
+ * @param uint32_t events Not used.
+ * @param void* user_data Not used.
+ */
+void termination_requested(int fd, uint32_t events, void *user_data);
+
 /**
  * Updates current stored spotify state and sends IPC messages to polybar to
  * update the spotify modules. This function does nothing if the current stored
@@ -88,22 +330,59 @@ dbus_bool_t spotify_paused();
 dbus_bool_t spotify_exited();
 
 /**
- * Updates the currently stored spotify trackid.
+ * Sends an IPC message to polybar to the status module indicating a track
+ * change.
  *
- * @param const char* The trackid
+ * @returns dbus_bool_t TRUE if the message was sent, FALSE otherwise
+ */
+dbus_bool_t spotify_update_track();
+
+/**
+ * Get the message that updates the spotify module. Without push mode this is
+ * the hook that makes polybar run `spotifyctl status`. In push mode, the status
+ * is rendered with format_render() from the last known track and sent with a
+ * `send` action, so polybar does not need to fork or query DBus. Rendering
+ * does not allocate.
  *
- * @returns TRUE if no error, otherwise FALSE.
+ * @returns const char* The message, which is valid until the next call
+ */
+const char *spotify_status_message();
+
+/**
+ * Record a new state reported by spotify. All states recorded within the
+ * coalescing window are merged, and polybar is only updated with the final
+ * state once the window closes (see coalesce_flush_due()).
+ *
+ * @param SpotifyState state The new state of spotify
+ */
+void coalesce_state(SpotifyState state);
+
+/**
+ * Record a track change reported by spotify. Like coalesce_state(), this is
+ * merged with other changes within the coalescing window.
  */
-dbus_bool_t update_last_trackid(const char *trackid);
+void coalesce_track_change();
 
 /**
- * If the trackid has changed, an IPC message is sent to polybar to the status
- * module indicating a track change.
+ * Update polybar with the merged state if the coalescing window has closed.
  *
- * @param const char* current_trackid The current trackid reported by spotify
+ * @returns int The number of milliseconds until the coalescing window closes
+ *              or -1 if there is no pending update. This can be used as the
+ *              delay of the coalescing timer.
+ */
+int coalesce_flush_due();
+
+/**
+ * Write the metrics file given with --metrics if it is due.
  *
- * @returns dbus_bool_t TRUE if the trackid has changed, FALSE otherwise
+ * @returns int The number of milliseconds until the metrics file is due to be
+ *              written again, or -1 if no metrics file is written.
+ */
+int metrics_write_due();
+
+/**
+ * Print listener usage information
  */
-dbus_bool_t spotify_update_track(const char *current_trackid);
+void print_usage();
 
 #endif
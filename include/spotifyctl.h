@@ -3,74 +3,32 @@
 
 #include <dbus-1.0/dbus/dbus.h>
 
-/**
- * Extract the title of the currently playing song on spotify from a
- * Metadata property DBusMessage
- *
- * @param DBusMessage* msg The Metadata property DBusMessage
- * @returns char* The title of the currently playing track
- */
-char *get_song_title_from_metadata(DBusMessage *msg);
+#include "format.h"
+#include "utils.h"
 
 /**
- * Extract the artist of the currently playing song on spotify from a
- * Metadata property DBusMessage
- *
- * @param DBusMessage* msg The Metadata property DBusMessage
- * @returns char* The artist of the currently playing track
- */
-char *get_song_artist_from_metadata(DBusMessage *msg);
-
-/**
- * Build the output message according to the specified format options
+ * Prints the status output message according to the specified format options
+ * from the status snapshot published by spotify-listener, without connecting
+ * to DBus.
  *
- * @param char* artist The artist name
- * @param char* title The track title
- * @param int max_artist_length The maximum length of the artist in the output
- * @param int max_title_length The maximum length of the title in the output
- * @param int max_length The maximum length of the output string
- * @param char* format The format string specifying the output. This can contain
- *                     the %artist% and %title% tokens which will be replaced by
- *                     the artist and title specified in the arguments.
- * @param char* trunc The string to use to indicate that the artist, title, or
- *                    output was truncated. This will be how the artist, title
- *                    or output ends and will honor the max length constraints.
+ * @param StatusFormat* format The compiled format to print the status in
  *
- * @returns char* The format string with %artist% replaced by the song artist,
- *                %title% replaced by the song title. If max_length is INT_MAX,
- *                artist will be truncated if it is longer than
- *                max_artist_length, and title will be truncated if it is longer
- *                than max_title_length. If max_length is not INT_MAX, the
- *                artist and title will only be truncated if the entire output
- *                string is shorter than max_length, otherwise it will be
- *                truncated as normal. In truncating a string, the end of the
- *                string will be replaced with trunc while sataisfying the
- *                max length constraints.
+ * @returns dbus_bool_t TRUE if the status was printed. FALSE if there is no
+ *                      usable snapshot (e.g. the listener is not running) or
+ *                      the snapshot says spotify is not running, in which case
+ *                      the status must be requested over DBus.
  */
-char *format_output(const char *artist, const char *title,
-                    const int max_artist_length, const int max_title_length,
-                    const int max_length, const char *format,
-                    const char *trunc);
+dbus_bool_t get_status_from_snapshot(const StatusFormat *format);
 
 /**
  * Prints the status output message according to the specified format options
- * after making a method call to spotify to obtain the artist and title
+ * after making a method call to spotify to obtain the state of the player
  *
  * @param DBusConnection connection The DBusConnection object
- * @param int max_artist_length The maximum length of the artist in the output
- * @param int max_title_length The maximum length of the title in the output
- * @param int max_length The maximum length of the output string
- * @param char* format The format string specifying the output. This can contain
- *                     the %artist% and %title% tokens which will be replaced by
- *                     the artist and title specified in the arguments.
- * @param char* trunc The string to use to indicate that the artist, title, or
- *                    output was truncated. This will be how the artist, title
- *                    or output ends and will honor the max length constraints.
- *
+ * @param StatusFormat* format The compiled format to print the status in (see
+ *                             format_compile())
  */
-void get_status(DBusConnection *connection, const int max_artist_length,
-                const int max_title_length, const int max_length,
-                const char *format, const char *trunc);
+void get_status(DBusConnection *connection, const StatusFormat *format);
 
 /**
  * Call the specified org.mpris.MediaPlayer2.Player method
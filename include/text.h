@@ -0,0 +1,90 @@
+#ifndef _TEXT_H_
+#define _TEXT_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
+
+// Widest string a TextIndex has a precomputed cut for. Every track field fits
+// in this many columns. Wider strings are cut with a scan instead.
+#define TEXT_INDEX_MAX_WIDTH 1024
+
+/**
+ * The end of the longest prefix of a string that fits in some number of
+ * columns
+ */
+typedef struct {
+    // Length of the prefix in bytes
+    size_t len;
+    // Display width of the prefix in columns
+    int width;
+} TextCut;
+
+/**
+ * Precomputed cuts of a UTF-8 string for every width, so that the string can
+ * be truncated to any number of columns in O(1). A cut never splits a
+ * character, and keeps combining marks with the character they belong to.
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+    // Display width of the whole string in columns
+    int width;
+    // TRUE if every character is a single byte one column wide, like
+    // printable ASCII, in which case the tables are not used
+    dbus_bool_t ascii;
+    // Number of entries of the tables that are filled
+    int num_of_cuts;
+    // cut_len[w] and cut_width[w] describe the longest prefix that is at most
+    // w columns wide
+    unsigned short cut_len[TEXT_INDEX_MAX_WIDTH + 1];
+    unsigned short cut_width[TEXT_INDEX_MAX_WIDTH + 1];
+} TextIndex;
+
+/**
+ * Get the number of columns a UTF-8 string takes up in a terminal or bar.
+ * East Asian wide and fullwidth characters and emoji take up two columns,
+ * combining marks and other zero-width characters none. Invalid bytes take up
+ * one column each.
+ *
+ * @param const char* str The string
+ * @param size_t len The length of the string in bytes
+ *
+ * @returns int The display width of the string in columns
+ */
+int utf8_width(const char *str, const size_t len);
+
+/**
+ * Find the longest prefix of a UTF-8 string that is at most max_width columns
+ * wide, by scanning the string.
+ *
+ * @param const char* str The string
+ * @param size_t len The length of the string in bytes
+ * @param int max_width The maximum width of the prefix in columns
+ *
+ * @returns TextCut The end of the prefix
+ */
+TextCut utf8_cut(const char *str, const size_t len, const int max_width);
+
+/**
+ * Index the character boundaries and widths of a UTF-8 string in a single
+ * pass. The string must outlive the index.
+ *
+ * @param TextIndex* index The index to build
+ * @param const char* str The string
+ * @param size_t len The length of the string in bytes
+ */
+void text_index_build(TextIndex *index, const char *str, const size_t len);
+
+/**
+ * Find the longest prefix of an indexed string that is at most max_width
+ * columns wide. This is O(1) unless the string is wider than
+ * TEXT_INDEX_MAX_WIDTH.
+ *
+ * @param const TextIndex* index The index of the string
+ * @param int max_width The maximum width of the prefix in columns
+ *
+ * @returns TextCut The end of the prefix
+ */
+TextCut text_index_cut(const TextIndex *index, const int max_width);
+
+#endif
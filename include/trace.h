@@ -0,0 +1,94 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <dbus-1.0/dbus/dbus.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Identifies a trace file ("SPTR")
+#define TRACE_MAGIC 0x53505452
+
+// Must be incremented whenever the layout of the trace file changes
+#define TRACE_VERSION 1
+
+// Largest message a trace can hold, which is the largest message DBus allows
+#define TRACE_MAX_MESSAGE_LEN (128 * 1024 * 1024)
+
+/**
+ * A trace file starts with a TraceHeader, followed by a TraceRecordHeader and
+ * the marshalled message (see dbus_message_marshal()) for every message
+ * recorded. All fields are in host byte order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} TraceHeader;
+
+typedef struct {
+    // Microseconds since the trace was opened for writing
+    uint64_t time_us;
+    // Length of the marshalled message that follows in bytes
+    uint32_t len;
+} TraceRecordHeader;
+
+typedef struct {
+    FILE *file;
+} TraceReader;
+
+/**
+ * Create (or truncate) a trace file to record messages to.
+ *
+ * @param const char* path The path of the trace file
+ *
+ * @returns dbus_bool_t TRUE if messages can be recorded, otherwise FALSE.
+ */
+dbus_bool_t trace_writer_open(const char *path);
+
+/**
+ * Append a message to the trace along with the time it was received at. This
+ * does nothing if no trace was opened. Every message is flushed to the file
+ * right away, so the trace survives the listener being killed.
+ *
+ * @param DBusMessage* msg The message to record
+ *
+ * @returns dbus_bool_t TRUE if the message was recorded, otherwise FALSE.
+ */
+dbus_bool_t trace_record(DBusMessage *msg);
+
+/**
+ * Close the trace being recorded to, if any.
+ */
+void trace_writer_close();
+
+/**
+ * Open a trace file and check its header.
+ *
+ * @param TraceReader* reader The reader to initialize
+ * @param const char* path The path of the trace file
+ *
+ * @returns dbus_bool_t TRUE if the trace was opened, FALSE if it is missing or
+ *                      was written by an incompatible version.
+ */
+dbus_bool_t trace_reader_open(TraceReader *reader, const char *path);
+
+/**
+ * Read and demarshal the next message of a trace.
+ *
+ * @param TraceReader* reader The reader of the trace
+ * @param long long* time_us Set to the time the message was recorded at, in
+ *                           microseconds since the trace was opened
+ *
+ * @returns DBusMessage* The message, which must be unreferenced by the caller.
+ *                       NULL at the end of the trace, or if the trace is
+ *                       truncated or corrupt.
+ */
+DBusMessage *trace_reader_next(TraceReader *reader, long long *time_us);
+
+/**
+ * Close a trace opened with trace_reader_open().
+ *
+ * @param TraceReader* reader The reader of the trace
+ */
+void trace_reader_close(TraceReader *reader);
+
+#endif
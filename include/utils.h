@@ -2,9 +2,42 @@
 #define _UTILS_H_
 
 #include <dbus-1.0/dbus/dbus.h>
+#include <stddef.h>
 
 /**
- * Get the string pointed to by a DBusMessageIter
+ * A borrowed, null-terminated string and its length. The string is owned by
+ * someone else (e.g. a DBusMessage) and is only valid for as long as its owner.
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+} StringView;
+
+/**
+ * Get the string pointed to by a DBusMessageIter without copying it
+ *
+ * @param DBusMessageIter* iter The iterator pointing to the string
+ * @param StringView* view The view to point at the string. This is only valid
+ *                         for the lifetime of the message being iterated.
+ *
+ * @returns dbus_bool_t Returns TRUE if the iter is pointing at a string, object
+ *                      path or signature, otherwise FALSE.
+ */
+dbus_bool_t iter_get_string_view(DBusMessageIter *iter, StringView *view);
+
+/**
+ * Check if a StringView is equal to a string
+ *
+ * @param const StringView* view The view to compare
+ * @param const char* str The string to compare against
+ *
+ * @returns dbus_bool_t Returns TRUE if the strings are equal, otherwise FALSE.
+ */
+dbus_bool_t string_view_equals(const StringView *view, const char *str);
+
+/**
+ * Get a copy of the string pointed to by a DBusMessageIter. Prefer
+ * iter_get_string_view() when the string does not need to outlive the message.
  *
  * @param DBusMessageIter* The iterator pointing to the string
  *
@@ -37,6 +70,21 @@ void print_string_iter(DBusMessageIter *iter);
 dbus_bool_t recurse_iter_of_type(DBusMessageIter *iter,
                                  DBusMessageIter *subiter, const int type);
 
+/**
+ * Check if the value pointed to by a DBusMessageIter has the specified
+ * signature. Unlike comparing against dbus_message_iter_get_signature(), this
+ * compares type codes while walking the value and does not allocate. Since
+ * arrays are homogeneous, only the first element of an array is checked, and
+ * only the element type code of an empty array is checked.
+ *
+ * @param DBusMessageIter* iter The iterator pointing at the value
+ * @param const char* signature A signature of a single complete type
+ *
+ * @returns dbus_bool_t Returns TRUE if the value matches the signature,
+ *                      otherwise FALSE.
+ */
+dbus_bool_t iter_has_signature(DBusMessageIter *iter, const char *signature);
+
 /**
  * Initialize subiter inside the container pointed to be iter if it is of the
  * specified signature.
@@ -128,10 +176,26 @@ dbus_bool_t iter_try_step_to_key(DBusMessageIter *element_iter,
  */
 dbus_bool_t msleep(const long milliseconds);
 
+/**
+ * Get the current time of the monotonic clock
+ *
+ * @returns long long The current monotonic time in milliseconds
+ */
+long long get_monotonic_ms();
+
+/**
+ * Get the current time of the monotonic clock
+ *
+ * @returns long long The current monotonic time in microseconds
+ */
+long long get_monotonic_us();
+
 /**
  * Get an array of paths to polybar's IPC files in the specified directory.
  *
  * @param const char* ipc_path The directory in which to search for IPC files
+ * @param const char* prefix The prefix of the names of the IPC files (e.g.
+ *                           polybar_mqueue)
  * @param char*** ptr_paths A pointer to a pointer to an array of paths that
  *                          will be populated with the paths to the found IPC
  *                          files.
@@ -141,8 +205,8 @@ dbus_bool_t msleep(const long milliseconds);
  * @returns dbus_bool_t Returns TRUE if the directory is successfully searched
  *                      for paths, otherwise FALSE.
  */
-dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, char **ptr_paths[],
-                                  size_t *num_of_paths);
+dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, const char *prefix,
+                                  char **ptr_paths[], size_t *num_of_paths);
 
 /**
  * Join two paths together. This function takes into account if the first path
@@ -173,13 +237,16 @@ char* str_replace_all(const char *str, const char *find, const char *repl);
 /**
  * Truncate the specified string if it longer than the specified maximum length
  * and end the string with trunc while satisfying the max length constraint.
+ * Lengths are display widths (see utf8_width()), and str is only ever cut
+ * between whole characters.
  *
  * @param char* str The string to truncate
- * @param const int max_len The maximum length that this string should be
+ * @param const int max_len The maximum width that this string should be
  * @param char* trunc The string to end str with if its being truncated.
  *
- * @returns char* The truncated string. If str is longer than max_len, str will
+ * @returns char* The truncated string. If str is wider than max_len, str will
  * be cut off at max_len, and the end of the string will be replaced with trunc.
+ * Returns NULL if trunc is wider than max_len.
  */
 char* str_trunc(const char *str, const int max_len, const char *trunc);
 
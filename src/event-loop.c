@@ -0,0 +1,458 @@
+#include "../include/event-loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Maximum number of events handled per epoll_wait() call
+#define EVENT_LOOP_MAX_EVENTS 16
+
+typedef enum {
+    SOURCE_FD,
+    SOURCE_TIMER,
+    SOURCE_SIGNAL,
+    SOURCE_DBUS_WATCH,
+    SOURCE_DBUS_TIMEOUT
+} SourceKind;
+
+/**
+ * A file descriptor watched by the loop. Every DBus watch on the same
+ * descriptor (libdbus uses one watch to read and one to write) shares a single
+ * source, since a descriptor can only be added to epoll once.
+ */
+typedef struct {
+    int fd;
+    SourceKind kind;
+    EventHandler handler;
+    void *user_data;
+    // The DBus timeout handled by a SOURCE_DBUS_TIMEOUT
+    DBusTimeout *timeout;
+    // Set when the source was removed while the events it was returned with by
+    // epoll_wait() may still be handled. Removed sources are freed once every
+    // event was handled.
+    dbus_bool_t removed;
+} EventSource;
+
+static int epoll_fd = -1;
+
+static EventSource **sources = NULL;
+static size_t num_of_sources = 0;
+static size_t sources_capacity = 0;
+
+// Watches of the attached DBus connection
+static DBusWatch **watches = NULL;
+static size_t num_of_watches = 0;
+static size_t watches_capacity = 0;
+
+static DBusConnection *dbus_connection = NULL;
+static DispatchHandler dispatch_handler = NULL;
+
+// Set to FALSE to make event_loop_run() return
+static dbus_bool_t running = FALSE;
+
+dbus_bool_t event_loop_init() {
+    if (epoll_fd == -1) epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    return epoll_fd != -1;
+}
+
+static EventSource *find_source(const int fd) {
+    for (size_t s = 0; s < num_of_sources; s++) {
+        if (sources[s]->fd == fd && !sources[s]->removed) return sources[s];
+    }
+
+    return NULL;
+}
+
+static EventSource *add_source(const int fd, const SourceKind kind,
+                               const uint32_t events, EventHandler handler,
+                               void *user_data) {
+    EventSource *source = (EventSource *)malloc(sizeof(EventSource));
+    struct epoll_event event = {events, {.ptr = source}};
+
+    if (source == NULL) return NULL;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        free(source);
+        return NULL;
+    }
+
+    if (num_of_sources >= sources_capacity) {
+        sources_capacity += 4;
+        sources = (EventSource **)realloc(
+            sources, sources_capacity * sizeof(EventSource *));
+    }
+
+    source->fd = fd;
+    source->kind = kind;
+    source->handler = handler;
+    source->user_data = user_data;
+    source->timeout = NULL;
+    source->removed = FALSE;
+    sources[num_of_sources++] = source;
+
+    return source;
+}
+
+static void remove_source(EventSource *source) {
+    if (source->removed) return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    // Descriptors created by the loop are owned by it
+    if (source->kind != SOURCE_FD && source->kind != SOURCE_DBUS_WATCH)
+        close(source->fd);
+
+    source->fd = -1;
+    source->removed = TRUE;
+}
+
+/**
+ * Free the sources that were removed, once no event can refer to them anymore
+ */
+static void sweep_sources() {
+    size_t kept = 0;
+
+    for (size_t s = 0; s < num_of_sources; s++) {
+        if (sources[s]->removed)
+            free(sources[s]);
+        else
+            sources[kept++] = sources[s];
+    }
+
+    num_of_sources = kept;
+}
+
+dbus_bool_t event_loop_add_fd(int fd, uint32_t events, EventHandler handler,
+                              void *user_data) {
+    return add_source(fd, SOURCE_FD, events, handler, user_data) != NULL;
+}
+
+void event_loop_remove_fd(int fd) {
+    EventSource *source = find_source(fd);
+
+    if (source != NULL) remove_source(source);
+}
+
+int event_loop_add_timer(EventHandler handler, void *user_data) {
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) return -1;
+
+    if (add_source(fd, SOURCE_TIMER, EPOLLIN, handler, user_data) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+dbus_bool_t event_loop_arm_timer(int timer_fd, long delay_ms,
+                                 long interval_ms) {
+    struct itimerspec spec = {{interval_ms / 1000, interval_ms % 1000 * 1000000},
+                              {delay_ms / 1000, delay_ms % 1000 * 1000000}};
+
+    // A zero expiration disarms the timer, so expire after a nanosecond
+    // instead
+    if (delay_ms == 0) spec.it_value.tv_nsec = 1;
+    if (delay_ms < 0) spec.it_value.tv_sec = spec.it_value.tv_nsec = 0;
+
+    return timerfd_settime(timer_fd, 0, &spec, NULL) == 0;
+}
+
+int event_loop_add_signals(const sigset_t *signals, EventHandler handler,
+                           void *user_data) {
+    const int fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd == -1) return -1;
+
+    if (add_source(fd, SOURCE_SIGNAL, EPOLLIN, handler, user_data) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Find an enabled watch of the DBus connection on a descriptor
+ *
+ * @param int fd The descriptor
+ * @param unsigned int flag DBUS_WATCH_READABLE or DBUS_WATCH_WRITABLE to find
+ *                          a watch waiting for it, 0 for any watch
+ */
+static DBusWatch *find_watch(const int fd, const unsigned int flag) {
+    for (size_t w = 0; w < num_of_watches; w++) {
+        DBusWatch *watch = watches[w];
+
+        if (dbus_watch_get_unix_fd(watch) == fd &&
+            dbus_watch_get_enabled(watch) &&
+            (flag == 0 || (dbus_watch_get_flags(watch) & flag)))
+            return watch;
+    }
+
+    return NULL;
+}
+
+/**
+ * Update the epoll events of a descriptor to the flags of its enabled watches
+ */
+static dbus_bool_t sync_watch_fd(const int fd) {
+    EventSource *source = find_source(fd);
+    dbus_bool_t watched = FALSE;
+    uint32_t events = 0;
+
+    for (size_t w = 0; w < num_of_watches; w++) {
+        if (dbus_watch_get_unix_fd(watches[w]) != fd) continue;
+
+        watched = TRUE;
+        if (!dbus_watch_get_enabled(watches[w])) continue;
+
+        const unsigned int flags = dbus_watch_get_flags(watches[w]);
+        if (flags & DBUS_WATCH_READABLE) events |= EPOLLIN;
+        if (flags & DBUS_WATCH_WRITABLE) events |= EPOLLOUT;
+    }
+
+    if (!watched) {
+        if (source != NULL) remove_source(source);
+        return TRUE;
+    }
+
+    if (source == NULL) {
+        return add_source(fd, SOURCE_DBUS_WATCH, events, NULL, NULL) != NULL;
+    }
+
+    struct epoll_event event = {events, {.ptr = source}};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+static dbus_bool_t add_watch(DBusWatch *watch, void *data) {
+    if (num_of_watches >= watches_capacity) {
+        watches_capacity += 2;
+        watches = (DBusWatch **)realloc(
+            watches, watches_capacity * sizeof(DBusWatch *));
+    }
+
+    watches[num_of_watches++] = watch;
+
+    return sync_watch_fd(dbus_watch_get_unix_fd(watch));
+}
+
+static void remove_watch(DBusWatch *watch, void *data) {
+    for (size_t w = 0; w < num_of_watches; w++) {
+        if (watches[w] == watch) {
+            watches[w] = watches[--num_of_watches];
+            break;
+        }
+    }
+
+    sync_watch_fd(dbus_watch_get_unix_fd(watch));
+}
+
+static void watch_toggled(DBusWatch *watch, void *data) {
+    sync_watch_fd(dbus_watch_get_unix_fd(watch));
+}
+
+static void handle_watch_fd(EventSource *source, const uint32_t events) {
+    const int fd = source->fd;
+    const unsigned int problems =
+        (events & EPOLLHUP ? DBUS_WATCH_HANGUP : 0) |
+        (events & EPOLLERR ? DBUS_WATCH_ERROR : 0);
+    dbus_bool_t handled = FALSE;
+    DBusWatch *watch;
+
+    // Handling a watch may add or remove watches, so look the watch up again
+    // for every flag
+    if ((events & EPOLLIN) &&
+        (watch = find_watch(fd, DBUS_WATCH_READABLE)) != NULL) {
+        dbus_watch_handle(watch, DBUS_WATCH_READABLE | problems);
+        handled = TRUE;
+    }
+
+    if ((events & EPOLLOUT) &&
+        (watch = find_watch(fd, DBUS_WATCH_WRITABLE)) != NULL) {
+        dbus_watch_handle(watch, DBUS_WATCH_WRITABLE | problems);
+        handled = TRUE;
+    }
+
+    if (handled || problems == 0) return;
+
+    // Hang ups are reported even without waiting for any event, so let
+    // libdbus notice the connection is gone, or stop watching the descriptor
+    // if no watch is enabled
+    if ((watch = find_watch(fd, 0)) != NULL)
+        dbus_watch_handle(watch, problems);
+    else if (!source->removed)
+        remove_source(source);
+}
+
+static void sync_timeout(DBusTimeout *timeout) {
+    EventSource *source = (EventSource *)dbus_timeout_get_data(timeout);
+    const int interval_ms = dbus_timeout_get_interval(timeout);
+
+    if (source == NULL) return;
+
+    // libdbus timeouts repeat until they are disabled or removed
+    if (dbus_timeout_get_enabled(timeout))
+        event_loop_arm_timer(source->fd, interval_ms, interval_ms);
+    else
+        event_loop_arm_timer(source->fd, -1, 0);
+}
+
+static dbus_bool_t add_timeout(DBusTimeout *timeout, void *data) {
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) return FALSE;
+
+    EventSource *source =
+        add_source(fd, SOURCE_DBUS_TIMEOUT, EPOLLIN, NULL, NULL);
+    if (source == NULL) {
+        close(fd);
+        return FALSE;
+    }
+
+    source->timeout = timeout;
+    dbus_timeout_set_data(timeout, source, NULL);
+    sync_timeout(timeout);
+
+    return TRUE;
+}
+
+static void remove_timeout(DBusTimeout *timeout, void *data) {
+    EventSource *source = (EventSource *)dbus_timeout_get_data(timeout);
+
+    if (source != NULL) remove_source(source);
+    dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void timeout_toggled(DBusTimeout *timeout, void *data) {
+    sync_timeout(timeout);
+}
+
+dbus_bool_t event_loop_attach_dbus(DBusConnection *connection,
+                                   DispatchHandler handler) {
+    dbus_connection = connection;
+    dispatch_handler = handler;
+
+    return dbus_connection_set_watch_functions(connection, add_watch,
+                                               remove_watch, watch_toggled,
+                                               NULL, NULL) &&
+           dbus_connection_set_timeout_functions(connection, add_timeout,
+                                                 remove_timeout,
+                                                 timeout_toggled, NULL, NULL);
+}
+
+/**
+ * Dispatch every message of the DBus connection that was read, including ones
+ * read while blocking for a reply outside of the loop
+ */
+static void dispatch_dbus() {
+    dbus_bool_t dispatched = FALSE;
+
+    if (dbus_connection == NULL) return;
+
+    while (running && dbus_connection_get_dispatch_status(dbus_connection) ==
+                          DBUS_DISPATCH_DATA_REMAINS) {
+        dbus_connection_dispatch(dbus_connection);
+        dispatched = TRUE;
+    }
+
+    if (dispatched && dispatch_handler != NULL)
+        dispatch_handler(dbus_connection);
+}
+
+/**
+ * Read the expirations of a timer, so that it is not ready until it expires
+ * again
+ */
+static void acknowledge_timer(const int fd) {
+    uint64_t expirations;
+
+    while (read(fd, &expirations, sizeof(expirations)) == -1 &&
+           errno == EINTR)
+        ;
+}
+
+static void handle_source(EventSource *source, const uint32_t events) {
+    switch (source->kind) {
+        case SOURCE_DBUS_WATCH:
+            handle_watch_fd(source, events);
+            break;
+        case SOURCE_DBUS_TIMEOUT:
+            acknowledge_timer(source->fd);
+            dbus_timeout_handle(source->timeout);
+            break;
+        case SOURCE_TIMER:
+            acknowledge_timer(source->fd);
+            source->handler(source->fd, events, source->user_data);
+            break;
+        case SOURCE_FD:
+        case SOURCE_SIGNAL:
+            source->handler(source->fd, events, source->user_data);
+            break;
+    }
+}
+
+dbus_bool_t event_loop_run() {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    running = TRUE;
+
+    while (TRUE) {
+        dispatch_dbus();
+
+        if (!running) return TRUE;
+
+        if (dbus_connection != NULL &&
+            !dbus_connection_get_is_connected(dbus_connection))
+            return FALSE;
+
+        const int num =
+            epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+
+        if (num == -1) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+
+        for (int e = 0; e < num; e++) {
+            EventSource *source = (EventSource *)events[e].data.ptr;
+
+            if (!source->removed) handle_source(source, events[e].events);
+        }
+
+        sweep_sources();
+    }
+}
+
+void event_loop_stop() { running = FALSE; }
+
+void event_loop_free() {
+    if (dbus_connection != NULL) {
+        // Removes every watch and timeout of the connection
+        dbus_connection_set_watch_functions(dbus_connection, NULL, NULL, NULL,
+                                            NULL, NULL);
+        dbus_connection_set_timeout_functions(dbus_connection, NULL, NULL,
+                                              NULL, NULL, NULL);
+        dbus_connection = NULL;
+        dispatch_handler = NULL;
+    }
+
+    for (size_t s = 0; s < num_of_sources; s++) remove_source(sources[s]);
+    sweep_sources();
+
+    free(sources);
+    sources = NULL;
+    sources_capacity = 0;
+
+    free(watches);
+    watches = NULL;
+    num_of_watches = 0;
+    watches_capacity = 0;
+
+    if (epoll_fd != -1) close(epoll_fd);
+    epoll_fd = -1;
+}
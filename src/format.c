@@ -0,0 +1,457 @@
+#include "../include/format.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/probes.h"
+#include "../include/text.h"
+#include "../include/utils.h"
+
+dbus_bool_t format_options_valid(const int max_artist_length,
+                                 const int max_title_length,
+                                 const int max_length, const char *trunc) {
+    const int trunc_width = utf8_width(trunc, strlen(trunc));
+
+    return trunc_width <= max_artist_length &&
+           trunc_width <= max_title_length && trunc_width <= max_length;
+}
+
+typedef struct {
+    const char *name;
+    size_t len;
+    FormatTokenType type;
+} FormatTokenName;
+
+static const FormatTokenName TOKEN_NAMES[] = {
+    {"%artist%", 8, FORMAT_TOKEN_ARTIST},
+    {"%title%", 7, FORMAT_TOKEN_TITLE},
+    {"%album%", 7, FORMAT_TOKEN_ALBUM},
+    {"%tracknumber%", 13, FORMAT_TOKEN_TRACKNUMBER},
+    {"%length%", 8, FORMAT_TOKEN_LENGTH},
+    {"%status%", 8, FORMAT_TOKEN_STATUS}};
+
+static const size_t NUM_OF_TOKEN_NAMES =
+    sizeof(TOKEN_NAMES) / sizeof(TOKEN_NAMES[0]);
+
+/**
+ * Output buffer of format_render(). Appends are cut off at limit, which is the
+ * width in columns the output is truncated at, and at cap, which is the size
+ * of the buffer in bytes.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    int width;
+    int limit;
+    size_t cap;
+    // TRUE if an append was cut off at limit, after which nothing else is
+    // appended until limit is raised
+    dbus_bool_t cut;
+    // TRUE if an append was cut off because the buffer is full, after which
+    // nothing else is appended
+    dbus_bool_t full;
+} FormatOutput;
+
+/**
+ * Value of a token for a single render. Artist and title are indexed only
+ * when they have to be truncated.
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+    int width;
+} FormatValue;
+
+static dbus_bool_t add_token(StatusFormat *fmt, const FormatTokenType type,
+                             const char *text, const size_t len) {
+    // Merge literal text split by a lone %
+    if (type == FORMAT_TOKEN_TEXT && fmt->num_of_tokens > 0) {
+        FormatToken *last = &fmt->tokens[fmt->num_of_tokens - 1];
+
+        if (last->type == FORMAT_TOKEN_TEXT &&
+            last->text + last->len == text) {
+            last->len += len;
+            last->width += utf8_width(text, len);
+            return TRUE;
+        }
+    }
+
+    if (fmt->num_of_tokens == fmt->max_tokens) {
+        const size_t max_tokens =
+            fmt->max_tokens > 0 ? fmt->max_tokens * 2 : 16;
+        FormatToken *tokens = (FormatToken *)realloc(
+            fmt->tokens, max_tokens * sizeof(FormatToken));
+
+        if (tokens == NULL) return FALSE;
+
+        fmt->tokens = tokens;
+        fmt->max_tokens = max_tokens;
+    }
+
+    FormatToken *token = &fmt->tokens[fmt->num_of_tokens++];
+    token->type = type;
+    token->text = text;
+    token->len = len;
+    token->width = type == FORMAT_TOKEN_TEXT ? utf8_width(text, len) : 0;
+    token->end = 0;
+
+    return TRUE;
+}
+
+/**
+ * Split a format string into the tokens of fmt
+ */
+static dbus_bool_t compile_tokens(StatusFormat *fmt, const char *format) {
+    size_t open_segments[FORMAT_MAX_DEPTH];
+    size_t depth = 0;
+    const char *c = format;
+
+    while (*c != '\0') {
+        dbus_bool_t matched = FALSE;
+
+        if (c[0] == '%' && c[1] == '[') {
+            if (depth == FORMAT_MAX_DEPTH) return FALSE;
+
+            open_segments[depth++] = fmt->num_of_tokens;
+            if (!add_token(fmt, FORMAT_TOKEN_COND_BEGIN, c, 2)) return FALSE;
+            c += 2;
+            continue;
+        }
+
+        if (c[0] == '%' && c[1] == ']') {
+            if (depth == 0) return FALSE;
+
+            if (!add_token(fmt, FORMAT_TOKEN_COND_END, c, 2)) return FALSE;
+            fmt->tokens[open_segments[--depth]].end = fmt->num_of_tokens - 1;
+            c += 2;
+            continue;
+        }
+
+        if (c[0] == '%') {
+            for (size_t n = 0; n < NUM_OF_TOKEN_NAMES && !matched; n++) {
+                const FormatTokenName *name = &TOKEN_NAMES[n];
+
+                if (strncmp(c, name->name, name->len) == 0) {
+                    if (!add_token(fmt, name->type, c, name->len))
+                        return FALSE;
+                    c += name->len;
+                    matched = TRUE;
+                }
+            }
+        }
+
+        if (!matched) {
+            // Literal text up to the next %
+            const char *next = strchr(c + 1, '%');
+            const size_t len = next != NULL ? (size_t)(next - c) : strlen(c);
+
+            if (!add_token(fmt, FORMAT_TOKEN_TEXT, c, len)) return FALSE;
+            c += len;
+        }
+    }
+
+    return depth == 0;
+}
+
+dbus_bool_t format_compile(StatusFormat *fmt, const char *format,
+                           const int max_artist_length,
+                           const int max_title_length, const int max_length,
+                           const char *trunc) {
+    if (!format_options_valid(max_artist_length, max_title_length, max_length,
+                              trunc))
+        return FALSE;
+
+    fmt->tokens = NULL;
+    fmt->num_of_tokens = 0;
+    fmt->max_tokens = 0;
+    fmt->max_artist_length = max_artist_length;
+    fmt->max_title_length = max_title_length;
+    fmt->max_length = max_length;
+    fmt->trunc = trunc;
+    fmt->trunc_len = strlen(trunc);
+    fmt->trunc_width = utf8_width(trunc, fmt->trunc_len);
+
+    if (!compile_tokens(fmt, format)) {
+        format_free(fmt);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void format_free(StatusFormat *fmt) {
+    free(fmt->tokens);
+    fmt->tokens = NULL;
+    fmt->num_of_tokens = 0;
+    fmt->max_tokens = 0;
+}
+
+static void output_append(FormatOutput *out, const char *str, size_t len,
+                          int width) {
+    if (out->cut || out->full) return;
+
+    if (out->width + width > out->limit) {
+        // Cut off at the last whole character that fits in the limit, and
+        // don't append anything after the cut
+        const TextCut cut = utf8_cut(str, len, out->limit - out->width);
+
+        len = cut.len;
+        width = cut.width;
+        out->cut = TRUE;
+    }
+
+    if (out->len + len > out->cap) {
+        // Don't cut a multi-byte character in half
+        len = out->cap - out->len;
+        while (len > 0 && (str[len] & 0xC0) == 0x80) len--;
+        width = utf8_width(str, len);
+        out->full = TRUE;
+    }
+
+    memcpy(out->buf + out->len, str, len);
+    out->len += len;
+    out->width += width;
+}
+
+static void output_append_value(FormatOutput *out, const FormatValue *value,
+                                const TextCut *cut, const StatusFormat *fmt) {
+    // Same as str_trunc(), cut is NULL if the value is not truncated
+    if (cut != NULL) {
+        output_append(out, value->str, cut->len, cut->width);
+        output_append(out, fmt->trunc, fmt->trunc_len, fmt->trunc_width);
+    } else {
+        output_append(out, value->str, value->len, value->width);
+    }
+}
+
+static void set_value(FormatValue *value, const TrackState *track,
+                      const unsigned int field, const char *str) {
+    if (track->fields & field) {
+        value->str = str;
+        value->len = strlen(str);
+        value->width = utf8_width(str, value->len);
+    } else {
+        value->str = "";
+        value->len = 0;
+        value->width = 0;
+    }
+}
+
+/**
+ * Cut value to fit in max_len columns along with the trunc string, if it is
+ * wider than max_len. The index of indexed is only rebuilt if it is not of
+ * value. Returns NULL if the value is not truncated.
+ */
+static const TextCut *truncate_value(const FormatValue *value,
+                                     const int max_len, const StatusFormat *fmt,
+                                     FormatIndexedValue *indexed,
+                                     TextCut *cut) {
+    if (value->width <= max_len) return NULL;
+
+    if (value->width >= 0 && (size_t)value->width == value->len) {
+        // Single byte characters, which is most titles, don't need an index
+        // (see text_index_build())
+        cut->len = max_len - fmt->trunc_width;
+        cut->width = max_len - fmt->trunc_width;
+    } else {
+        // Comparing the value is much cheaper than decoding it again
+        if (!indexed->valid || indexed->len != value->len ||
+            memcmp(indexed->str, value->str, value->len) != 0) {
+            memcpy(indexed->str, value->str, value->len);
+            indexed->str[value->len] = '\0';
+            indexed->len = value->len;
+            indexed->valid = TRUE;
+            text_index_build(&indexed->index, indexed->str, indexed->len);
+        }
+
+        *cut = text_index_cut(&indexed->index, max_len - fmt->trunc_width);
+    }
+
+    return cut;
+}
+
+static dbus_bool_t is_value_token(const FormatTokenType type) {
+    return type != FORMAT_TOKEN_TEXT && type != FORMAT_TOKEN_COND_BEGIN &&
+           type != FORMAT_TOKEN_COND_END;
+}
+
+/**
+ * Check if none of the tokens directly inside of the conditional segment
+ * beginning at token begin are empty. Nested segments are not checked.
+ */
+static dbus_bool_t segment_shown(const StatusFormat *fmt, const size_t begin,
+                                 const FormatValue values[]) {
+    for (size_t t = begin + 1; t < fmt->tokens[begin].end; t++) {
+        const FormatToken *token = &fmt->tokens[t];
+
+        if (token->type == FORMAT_TOKEN_COND_BEGIN) {
+            t = token->end;
+        } else if (is_value_token(token->type) &&
+                   values[token->type].len == 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Get the token after token t, skipping the conditional segment beginning at
+ * t if it is hidden
+ */
+static size_t next_shown(const StatusFormat *fmt, const size_t t,
+                         const FormatValue values[]) {
+    const FormatToken *token = &fmt->tokens[t];
+
+    if (token->type == FORMAT_TOKEN_COND_BEGIN &&
+        !segment_shown(fmt, t, values))
+        return token->end + 1;
+
+    return t + 1;
+}
+
+void format_cache_clear(FormatCache *cache) {
+    cache->artist.valid = FALSE;
+    cache->title.valid = FALSE;
+}
+
+size_t format_render(const StatusFormat *fmt, const TrackState *track,
+                     FormatCache *cache, char *buf, const size_t size) {
+    FormatValue values[FORMAT_TOKEN_COND_BEGIN];
+    char tracknumber[16] = "";
+    char length[32] = "";
+    long long total = 0;
+    int num_of_artists = 0;
+    int num_of_titles = 0;
+    FormatCache uncached;
+    TextCut artist_cut;
+    TextCut title_cut;
+    const TextCut *trunc_artist = NULL;
+    const TextCut *trunc_title = NULL;
+
+    if (size == 0) return 0;
+
+    PROBE2(format_render_entry, fmt, track);
+
+    if (cache == NULL) {
+        format_cache_clear(&uncached);
+        cache = &uncached;
+    }
+
+    // Resolve the value of every token once
+    if (track->fields & TRACK_HAS_TRACKNUMBER)
+        snprintf(tracknumber, sizeof(tracknumber), "%d", track->tracknumber);
+
+    if ((track->fields & TRACK_HAS_LENGTH) && track->length >= 0) {
+        const long long seconds = track->length / (1000 * 1000);
+
+        if (seconds >= 3600) {
+            snprintf(length, sizeof(length), "%lld:%02lld:%02lld",
+                     seconds / 3600, seconds / 60 % 60, seconds % 60);
+        } else {
+            snprintf(length, sizeof(length), "%lld:%02lld", seconds / 60,
+                     seconds % 60);
+        }
+    }
+
+    values[FORMAT_TOKEN_TEXT].str = "";
+    values[FORMAT_TOKEN_TEXT].len = 0;
+    values[FORMAT_TOKEN_TEXT].width = 0;
+    set_value(&values[FORMAT_TOKEN_ARTIST], track, TRACK_HAS_ARTISTS,
+              track->artists);
+    set_value(&values[FORMAT_TOKEN_TITLE], track, TRACK_HAS_TITLE,
+              track->title);
+    set_value(&values[FORMAT_TOKEN_ALBUM], track, TRACK_HAS_ALBUM,
+              track->album);
+    set_value(&values[FORMAT_TOKEN_TRACKNUMBER], track, TRACK_HAS_TRACKNUMBER,
+              tracknumber);
+    set_value(&values[FORMAT_TOKEN_LENGTH], track, TRACK_HAS_LENGTH, length);
+    set_value(&values[FORMAT_TOKEN_STATUS], track, TRACK_HAS_STATUS,
+              track->status);
+
+    // Measure the width of the untruncated output, skipping hidden conditional
+    // segments
+    for (size_t t = 0; t < fmt->num_of_tokens; t = next_shown(fmt, t, values)) {
+        const FormatToken *token = &fmt->tokens[t];
+
+        if (token->type == FORMAT_TOKEN_TEXT) {
+            total += token->width;
+        } else if (is_value_token(token->type)) {
+            total += values[token->type].width;
+            if (token->type == FORMAT_TOKEN_ARTIST) num_of_artists++;
+            if (token->type == FORMAT_TOKEN_TITLE) num_of_titles++;
+        }
+    }
+
+    // Truncate artist and title only if total untruncated width > max_length
+    // and max_length was specified
+    const dbus_bool_t truncate =
+        fmt->max_length == INT_MAX || total > fmt->max_length;
+
+    if (truncate) {
+        const FormatValue *artist = &values[FORMAT_TOKEN_ARTIST];
+        const FormatValue *title = &values[FORMAT_TOKEN_TITLE];
+
+        // Every artist and title token is cut at the same place, so each is
+        // indexed once
+        if (num_of_artists > 0)
+            trunc_artist = truncate_value(artist, fmt->max_artist_length, fmt,
+                                          &cache->artist, &artist_cut);
+        if (num_of_titles > 0)
+            trunc_title = truncate_value(title, fmt->max_title_length, fmt,
+                                         &cache->title, &title_cut);
+
+        if (trunc_artist != NULL)
+            total -= num_of_artists * (artist->width - trunc_artist->width -
+                                       fmt->trunc_width);
+        if (trunc_title != NULL)
+            total -= num_of_titles * (title->width - trunc_title->width -
+                                      fmt->trunc_width);
+    }
+
+    const dbus_bool_t truncate_output = truncate && total > fmt->max_length;
+
+    FormatOutput out = {buf, 0, 0, INT_MAX, size - 1, FALSE, FALSE};
+    if (truncate_output) out.limit = fmt->max_length - fmt->trunc_width;
+
+    for (size_t t = 0; t < fmt->num_of_tokens; t = next_shown(fmt, t, values)) {
+        const FormatToken *token = &fmt->tokens[t];
+
+        switch (token->type) {
+            case FORMAT_TOKEN_TEXT:
+                output_append(&out, token->text, token->len, token->width);
+                break;
+            case FORMAT_TOKEN_ARTIST:
+                output_append_value(&out, &values[token->type], trunc_artist,
+                                    fmt);
+                break;
+            case FORMAT_TOKEN_TITLE:
+                output_append_value(&out, &values[token->type], trunc_title,
+                                    fmt);
+                break;
+            case FORMAT_TOKEN_COND_BEGIN:
+            case FORMAT_TOKEN_COND_END:
+                break;
+            default:
+                output_append(&out, values[token->type].str,
+                              values[token->type].len,
+                              values[token->type].width);
+                break;
+        }
+    }
+
+    if (truncate_output) {
+        out.limit = fmt->max_length;
+        out.cut = FALSE;
+        output_append(&out, fmt->trunc, fmt->trunc_len, fmt->trunc_width);
+    }
+
+    buf[out.len] = '\0';
+
+    PROBE2(format_render_return, buf, out.len);
+
+    return out.len;
+}
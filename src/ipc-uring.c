@@ -0,0 +1,288 @@
+#include "../include/ipc-uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int ring_fd = -1;
+
+// Shared rings mapped from the kernel
+static void *sq_ring = MAP_FAILED;
+static size_t sq_ring_size = 0;
+static void *cq_ring = MAP_FAILED;
+static size_t cq_ring_size = 0;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static size_t sqes_size = 0;
+
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+
+// Registered descriptor of every slot, -1 if the slot is free
+static int file_slots[IPC_URING_MAX_FILES];
+// TRUE if the kernel accepted the sparse set of registered files
+static dbus_bool_t files_registered = FALSE;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(unsigned int to_submit, unsigned int min_complete,
+                          unsigned int flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int io_uring_register(unsigned int opcode, void *arg,
+                             unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static dbus_bool_t supports_write() {
+    const size_t size = sizeof(struct io_uring_probe) +
+                        IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    dbus_bool_t supported = FALSE;
+
+    if (probe == NULL) return FALSE;
+
+    // Probing was added along with IORING_OP_WRITE, so a kernel without it
+    // can't write either
+    if (io_uring_register(IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+        probe->last_op >= IORING_OP_WRITE)
+        supported = probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED;
+
+    free(probe);
+    return supported;
+}
+
+static dbus_bool_t map_rings(const struct io_uring_params *p) {
+    sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    cq_ring_size =
+        p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both rings share a single mapping on Linux 5.4+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return FALSE;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return FALSE;
+    }
+
+    sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring_fd,
+                                       IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return FALSE;
+
+    sq_head = (unsigned int *)((char *)sq_ring + p->sq_off.head);
+    sq_tail = (unsigned int *)((char *)sq_ring + p->sq_off.tail);
+    sq_mask = (unsigned int *)((char *)sq_ring + p->sq_off.ring_mask);
+    sq_array = (unsigned int *)((char *)sq_ring + p->sq_off.array);
+    cq_head = (unsigned int *)((char *)cq_ring + p->cq_off.head);
+    cq_tail = (unsigned int *)((char *)cq_ring + p->cq_off.tail);
+    cq_mask = (unsigned int *)((char *)cq_ring + p->cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + p->cq_off.cqes);
+
+    return TRUE;
+}
+
+dbus_bool_t ipc_uring_init() {
+    struct io_uring_params params;
+
+    if (ring_fd != -1) return TRUE;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = io_uring_setup(IPC_URING_ENTRIES, &params);
+    if (ring_fd == -1) return FALSE;
+
+    if (!supports_write() || !map_rings(&params)) {
+        ipc_uring_free();
+        return FALSE;
+    }
+
+    // Register an empty set of files that is filled in as bars are opened
+    for (int s = 0; s < IPC_URING_MAX_FILES; s++) file_slots[s] = -1;
+    files_registered = io_uring_register(IORING_REGISTER_FILES, file_slots,
+                                         IPC_URING_MAX_FILES) == 0;
+
+    return TRUE;
+}
+
+static dbus_bool_t update_file_slot(const int file_slot, int fd) {
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = file_slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+
+    return io_uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+int ipc_uring_register_fd(int fd) {
+    if (!files_registered) return -1;
+
+    for (int s = 0; s < IPC_URING_MAX_FILES; s++) {
+        if (file_slots[s] != -1) continue;
+
+        if (!update_file_slot(s, fd)) return -1;
+
+        file_slots[s] = fd;
+        return s;
+    }
+
+    return -1;
+}
+
+void ipc_uring_unregister_fd(int file_slot) {
+    if (file_slot < 0 || file_slot >= IPC_URING_MAX_FILES) return;
+
+    update_file_slot(file_slot, -1);
+    file_slots[file_slot] = -1;
+}
+
+/**
+ * Move every completion into the result of its write
+ *
+ * @returns unsigned int The number of completions
+ */
+static unsigned int reap_completions(IpcWrite writes[]) {
+    unsigned int head = *cq_head;
+    const unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int num = 0;
+
+    for (; head != tail; head++, num++) {
+        const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        writes[cqe->user_data].result = cqe->res;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    return num;
+}
+
+/**
+ * Submit a batch of at most IPC_URING_ENTRIES writes and wait for them
+ */
+static dbus_bool_t write_batch(IpcWrite writes[], const size_t first,
+                               const unsigned int num) {
+    const unsigned int start = *sq_tail;
+    unsigned int tail = start;
+
+    for (size_t w = first; w < first + num; w++, tail++) {
+        const unsigned int index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        if (writes[w].file_slot >= 0) {
+            sqe->fd = writes[w].file_slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = writes[w].fd;
+        }
+        sqe->addr = (uint64_t)(uintptr_t)writes[w].buf;
+        sqe->len = writes[w].len;
+        // FIFOs have no offset, write at the current position
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = w;
+
+        sq_array[index] = index;
+    }
+
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned int completed = 0;
+    unsigned int submitted = 0;
+
+    // Submit the whole batch and wait for it with a single call. Writes to a
+    // non-blocking FIFO complete right away, so the call rarely has to be
+    // repeated.
+    while (completed < num) {
+        const int res = io_uring_enter(num - submitted, num - completed,
+                                       IORING_ENTER_GETEVENTS);
+
+        // The kernel consumes submissions by advancing the head, even when
+        // interrupted
+        submitted = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - start;
+        completed += reap_completions(writes);
+
+        if (res == -1 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            // Writes that were never submitted are left to be retried
+            for (size_t w = first + submitted; w < first + num; w++)
+                writes[w].result = -EAGAIN;
+
+            // Drop them from the ring, so they are not submitted later
+            __atomic_store_n(sq_tail, start + submitted, __ATOMIC_RELEASE);
+
+            // Wait for the submitted ones, their buffers must stay valid
+            while (completed < submitted) {
+                if (io_uring_enter(0, submitted - completed,
+                                   IORING_ENTER_GETEVENTS) == -1 &&
+                    errno != EINTR)
+                    return FALSE;
+                completed += reap_completions(writes);
+            }
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+dbus_bool_t ipc_uring_write(IpcWrite writes[], size_t num_of_writes) {
+    if (ring_fd == -1) return FALSE;
+
+    for (size_t first = 0; first < num_of_writes; first += IPC_URING_ENTRIES) {
+        const size_t left = num_of_writes - first;
+        const unsigned int num =
+            left < IPC_URING_ENTRIES ? left : IPC_URING_ENTRIES;
+
+        if (!write_batch(writes, first, num)) {
+            for (size_t w = first + num; w < num_of_writes; w++)
+                writes[w].result = -EAGAIN;
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+void ipc_uring_free() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    sqes = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+    sq_ring = MAP_FAILED;
+
+    // Closing the ring also unregisters its files
+    if (ring_fd != -1) close(ring_fd);
+    ring_fd = -1;
+
+    for (int s = 0; s < IPC_URING_MAX_FILES; s++) file_slots[s] = -1;
+    files_registered = FALSE;
+}
@@ -0,0 +1,230 @@
+#include "../include/ipc-writer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/event-loop.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/probes.h"
+
+// Time between checks of whether the queue was drained by ipc_writer_flush()
+const long IPC_WRITER_FLUSH_POLL_NS = 100000;
+
+// Bounds of the backoff between retries of messages that bars did not accept
+const long IPC_RETRY_MIN_DELAY_MS = 10;
+const long IPC_RETRY_MAX_DELAY_MS = 1000;
+
+typedef struct {
+    char messages[IPC_UPDATE_MAX_MSGS][IPC_MAX_MSG_LEN];
+    size_t num_of_msgs;
+    unsigned int refresh;
+    long long origin_us;
+} IpcUpdate;
+
+static IpcUpdate queue[IPC_QUEUE_SIZE];
+// Number of updates ever queued, only written by the producer
+static size_t queue_tail = 0;
+// Number of updates ever delivered, only written by the background thread
+static size_t queue_head = 0;
+// Largest number of updates waiting at once, only used by the producer
+static size_t max_depth = 0;
+
+// Posted for every update queued and once more to stop the background thread,
+// so that it can sleep while the queue is empty
+static sem_t queued;
+
+static pthread_t writer_thread;
+// TRUE while the background thread is running
+static dbus_bool_t started = FALSE;
+// Set to make the background thread exit once the queue is empty
+static dbus_bool_t stopping = FALSE;
+
+// Timer that retries the messages bars did not accept, -1 if there is none
+static int retry_timer_fd = -1;
+// Delay the retry timer was last armed with, 0 if it is disarmed. Only used by
+// the thread delivering updates.
+static long retry_delay_ms = 0;
+
+/**
+ * Arm the retry timer while bars still have messages queued, or disarm it once
+ * they accepted them all. The delay doubles while bars don't accept any
+ * message, and starts over once they do.
+ *
+ * @param size_t num_before The number of messages queued before the delivery
+ */
+static void schedule_retry(const size_t num_before) {
+    const int timer_fd = __atomic_load_n(&retry_timer_fd, __ATOMIC_ACQUIRE);
+    const size_t num_pending = ipc_endpoints_pending();
+
+    if (timer_fd == -1) return;
+
+    if (num_pending == 0) {
+        if (retry_delay_ms > 0) event_loop_arm_timer(timer_fd, -1, 0);
+        retry_delay_ms = 0;
+        return;
+    }
+
+    if (retry_delay_ms == 0 || num_pending < num_before)
+        retry_delay_ms = IPC_RETRY_MIN_DELAY_MS;
+    else if (retry_delay_ms < IPC_RETRY_MAX_DELAY_MS)
+        retry_delay_ms *= 2;
+
+    if (retry_delay_ms > IPC_RETRY_MAX_DELAY_MS)
+        retry_delay_ms = IPC_RETRY_MAX_DELAY_MS;
+
+    event_loop_arm_timer(timer_fd, retry_delay_ms, 0);
+}
+
+static dbus_bool_t deliver(const char *messages[], size_t num_of_msgs,
+                           unsigned int refresh, long long origin_us) {
+    PROBE2(ipc_send_entry, num_of_msgs, origin_us);
+
+    // Apply any bars that were started or stopped since the last message
+    ipc_endpoints_refresh();
+
+    const size_t num_before = ipc_endpoints_pending();
+
+    const dbus_bool_t sent =
+        ipc_send_messages(messages, num_of_msgs, refresh, origin_us);
+
+    schedule_retry(num_before);
+
+    PROBE1(ipc_send_return, sent);
+
+    return sent;
+}
+
+static void *deliver_updates(void *arg) {
+    while (TRUE) {
+        while (sem_wait(&queued) == -1 && errno == EINTR)
+            ;
+
+        // Pairs with the release in ipc_writer_send(), so the update is
+        // completely written before it is read here
+        const size_t tail = __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE);
+
+        if (queue_head == tail) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        const IpcUpdate *update = &queue[queue_head % IPC_QUEUE_SIZE];
+        const char *messages[IPC_UPDATE_MAX_MSGS];
+
+        for (size_t m = 0; m < update->num_of_msgs; m++)
+            messages[m] = update->messages[m];
+
+        if (!deliver(messages, update->num_of_msgs, update->refresh,
+                     update->origin_us))
+            log_record(LOG_LEVEL_WARN, "Failed to update every bar",
+                       "messages=%zu", update->num_of_msgs);
+
+        // The slot can be reused once this is seen by the producer
+        __atomic_store_n(&queue_head, queue_head + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+dbus_bool_t ipc_writer_start() {
+    if (started) return TRUE;
+
+    if (sem_init(&queued, 0, 0) == -1) return FALSE;
+
+    stopping = FALSE;
+    max_depth = 0;
+    started = pthread_create(&writer_thread, NULL, deliver_updates, NULL) == 0;
+
+    if (!started) sem_destroy(&queued);
+
+    return started;
+}
+
+dbus_bool_t ipc_writer_send(const char *messages[], size_t num_of_msgs,
+                            unsigned int refresh, long long origin_us) {
+    if (!started) return deliver(messages, num_of_msgs, refresh, origin_us);
+
+    if (num_of_msgs > IPC_UPDATE_MAX_MSGS) return FALSE;
+
+    const size_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+
+    if (queue_tail - head == IPC_QUEUE_SIZE) {
+        metrics_count(METRIC_UPDATES_DROPPED, 1);
+        return FALSE;
+    }
+
+    IpcUpdate *update = &queue[queue_tail % IPC_QUEUE_SIZE];
+
+    for (size_t m = 0; m < num_of_msgs; m++) {
+        const size_t len = strlen(messages[m]);
+
+        // Reject messages that can't be framed like ipc_send_messages() does
+        // rather than queueing them cut off
+        if (len + 2 > IPC_MAX_MSG_LEN) {
+            metrics_count(METRIC_IPC_FAILURES, 1);
+            return FALSE;
+        }
+
+        memcpy(update->messages[m], messages[m], len + 1);
+    }
+
+    update->num_of_msgs = num_of_msgs;
+    update->refresh = refresh;
+    update->origin_us = origin_us;
+
+    __atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+    sem_post(&queued);
+
+    const size_t depth = queue_tail - head;
+    if (depth > max_depth) max_depth = depth;
+
+    return TRUE;
+}
+
+void ipc_writer_set_retry_timer(int timer_fd) {
+    __atomic_store_n(&retry_timer_fd, timer_fd, __ATOMIC_RELEASE);
+}
+
+dbus_bool_t ipc_writer_full() {
+    return started && queue_tail - __atomic_load_n(&queue_head,
+                                                   __ATOMIC_ACQUIRE) ==
+                          IPC_QUEUE_SIZE;
+}
+
+dbus_bool_t ipc_writer_refresh() {
+    if (ipc_writer_full()) return TRUE;
+
+    // An update without messages only refreshes the endpoints and flushes
+    // what is still queued for them
+    return ipc_writer_send(NULL, 0, 0, 0);
+}
+
+size_t ipc_writer_max_depth() { return max_depth; }
+
+void ipc_writer_flush() {
+    const struct timespec poll = {0, IPC_WRITER_FLUSH_POLL_NS};
+
+    while (started &&
+           __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE) != queue_tail)
+        nanosleep(&poll, NULL);
+}
+
+void ipc_writer_stop() {
+    if (!started) return;
+
+    __atomic_store_n(&stopping, TRUE, __ATOMIC_RELEASE);
+    sem_post(&queued);
+
+    pthread_join(writer_thread, NULL);
+    sem_destroy(&queued);
+
+    // The timer may belong to an event loop that is freed next
+    ipc_writer_set_retry_timer(-1);
+    retry_delay_ms = 0;
+
+    started = FALSE;
+}
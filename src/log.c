@@ -0,0 +1,257 @@
+#include "../include/log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Maximum number of records taken out of the ring at once by the background
+// thread
+#define LOG_BATCH_SIZE 32
+
+typedef struct {
+    struct timespec time;
+    LogLevel level;
+    char text[LOG_MAX_RECORD_LEN];
+} LogRecord;
+
+static const char *LEVEL_NAMES[] = {"error", "warn", "info", "debug"};
+
+static LogLevel current_level = LOG_LEVEL_INFO;
+
+// Records waiting to be written, in the order they were logged
+static LogRecord ring[LOG_RING_SIZE];
+static size_t ring_head = 0;
+static size_t ring_count = 0;
+// Records dropped because the ring was full, since the last were reported
+static unsigned long dropped = 0;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when records are added or the thread has to stop
+static pthread_cond_t ring_filled = PTHREAD_COND_INITIALIZER;
+// Signaled when the thread wrote everything it took out of the ring
+static pthread_cond_t ring_drained = PTHREAD_COND_INITIALIZER;
+
+static pthread_t writer_thread;
+// TRUE while the background thread is running
+static dbus_bool_t started = FALSE;
+// Set to make the background thread exit once the ring is empty
+static dbus_bool_t stopping = FALSE;
+// TRUE while the background thread is writing records it took from the ring
+static dbus_bool_t writing = FALSE;
+
+dbus_bool_t log_parse_level(const char *name, LogLevel *level) {
+    for (int l = LOG_LEVEL_ERROR; l <= LOG_LEVEL_DEBUG; l++) {
+        if (strcmp(name, LEVEL_NAMES[l]) == 0) {
+            *level = l;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+void log_set_level(LogLevel level) {
+    __atomic_store_n(&current_level, level, __ATOMIC_RELAXED);
+}
+
+dbus_bool_t log_enabled(LogLevel level) {
+    return level <= __atomic_load_n(&current_level, __ATOMIC_RELAXED);
+}
+
+static void write_all(const int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        const ssize_t n = write(fd, buf, len);
+
+        if (n == -1 && errno == EINTR) continue;
+        // Nothing can be done if the output is gone
+        if (n <= 0) return;
+
+        buf += n;
+        len -= n;
+    }
+}
+
+static void write_record(const LogRecord *record) {
+    char line[LOG_MAX_RECORD_LEN + 64];
+    struct tm tm;
+
+    gmtime_r(&record->time.tv_sec, &tm);
+
+    int len = strftime(line, sizeof(line), "ts=%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(line + len, sizeof(line) - len, ".%03ldZ level=%s %s\n",
+                    record->time.tv_nsec / (1000 * 1000),
+                    LEVEL_NAMES[record->level], record->text);
+
+    // The text was cut off, so end the line properly
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    write_all(record->level <= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO,
+              line, len);
+}
+
+/**
+ * Format the message and fields of a record, quoting the message
+ */
+static void format_record(LogRecord *record, const char *msg,
+                          const char *fields, va_list args) {
+    char *text = record->text;
+    // Leave room for the closing quote and null char
+    char *const end = text + LOG_MAX_RECORD_LEN - 2;
+
+    text += snprintf(text, LOG_MAX_RECORD_LEN, "%s", "msg=\"");
+
+    for (const char *c = msg; *c != '\0' && text < end - 1; c++) {
+        if (*c == '"' || *c == '\\') {
+            *text++ = '\\';
+            *text++ = *c;
+        } else if (*c == '\n') {
+            *text++ = '\\';
+            *text++ = 'n';
+        } else {
+            *text++ = *c;
+        }
+    }
+
+    *text++ = '"';
+    *text = '\0';
+
+    if (fields != NULL && text < end) {
+        *text++ = ' ';
+        vsnprintf(text, record->text + LOG_MAX_RECORD_LEN - text, fields,
+                  args);
+    }
+}
+
+void log_record(LogLevel level, const char *msg, const char *fields, ...) {
+    LogRecord record;
+    va_list args;
+
+    if (!log_enabled(level)) return;
+
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    record.level = level;
+
+    va_start(args, fields);
+    format_record(&record, msg, fields, args);
+    va_end(args);
+
+    pthread_mutex_lock(&ring_lock);
+
+    if (!started) {
+        pthread_mutex_unlock(&ring_lock);
+        write_record(&record);
+        return;
+    }
+
+    if (ring_count == LOG_RING_SIZE) {
+        dropped++;
+    } else {
+        const size_t tail = (ring_head + ring_count) % LOG_RING_SIZE;
+
+        memcpy(&ring[tail], &record, sizeof(record));
+        ring_count++;
+        pthread_cond_signal(&ring_filled);
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void *write_records(void *arg) {
+    static LogRecord batch[LOG_BATCH_SIZE];
+
+    pthread_mutex_lock(&ring_lock);
+
+    while (TRUE) {
+        while (ring_count == 0 && dropped == 0 && !stopping)
+            pthread_cond_wait(&ring_filled, &ring_lock);
+
+        if (ring_count == 0 && dropped == 0 && stopping) break;
+
+        // Take a batch of records, so they can be written without holding the
+        // lock
+        size_t num = 0;
+        while (num < LOG_BATCH_SIZE && ring_count > 0) {
+            memcpy(&batch[num++], &ring[ring_head], sizeof(LogRecord));
+            ring_head = (ring_head + 1) % LOG_RING_SIZE;
+            ring_count--;
+        }
+
+        const unsigned long num_of_dropped = dropped;
+        dropped = 0;
+        writing = TRUE;
+
+        pthread_mutex_unlock(&ring_lock);
+
+        for (size_t r = 0; r < num; r++) write_record(&batch[r]);
+
+        if (num_of_dropped > 0) {
+            LogRecord record;
+
+            clock_gettime(CLOCK_REALTIME, &record.time);
+            record.level = LOG_LEVEL_WARN;
+            snprintf(record.text, sizeof(record.text),
+                     "msg=\"Dropped log records\" dropped=%lu",
+                     num_of_dropped);
+            write_record(&record);
+        }
+
+        pthread_mutex_lock(&ring_lock);
+
+        writing = FALSE;
+        if (ring_count == 0) pthread_cond_broadcast(&ring_drained);
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+
+    return NULL;
+}
+
+dbus_bool_t log_start() {
+    pthread_mutex_lock(&ring_lock);
+
+    if (!started) {
+        stopping = FALSE;
+        started = pthread_create(&writer_thread, NULL, write_records, NULL) == 0;
+    }
+
+    const dbus_bool_t res = started;
+    pthread_mutex_unlock(&ring_lock);
+
+    return res;
+}
+
+void log_flush() {
+    pthread_mutex_lock(&ring_lock);
+
+    while (started && (ring_count > 0 || writing))
+        pthread_cond_wait(&ring_drained, &ring_lock);
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+void log_stop() {
+    pthread_mutex_lock(&ring_lock);
+
+    if (!started) {
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+
+    stopping = TRUE;
+    pthread_cond_signal(&ring_filled);
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_join(writer_thread, NULL);
+
+    pthread_mutex_lock(&ring_lock);
+    started = FALSE;
+    pthread_cond_broadcast(&ring_drained);
+    pthread_mutex_unlock(&ring_lock);
+}
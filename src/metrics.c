@@ -0,0 +1,171 @@
+#include "../include/metrics.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *name;
+    const char *help;
+} MetricInfo;
+
+// Prometheus names of the counters, in the order of MetricCounter
+static const MetricInfo COUNTER_INFO[NUM_OF_METRIC_COUNTERS] = {
+    {"spotify_listener_signals_received_total",
+     "Signals dispatched to the listener"},
+    {"spotify_listener_signals_filtered_total",
+     "Signals that were not about spotify and were ignored"},
+    {"spotify_listener_signals_handled_total",
+     "Signals about spotify that were handled"},
+    {"spotify_listener_hooks_sent_total",
+     "Hook and action messages written to polybar"},
+    {"spotify_listener_ipc_failures_total",
+     "Messages that could not be delivered to a bar"},
+    {"spotify_listener_bars_discovered_total",
+     "Polybar IPC endpoints that were found"},
+    {"spotify_listener_updates_dropped_total",
+     "Updates dropped because the IPC writer queue was full"},
+    {"spotify_listener_hooks_avoided_total",
+     "Messages not sent to a bar because its module already showed them"},
+};
+
+// Prometheus names of the histograms, in the order of MetricHistogram
+static const MetricInfo HISTOGRAM_INFO[NUM_OF_METRIC_HISTOGRAMS] = {
+    {"spotify_listener_handler_seconds", "Time spent handling a signal"},
+    {"spotify_listener_signal_to_write_seconds",
+     "Time from a signal to a message it caused being written to a bar"},
+};
+
+// Quantiles exported for every histogram
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999, 1};
+
+static uint64_t counters[NUM_OF_METRIC_COUNTERS];
+static Histogram histograms[NUM_OF_METRIC_HISTOGRAMS];
+
+static size_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+    if (value >> HISTOGRAM_MAX_VALUE_BITS)
+        value = ((uint64_t)1 << HISTOGRAM_MAX_VALUE_BITS) - 1;
+
+    // Values in [2^msb, 2^(msb + 1)) are split into HISTOGRAM_SUB_BUCKETS
+    // buckets of 2^shift values each
+    const int msb = 63 - __builtin_clzll(value);
+    const int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+           ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper_bound(const size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+    const int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_record(Histogram *histogram, long long value) {
+    if (value < 0) value = 0;
+
+    __atomic_fetch_add(&histogram->buckets[bucket_index(value)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while ((uint64_t)value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t histogram_percentile(const Histogram *histogram, double quantile) {
+    const uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    const uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+
+    if (count == 0) return 0;
+
+    if (quantile < 0) quantile = 0;
+    if (quantile > 1) quantile = 1;
+
+    // Nearest rank of the percentile, starting at 1
+    uint64_t rank = quantile * count;
+    if (rank < quantile * count || rank == 0) rank++;
+
+    for (size_t b = 0; b < HISTOGRAM_NUM_OF_BUCKETS; b++) {
+        seen += __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+
+        if (seen >= rank) {
+            const uint64_t bound = bucket_upper_bound(b);
+            return bound < max ? bound : max;
+        }
+    }
+
+    // Values were recorded while the buckets were being read
+    return max;
+}
+
+void metrics_count(MetricCounter counter, uint64_t amount) {
+    __atomic_fetch_add(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_get(MetricCounter counter) {
+    return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+void metrics_record(MetricHistogram histogram, long long value_us) {
+    histogram_record(&histograms[histogram], value_us);
+}
+
+const Histogram *metrics_histogram(MetricHistogram histogram) {
+    return &histograms[histogram];
+}
+
+static void write_histogram(FILE *file, const MetricInfo *info,
+                            const Histogram *histogram) {
+    fprintf(file, "# HELP %s %s\n", info->name, info->help);
+    fprintf(file, "# TYPE %s summary\n", info->name);
+
+    for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+        fprintf(file, "%s{quantile=\"%g\"} %.6f\n", info->name, QUANTILES[q],
+                histogram_percentile(histogram, QUANTILES[q]) / 1e6);
+    }
+
+    fprintf(file, "%s_sum %.6f\n", info->name,
+            __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e6);
+    fprintf(file, "%s_count %lu\n", info->name,
+            (unsigned long)__atomic_load_n(&histogram->count,
+                                           __ATOMIC_RELAXED));
+}
+
+dbus_bool_t metrics_write_prometheus(const char *path) {
+    char tmp_path[PATH_MAX];
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path))
+        return FALSE;
+
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) return FALSE;
+
+    for (int c = 0; c < NUM_OF_METRIC_COUNTERS; c++) {
+        fprintf(file, "# HELP %s %s\n", COUNTER_INFO[c].name,
+                COUNTER_INFO[c].help);
+        fprintf(file, "# TYPE %s counter\n", COUNTER_INFO[c].name);
+        fprintf(file, "%s %lu\n", COUNTER_INFO[c].name,
+                (unsigned long)metrics_get(c));
+    }
+
+    for (int h = 0; h < NUM_OF_METRIC_HISTOGRAMS; h++)
+        write_histogram(file, &HISTOGRAM_INFO[h], &histograms[h]);
+
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,302 @@
+#include "../include/mpris.h"
+
+#include <string.h>
+
+#include "../include/utils.h"
+
+static const char *MPRIS_OBJECT_PATH = "/org/mpris/MediaPlayer2";
+static const char *MPRIS_PLAYER_INTERFACE = "org.mpris.MediaPlayer2.Player";
+
+// Keys of the org.mpris.MediaPlayer2.Player properties
+static const char *PROPERTY_METADATA_KEY = "Metadata";
+static const char *PROPERTY_STATUS_KEY = "PlaybackStatus";
+
+// Keys of the Metadata dictionary
+static const char *METADATA_TRACKID_KEY = "mpris:trackid";
+static const char *METADATA_LENGTH_KEY = "mpris:length";
+static const char *METADATA_ART_URL_KEY = "mpris:artUrl";
+static const char *METADATA_TITLE_KEY = "xesam:title";
+static const char *METADATA_ARTIST_KEY = "xesam:artist";
+static const char *METADATA_ALBUM_KEY = "xesam:album";
+static const char *METADATA_TRACKNUMBER_KEY = "xesam:trackNumber";
+
+static const StringView ARTIST_SEPARATOR = {", ", 2};
+
+/**
+ * Append src to the string dst of the specified size at offset *len. If src
+ * does not fit, it is cut off at the last whole UTF-8 character that fits.
+ */
+static void append_utf8(char *dst, const size_t size, size_t *len,
+                        const StringView *src) {
+    size_t n = src->len;
+
+    if (*len + n >= size) {
+        n = size - *len - 1;
+        // Don't cut a multi-byte character in half
+        while (n > 0 && (src->str[n] & 0xC0) == 0x80) n--;
+    }
+
+    memcpy(dst + *len, src->str, n);
+    *len += n;
+    dst[*len] = '\0';
+}
+
+static void copy_utf8(char *dst, const size_t size, const StringView *src) {
+    size_t len = 0;
+    append_utf8(dst, size, &len, src);
+}
+
+static dbus_bool_t is_dict(DBusMessageIter *iter) {
+    return dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_ARRAY &&
+           dbus_message_iter_get_element_type(iter) == DBUS_TYPE_DICT_ENTRY;
+}
+
+/**
+ * Get the key of the string-variant dict entry pointed to by entry_iter and
+ * initialize kv_iter at the value of the entry. Returns NULL if the entry does
+ * not have a string key.
+ */
+static const char *dict_entry_key(DBusMessageIter *entry_iter,
+                                  DBusMessageIter *kv_iter) {
+    dbus_message_iter_recurse(entry_iter, kv_iter);
+
+    if (dbus_message_iter_get_arg_type(kv_iter) != DBUS_TYPE_STRING)
+        return NULL;
+
+    DBusBasicValue key;
+    dbus_message_iter_get_basic(kv_iter, &key);
+    dbus_message_iter_next(kv_iter);
+
+    return key.str;
+}
+
+/**
+ * Initialize value_iter inside the variant pointed to by kv_iter. Returns FALSE
+ * if kv_iter is not pointing at a variant.
+ */
+static dbus_bool_t variant_open(DBusMessageIter *kv_iter,
+                                DBusMessageIter *value_iter) {
+    if (dbus_message_iter_get_arg_type(kv_iter) != DBUS_TYPE_VARIANT)
+        return FALSE;
+
+    dbus_message_iter_recurse(kv_iter, value_iter);
+    return TRUE;
+}
+
+static void decode_artists(DBusMessageIter *iter, TrackState *track) {
+    DBusMessageIter artist_iter;
+    StringView artist;
+    size_t len = 0;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) return;
+
+    track->artists[0] = '\0';
+    dbus_message_iter_recurse(iter, &artist_iter);
+
+    while (iter_get_string_view(&artist_iter, &artist)) {
+        if (len > 0)
+            append_utf8(track->artists, TRACK_TEXT_SIZE, &len,
+                        &ARTIST_SEPARATOR);
+        append_utf8(track->artists, TRACK_TEXT_SIZE, &len, &artist);
+        dbus_message_iter_next(&artist_iter);
+    }
+
+    track->fields |= TRACK_HAS_ARTISTS;
+}
+
+static void decode_length(DBusMessageIter *iter, TrackState *track) {
+    DBusBasicValue value;
+
+    // The spec says int64, but some players send uint64
+    switch (dbus_message_iter_get_arg_type(iter)) {
+        case DBUS_TYPE_INT64:
+            dbus_message_iter_get_basic(iter, &value);
+            track->length = value.i64;
+            break;
+        case DBUS_TYPE_UINT64:
+            dbus_message_iter_get_basic(iter, &value);
+            track->length = value.u64;
+            break;
+        default:
+            return;
+    }
+
+    track->fields |= TRACK_HAS_LENGTH;
+}
+
+DBusMessage *mpris_new_get_all_call(const char *destination) {
+    DBusMessage *msg = dbus_message_new_method_call(
+        destination, MPRIS_OBJECT_PATH, DBUS_INTERFACE_PROPERTIES, "GetAll");
+    if (msg == NULL) return NULL;
+
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING,
+                                  &MPRIS_PLAYER_INTERFACE, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+static void decode_tracknumber(DBusMessageIter *iter, TrackState *track) {
+    DBusBasicValue value;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INT32) return;
+
+    dbus_message_iter_get_basic(iter, &value);
+    track->tracknumber = value.i32;
+    track->fields |= TRACK_HAS_TRACKNUMBER;
+}
+
+void track_state_clear(TrackState *track) {
+    track->fields = 0;
+    track->trackid[0] = '\0';
+    track->status[0] = '\0';
+    track->title[0] = '\0';
+    track->artists[0] = '\0';
+    track->album[0] = '\0';
+    track->length = 0;
+    track->art_url[0] = '\0';
+    track->tracknumber = 0;
+}
+
+void track_state_merge(TrackState *dst, const TrackState *src) {
+    // A new Metadata dictionary replaces the old one, so only the status is
+    // kept from the previous track
+    if (src->fields & TRACK_METADATA_FIELDS) {
+        const unsigned int fields = dst->fields & ~TRACK_METADATA_FIELDS;
+        char status[TRACK_STATUS_SIZE];
+
+        strcpy(status, dst->status);
+        track_state_clear(dst);
+        strcpy(dst->status, status);
+        dst->fields = fields;
+    }
+
+    if (src->fields & TRACK_HAS_TRACKID) strcpy(dst->trackid, src->trackid);
+    if (src->fields & TRACK_HAS_STATUS) strcpy(dst->status, src->status);
+    if (src->fields & TRACK_HAS_TITLE) strcpy(dst->title, src->title);
+    if (src->fields & TRACK_HAS_ARTISTS) strcpy(dst->artists, src->artists);
+    if (src->fields & TRACK_HAS_ALBUM) strcpy(dst->album, src->album);
+    if (src->fields & TRACK_HAS_LENGTH) dst->length = src->length;
+    if (src->fields & TRACK_HAS_ART_URL) strcpy(dst->art_url, src->art_url);
+    if (src->fields & TRACK_HAS_TRACKNUMBER)
+        dst->tracknumber = src->tracknumber;
+
+    dst->fields |= src->fields;
+}
+
+dbus_bool_t mpris_decode_metadata(DBusMessageIter *iter, TrackState *track) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter kv_iter;
+    DBusMessageIter value_iter;
+    unsigned int found = 0;
+
+    if (!is_dict(iter)) return FALSE;
+
+    dbus_message_iter_recurse(iter, &entry_iter);
+
+    // Iterate through dict entries once, picking out every known key and
+    // stopping as soon as all of them have been seen. Only values of known
+    // keys are stepped into.
+    while (found != TRACK_METADATA_FIELDS &&
+           dbus_message_iter_get_arg_type(&entry_iter) ==
+               DBUS_TYPE_DICT_ENTRY) {
+        const char *key = dict_entry_key(&entry_iter, &kv_iter);
+        unsigned int field = 0;
+
+        if (key == NULL) {
+            // Malformed entry, skip it
+        } else if (strcmp(key, METADATA_TRACKID_KEY) == 0) {
+            field = TRACK_HAS_TRACKID;
+        } else if (strcmp(key, METADATA_TITLE_KEY) == 0) {
+            field = TRACK_HAS_TITLE;
+        } else if (strcmp(key, METADATA_ARTIST_KEY) == 0) {
+            field = TRACK_HAS_ARTISTS;
+        } else if (strcmp(key, METADATA_ALBUM_KEY) == 0) {
+            field = TRACK_HAS_ALBUM;
+        } else if (strcmp(key, METADATA_LENGTH_KEY) == 0) {
+            field = TRACK_HAS_LENGTH;
+        } else if (strcmp(key, METADATA_ART_URL_KEY) == 0) {
+            field = TRACK_HAS_ART_URL;
+        } else if (strcmp(key, METADATA_TRACKNUMBER_KEY) == 0) {
+            field = TRACK_HAS_TRACKNUMBER;
+        }
+
+        if (field != 0 && variant_open(&kv_iter, &value_iter)) {
+            StringView str;
+            const dbus_bool_t is_str = iter_get_string_view(&value_iter, &str);
+
+            found |= field;
+
+            switch (field) {
+                case TRACK_HAS_ARTISTS:
+                    decode_artists(&value_iter, track);
+                    break;
+                case TRACK_HAS_LENGTH:
+                    decode_length(&value_iter, track);
+                    break;
+                case TRACK_HAS_TRACKNUMBER:
+                    decode_tracknumber(&value_iter, track);
+                    break;
+                case TRACK_HAS_TRACKID:
+                    if (!is_str) break;
+                    copy_utf8(track->trackid, TRACK_ID_SIZE, &str);
+                    track->fields |= field;
+                    break;
+                case TRACK_HAS_TITLE:
+                    if (!is_str) break;
+                    copy_utf8(track->title, TRACK_TEXT_SIZE, &str);
+                    track->fields |= field;
+                    break;
+                case TRACK_HAS_ALBUM:
+                    if (!is_str) break;
+                    copy_utf8(track->album, TRACK_TEXT_SIZE, &str);
+                    track->fields |= field;
+                    break;
+                case TRACK_HAS_ART_URL:
+                    if (!is_str) break;
+                    copy_utf8(track->art_url, TRACK_URL_SIZE, &str);
+                    track->fields |= field;
+                    break;
+            }
+        }
+
+        dbus_message_iter_next(&entry_iter);
+    }
+
+    return TRUE;
+}
+
+dbus_bool_t mpris_decode_properties(DBusMessageIter *iter, TrackState *track) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter kv_iter;
+    DBusMessageIter value_iter;
+
+    if (!is_dict(iter)) return FALSE;
+
+    dbus_message_iter_recurse(iter, &entry_iter);
+
+    // Iterate through dict entries once
+    while (dbus_message_iter_get_arg_type(&entry_iter) ==
+           DBUS_TYPE_DICT_ENTRY) {
+        const char *key = dict_entry_key(&entry_iter, &kv_iter);
+
+        if (key == NULL || !variant_open(&kv_iter, &value_iter)) {
+            // Malformed entry, skip it
+        } else if (strcmp(key, PROPERTY_METADATA_KEY) == 0) {
+            mpris_decode_metadata(&value_iter, track);
+        } else if (strcmp(key, PROPERTY_STATUS_KEY) == 0) {
+            StringView status;
+
+            if (iter_get_string_view(&value_iter, &status)) {
+                copy_utf8(track->status, TRACK_STATUS_SIZE, &status);
+                track->fields |= TRACK_HAS_STATUS;
+            }
+        }
+
+        dbus_message_iter_next(&entry_iter);
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,965 @@
+#include "../include/polybar-ipc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/ipc-uring.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/probes.h"
+#include "../include/utils.h"
+
+// Names of the IPC files of each transport are the prefix, the PID of the bar
+// and the suffix
+static const char *IPC_FILE_PREFIXES[] = {"polybar_mqueue.", "ipc."};
+static const char *IPC_FILE_SUFFIXES[] = {"", ".sock"};
+
+// Longest time to wait for bars to read their messages before giving up and
+// leaving the rest queued
+const long IPC_DRAIN_TIMEOUT_US = 100000;
+
+// Bounds of the backoff between checks of whether bars have read a message
+const long IPC_DRAIN_MIN_DELAY_US = 20;
+const long IPC_DRAIN_MAX_DELAY_US = 1000;
+
+/**
+ * A directory containing the IPC files of a transport
+ */
+typedef struct {
+    char *path;
+    IpcTransport transport;
+    // inotify watch on the directory, -1 if not watched
+    int wd;
+    // inotify watch on the parent while the directory does not exist, -1 if
+    // not watched
+    int parent_wd;
+} IpcDirectory;
+
+// Directories containing the IPC files
+static IpcDirectory directories[2];
+static size_t num_of_directories = 0;
+
+// Known endpoints
+static PolybarEndpoint *endpoints = NULL;
+static size_t num_of_endpoints = 0;
+static size_t endpoints_capacity = 0;
+
+// inotify descriptor watching the directories, -1 if unavailable
+static int inotify_fd = -1;
+
+// If TRUE, messages are written with io_uring instead of write()
+static dbus_bool_t use_io_uring = FALSE;
+
+// Set when the directories must be scanned again (i.e. inotify unavailable or
+// its queue overflowed)
+static dbus_bool_t needs_rescan = TRUE;
+
+static dbus_bool_t is_ipc_file(const char *name, const IpcTransport transport) {
+    const char *prefix = IPC_FILE_PREFIXES[transport];
+    char *end;
+
+    if (strncmp(name, prefix, strlen(prefix)) != 0) return FALSE;
+
+    strtol(name + strlen(prefix), &end, 10);
+    return strcmp(end, IPC_FILE_SUFFIXES[transport]) == 0;
+}
+
+static const char *file_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+static ssize_t find_endpoint(const char *path) {
+    for (size_t i = 0; i < num_of_endpoints; i++) {
+        if (strcmp(endpoints[i].path, path) == 0) return i;
+    }
+
+    return -1;
+}
+
+static void add_endpoint(char *path, const IpcTransport transport) {
+    // Path is already known
+    if (find_endpoint(path) != -1) {
+        free(path);
+        return;
+    }
+
+    if (num_of_endpoints >= endpoints_capacity) {
+        // Grow by 3 endpoints at a time, most setups have very few bars
+        endpoints_capacity += 3;
+        endpoints = (PolybarEndpoint *)realloc(
+            endpoints, endpoints_capacity * sizeof(PolybarEndpoint));
+    }
+
+    PolybarEndpoint *endpoint = &endpoints[num_of_endpoints];
+
+    endpoint->path = path;
+    endpoint->transport = transport;
+    // The PID follows the prefix of the name
+    endpoint->pid = strtol(
+        file_name(path) + strlen(IPC_FILE_PREFIXES[transport]), NULL, 10);
+    endpoint->fd = -1;
+    endpoint->file_slot = -1;
+    endpoint->pending_head = 0;
+    endpoint->num_of_pending = 0;
+    endpoint->stalled = FALSE;
+    endpoint->num_of_in_flight = 0;
+    endpoint->num_of_sending = 0;
+    endpoint->acks_len = 0;
+    endpoint->num_of_modules = 0;
+    num_of_endpoints++;
+
+    metrics_count(METRIC_BARS_DISCOVERED, 1);
+}
+
+static void close_endpoint(PolybarEndpoint *endpoint) {
+    // Must be unregistered before the descriptor is reused
+    if (endpoint->file_slot != -1) ipc_uring_unregister_fd(endpoint->file_slot);
+    endpoint->file_slot = -1;
+
+    if (endpoint->fd != -1) close(endpoint->fd);
+    endpoint->fd = -1;
+
+    // Requests that were not acknowledged are sent again on a new connection
+    endpoint->num_of_in_flight = 0;
+    endpoint->num_of_sending = 0;
+    endpoint->acks_len = 0;
+}
+
+static void remove_endpoint_at(size_t i) {
+    close_endpoint(&endpoints[i]);
+    free(endpoints[i].path);
+
+    // Order does not matter, so move the last endpoint into the hole
+    endpoints[i] = endpoints[num_of_endpoints - 1];
+    num_of_endpoints--;
+}
+
+static void remove_endpoint(const char *path) {
+    ssize_t i = find_endpoint(path);
+
+    if (i != -1) remove_endpoint_at(i);
+}
+
+static void clear_endpoints() {
+    while (num_of_endpoints > 0) remove_endpoint_at(num_of_endpoints - 1);
+}
+
+static dbus_bool_t rescan_endpoints() {
+    char **paths[num_of_directories];
+    size_t num_of_paths[num_of_directories];
+    dbus_bool_t success = TRUE;
+
+    for (size_t d = 0; d < num_of_directories; d++) {
+        const IpcDirectory *dir = &directories[d];
+
+        // A socket directory is only created once a bar that uses it starts
+        if (!get_polybar_ipc_paths(dir->path,
+                                   IPC_FILE_PREFIXES[dir->transport],
+                                   &paths[d], &num_of_paths[d])) {
+            if (errno != ENOENT) success = FALSE;
+            paths[d] = NULL;
+            num_of_paths[d] = 0;
+        }
+    }
+
+    // Drop endpoints that no longer exist, keeping the descriptors of the
+    // ones that still do
+    for (size_t i = num_of_endpoints; i-- > 0;) {
+        dbus_bool_t found = FALSE;
+
+        for (size_t d = 0; d < num_of_directories && !found; d++) {
+            for (size_t p = 0; p < num_of_paths[d] && !found; p++)
+                found = strcmp(endpoints[i].path, paths[d][p]) == 0;
+        }
+
+        if (!found) remove_endpoint_at(i);
+    }
+
+    // Endpoints take ownership of the paths
+    for (size_t d = 0; d < num_of_directories; d++) {
+        const IpcTransport transport = directories[d].transport;
+
+        for (size_t p = 0; p < num_of_paths[d]; p++) {
+            if (is_ipc_file(file_name(paths[d][p]), transport)) {
+                add_endpoint(paths[d][p], transport);
+            } else {
+                free(paths[d][p]);
+            }
+        }
+
+        free(paths[d]);
+    }
+
+    if (success) needs_rescan = FALSE;
+    return success;
+}
+
+static dbus_bool_t watch_directory(IpcDirectory *dir) {
+    // A directory can also be the parent of another one, which shares the
+    // watch, so the events of both are added to it rather than replaced
+    dir->wd = inotify_add_watch(inotify_fd, dir->path,
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                    IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+    if (dir->wd != -1 || errno != ENOENT) return dir->wd != -1;
+
+    // Wait for the directory to be created instead
+    char *parent = strdup(dir->path);
+    char *slash = strrchr(parent, '/');
+
+    if (slash == NULL) {
+        strcpy(parent, ".");
+    } else {
+        // Keep the slash of a directory in the root
+        slash[slash == parent ? 1 : 0] = '\0';
+    }
+
+    dir->parent_wd =
+        inotify_add_watch(inotify_fd, parent,
+                          IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+
+    free(parent);
+    return dir->parent_wd != -1;
+}
+
+static void add_directory(const char *path, const IpcTransport transport) {
+    IpcDirectory *dir = &directories[num_of_directories++];
+
+    dir->path = strdup(path);
+    dir->transport = transport;
+
+    // Names are matched against the last component of the path
+    for (size_t len = strlen(dir->path); len > 1 && dir->path[len - 1] == '/';)
+        dir->path[--len] = '\0';
+
+    dir->wd = -1;
+    dir->parent_wd = -1;
+
+    // Without a watch on every directory, they all have to be rescanned on
+    // every refresh
+    if (inotify_fd != -1 && !watch_directory(dir)) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+dbus_bool_t ipc_endpoints_init(const char *ipc_dir, const char *socket_dir) {
+    ipc_endpoints_free();
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    add_directory(ipc_dir, IPC_TRANSPORT_FIFO);
+    if (socket_dir != NULL) add_directory(socket_dir, IPC_TRANSPORT_SOCKET);
+
+    // Watches must be placed before scanning so no endpoint is missed
+    return rescan_endpoints();
+}
+
+static dbus_bool_t watch_shared(const int wd) {
+    for (size_t d = 0; d < num_of_directories; d++) {
+        if (directories[d].wd == wd) return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Apply an inotify event to the set of known endpoints
+ */
+static void handle_inotify_event(const struct inotify_event *event) {
+    // Events were dropped, so the set can't be trusted anymore
+    if (event->mask & IN_Q_OVERFLOW) {
+        needs_rescan = TRUE;
+        return;
+    }
+
+    for (size_t d = 0; d < num_of_directories; d++) {
+        IpcDirectory *dir = &directories[d];
+
+        // The directory was created, so watch it and pick up the files that
+        // were created before the watch was placed
+        if (event->wd == dir->parent_wd && event->len > 0 &&
+            strcmp(event->name, file_name(dir->path)) == 0) {
+            if (!watch_shared(dir->parent_wd))
+                inotify_rm_watch(inotify_fd, dir->parent_wd);
+            dir->parent_wd = -1;
+            watch_directory(dir);
+            needs_rescan = TRUE;
+            return;
+        }
+
+        // The directory was removed, so wait for it to be created again
+        if (event->wd == dir->wd && (event->mask & IN_IGNORED)) {
+            dir->wd = -1;
+            watch_directory(dir);
+            needs_rescan = TRUE;
+            return;
+        }
+
+        if (event->wd != dir->wd || event->len == 0 ||
+            !is_ipc_file(event->name, dir->transport))
+            continue;
+
+        char *path = join_path(dir->path, event->name);
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_endpoint(path, dir->transport);
+        } else {
+            remove_endpoint(path);
+            free(path);
+        }
+        return;
+    }
+}
+
+dbus_bool_t ipc_endpoints_refresh() {
+    // Buffer must be aligned for struct inotify_event
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    // Without inotify, there is no choice but to scan every time
+    if (inotify_fd == -1) return rescan_endpoints();
+
+    // Drain all pending events
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event *event;
+
+        for (char *ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)ptr;
+            handle_inotify_event(event);
+        }
+    }
+
+    if (len == -1 && errno != EAGAIN && errno != EINTR) return FALSE;
+
+    if (needs_rescan) return rescan_endpoints();
+
+    return TRUE;
+}
+
+int ipc_endpoints_fd() { return inotify_fd; }
+
+dbus_bool_t ipc_use_io_uring(dbus_bool_t enable) {
+    if (enable) {
+        use_io_uring = ipc_uring_init();
+        return use_io_uring;
+    }
+
+    // Descriptors registered with the ring are unregistered before it goes
+    for (size_t p = 0; p < num_of_endpoints; p++) {
+        if (endpoints[p].file_slot != -1)
+            ipc_uring_unregister_fd(endpoints[p].file_slot);
+        endpoints[p].file_slot = -1;
+    }
+
+    ipc_uring_free();
+    use_io_uring = FALSE;
+
+    return TRUE;
+}
+
+size_t ipc_get_endpoints(PolybarEndpoint **ptr_endpoints) {
+    *ptr_endpoints = endpoints;
+    return num_of_endpoints;
+}
+
+static void sleep_us(const long microseconds) {
+    struct timespec ts = {microseconds / 1000000,
+                          (microseconds % 1000000) * 1000};
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+// Result of trying to write an endpoint's pending messages
+typedef enum {
+    ENDPOINT_IDLE,     // Every pending message was written and read
+    ENDPOINT_READY,    // The next pending message can be written now
+    ENDPOINT_BUSY,     // The bar has not read the last message yet
+    ENDPOINT_BLOCKED,  // The bar can't accept messages right now
+    ENDPOINT_DEAD      // The polybar that owns the endpoint no longer exists
+} EndpointResult;
+
+static uint64_t hash_message(const char *message) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char *c = message; *c != '\0' && *c != '\n'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Get the name of the module a message is for
+ *
+ * @param const char* message The message
+ * @param const char** name Set to the start of the name in the message
+ *
+ * @returns size_t The length of the name, 0 if the message is not for a module
+ */
+static size_t module_name(const char *message, const char **name) {
+    static const char *HOOK_PREFIX = "hook:module/";
+    static const char *ACTION_PREFIX = "action:#";
+    const char *end;
+
+    if (strncmp(message, HOOK_PREFIX, strlen(HOOK_PREFIX)) == 0) {
+        // hook:module/<name><index>
+        *name = message + strlen(HOOK_PREFIX);
+        end = *name + strcspn(*name, "\n");
+        while (end > *name && end[-1] >= '0' && end[-1] <= '9') end--;
+    } else if (strncmp(message, ACTION_PREFIX, strlen(ACTION_PREFIX)) == 0) {
+        // action:#<name>.<action>
+        *name = message + strlen(ACTION_PREFIX);
+        end = strchr(*name, '.');
+        if (end == NULL) return 0;
+    } else {
+        return 0;
+    }
+
+    return end - *name;
+}
+
+/**
+ * Find what the module a message is for shows on a bar
+ *
+ * @param PolybarEndpoint* endpoint The bar
+ * @param const char* message The message
+ * @param dbus_bool_t add TRUE to add the module if it is not known yet
+ *
+ * @returns ModuleState* The module, or NULL if the message is not for a module
+ *                       or the module is not known (and could not be added)
+ */
+static ModuleState *endpoint_module(PolybarEndpoint *endpoint,
+                                    const char *message,
+                                    const dbus_bool_t add) {
+    const char *name;
+    const size_t len = module_name(message, &name);
+
+    if (len == 0 || len >= IPC_MODULE_NAME_LEN) return NULL;
+
+    for (size_t i = 0; i < endpoint->num_of_modules; i++) {
+        ModuleState *module = &endpoint->modules[i];
+        if (strncmp(module->name, name, len) == 0 && module->name[len] == '\0')
+            return module;
+    }
+
+    if (!add || endpoint->num_of_modules == IPC_MAX_MODULES) return NULL;
+
+    ModuleState *module = &endpoint->modules[endpoint->num_of_modules++];
+    memcpy(module->name, name, len);
+    module->name[len] = '\0';
+    module->message_hash = 0;
+
+    return module;
+}
+
+/**
+ * Forget what the module of a message that will never reach the bar shows
+ */
+static void endpoint_forget(PolybarEndpoint *endpoint, const char *message) {
+    ModuleState *module = endpoint_module(endpoint, message, FALSE);
+
+    if (module != NULL) module->message_hash = 0;
+}
+
+static dbus_bool_t endpoint_alive(const PolybarEndpoint *endpoint) {
+    // Without a PID there is no way to tell, so assume it is alive
+    if (endpoint->pid <= 0) return TRUE;
+
+    // EPERM means the process exists but belongs to someone else
+    return kill(endpoint->pid, 0) == 0 || errno != ESRCH;
+}
+
+static int fifo_open(const char *path) {
+    // Opening a FIFO without O_NONBLOCK blocks until there is a reader, which
+    // is forever if the polybar that created it crashed
+    return open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static void endpoint_pop(PolybarEndpoint *endpoint) {
+    endpoint->pending_head = (endpoint->pending_head + 1) % IPC_MAX_PENDING;
+    endpoint->num_of_pending--;
+}
+
+/**
+ * Account for a message of an endpoint having been written
+ */
+static void endpoint_sent(const PolybarEndpoint *endpoint, const size_t index) {
+    const char *message = endpoint->pending[index];
+
+    log_record(LOG_LEVEL_DEBUG, "Sent message", "message=\"%.*s\" bar=%s",
+               (int)strlen(message) - 1, message, endpoint->path);
+
+    const long long origin_us = endpoint->pending_origin_us[index];
+    if (origin_us > 0)
+        metrics_record(METRIC_SIGNAL_TO_WRITE, get_monotonic_us() - origin_us);
+}
+
+static size_t fifo_unread(PolybarEndpoint *endpoint) {
+    int unread = 0;
+
+    // FIONREAD works on either end of a pipe and gives the number of bytes
+    // that polybar has not read yet
+    if (endpoint->fd == -1 || ioctl(endpoint->fd, FIONREAD, &unread) == -1)
+        return 0;
+
+    return unread;
+}
+
+static EndpointResult fifo_prepare(PolybarEndpoint *endpoint) {
+    // Polybar would read the previous message and this one as a single
+    // message, so wait for it to read the previous one first
+    if (fifo_unread(endpoint) > 0) return ENDPOINT_BUSY;
+
+    endpoint->out = endpoint->pending[endpoint->pending_head];
+    endpoint->out_len = strlen(endpoint->out);
+
+    return ENDPOINT_READY;
+}
+
+static EndpointResult fifo_complete(PolybarEndpoint *endpoint,
+                                    const ssize_t written) {
+    if (written != (ssize_t)endpoint->out_len) {
+        if (written == -EAGAIN) return ENDPOINT_BLOCKED;
+
+        // Bar most likely exited, reopen on the next attempt
+        close_endpoint(endpoint);
+        if (!endpoint_alive(endpoint)) return ENDPOINT_DEAD;
+        return ENDPOINT_BLOCKED;
+    }
+
+    endpoint_sent(endpoint, endpoint->pending_head);
+    metrics_count(METRIC_HOOKS_SENT, 1);
+    endpoint_pop(endpoint);
+
+    // The bar can't have read the message yet, so the next one has to wait
+    // for the next pass
+    return endpoint->num_of_pending > 0 ? ENDPOINT_BUSY : ENDPOINT_IDLE;
+}
+
+/**
+ * Drop the messages acknowledged by the responses received so far
+ *
+ * @returns dbus_bool_t FALSE if the connection had to be closed
+ */
+static dbus_bool_t socket_read_acks(PolybarEndpoint *endpoint) {
+    ssize_t len;
+
+    while ((len = read(endpoint->fd, endpoint->acks + endpoint->acks_len,
+                       sizeof(endpoint->acks) - endpoint->acks_len)) > 0) {
+        const char *ack = endpoint->acks;
+        size_t left = endpoint->acks_len + len;
+        PolybarSocketType type;
+        const char *payload;
+        size_t payload_len;
+        ssize_t ack_len;
+
+        while ((ack_len = polybar_socket_decode(ack, left, &type, &payload,
+                                                &payload_len)) > 0) {
+            // A response without a request means the connection is out of
+            // sync
+            if (endpoint->num_of_in_flight == 0) break;
+
+            if (type == POLYBAR_SOCKET_OK) {
+                metrics_count(METRIC_HOOKS_SENT, 1);
+            } else {
+                const char *message = endpoint->pending[endpoint->pending_head];
+
+                log_record(LOG_LEVEL_WARN, "Bar rejected message",
+                           "message=\"%.*s\" error=\"%.*s\" bar=%s",
+                           (int)strlen(message) - 1, message, (int)payload_len,
+                           payload, endpoint->path);
+                metrics_count(METRIC_IPC_FAILURES, 1);
+                endpoint_forget(endpoint, message);
+            }
+
+            endpoint_pop(endpoint);
+            endpoint->num_of_in_flight--;
+            ack += ack_len;
+            left -= ack_len;
+        }
+
+        // Also give up on responses that can't fit in the buffer
+        if (ack_len != 0 || left == sizeof(endpoint->acks)) {
+            log_record(LOG_LEVEL_WARN, "Invalid response from bar", "bar=%s",
+                       endpoint->path);
+            close_endpoint(endpoint);
+            return FALSE;
+        }
+
+        memmove(endpoint->acks, ack, left);
+        endpoint->acks_len = left;
+    }
+
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) return TRUE;
+
+    // The bar closed the connection (which polybar may do after answering a
+    // request), requests it did not answer are sent again on a new one
+    close_endpoint(endpoint);
+    return FALSE;
+}
+
+static EndpointResult socket_prepare(PolybarEndpoint *endpoint) {
+    const size_t unsent =
+        endpoint->num_of_pending - endpoint->num_of_in_flight;
+    const size_t window =
+        IPC_SOCKET_MAX_IN_FLIGHT - endpoint->num_of_in_flight;
+    const size_t num = unsent < window ? unsent : window;
+    size_t len = 0;
+
+    // Wait for the bar to acknowledge some of the requests it was sent
+    if (num == 0) return ENDPOINT_BUSY;
+
+    // Pipeline the requests, which were checked when they were queued
+    for (size_t m = 0; m < num; m++) {
+        const size_t index =
+            (endpoint->pending_head + endpoint->num_of_in_flight + m) %
+            IPC_MAX_PENDING;
+
+        len += polybar_socket_encode(endpoint->pending[index],
+                                     endpoint->frames + len,
+                                     sizeof(endpoint->frames) - len);
+    }
+
+    endpoint->out = endpoint->frames;
+    endpoint->out_len = len;
+    endpoint->num_of_sending = num;
+
+    return ENDPOINT_READY;
+}
+
+static EndpointResult socket_complete(PolybarEndpoint *endpoint,
+                                      const ssize_t written) {
+    const size_t num = endpoint->num_of_sending;
+
+    endpoint->num_of_sending = 0;
+
+    if (written != (ssize_t)endpoint->out_len) {
+        if (written == -EAGAIN) return ENDPOINT_BLOCKED;
+
+        // The bar exited, or only part of a request was written and the
+        // connection can't be used anymore
+        close_endpoint(endpoint);
+        if (!endpoint_alive(endpoint)) return ENDPOINT_DEAD;
+        return ENDPOINT_BLOCKED;
+    }
+
+    for (size_t m = 0; m < num; m++) {
+        endpoint_sent(endpoint, (endpoint->pending_head +
+                                 endpoint->num_of_in_flight + m) %
+                                    IPC_MAX_PENDING);
+    }
+
+    // Messages stay queued until the bar acknowledges them
+    endpoint->num_of_in_flight += num;
+
+    return ENDPOINT_BUSY;
+}
+
+/**
+ * How messages are written to the endpoints of a transport
+ */
+typedef struct {
+    // Open a non-blocking descriptor to write to, or return -1 with errno set
+    int (*open)(const char *path);
+    // Set the next write of an open endpoint with pending messages
+    EndpointResult (*prepare)(PolybarEndpoint *endpoint);
+    // Account for the result of the write, which is -errno if it failed
+    EndpointResult (*complete)(PolybarEndpoint *endpoint, ssize_t written);
+} IpcTransportOps;
+
+static const IpcTransportOps TRANSPORTS[] = {
+    [IPC_TRANSPORT_FIFO] = {fifo_open, fifo_prepare, fifo_complete},
+    [IPC_TRANSPORT_SOCKET] = {polybar_socket_connect, socket_prepare,
+                              socket_complete}};
+
+static dbus_bool_t endpoint_open(PolybarEndpoint *endpoint) {
+    if (endpoint->fd == -1) {
+        endpoint->fd = TRANSPORTS[endpoint->transport].open(endpoint->path);
+
+        // The descriptor is held open, so register it with the ring once
+        if (endpoint->fd != -1 && use_io_uring)
+            endpoint->file_slot = ipc_uring_register_fd(endpoint->fd);
+    }
+
+    return endpoint->fd != -1;
+}
+
+/**
+ * Check whether a bar with a FIFO also has a socket, in which case messages
+ * are only sent through the socket
+ */
+static dbus_bool_t endpoint_superseded(const PolybarEndpoint *endpoint) {
+    if (endpoint->transport != IPC_TRANSPORT_FIFO || endpoint->pid <= 0)
+        return FALSE;
+
+    for (size_t p = 0; p < num_of_endpoints; p++) {
+        if (endpoints[p].transport == IPC_TRANSPORT_SOCKET &&
+            endpoints[p].pid == endpoint->pid)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static dbus_bool_t endpoint_queue(PolybarEndpoint *endpoint,
+                                  const char *message,
+                                  const long long origin_us) {
+    const size_t len = strlen(message);
+    char frame[POLYBAR_SOCKET_HEADER_LEN + IPC_MAX_MSG_LEN];
+
+    // +1 for newline and +1 for null char
+    if (len + 2 > IPC_MAX_MSG_LEN) {
+        metrics_count(METRIC_IPC_FAILURES, 1);
+        return FALSE;
+    }
+
+    // Sockets only take messages that have an equivalent request
+    if (endpoint->transport == IPC_TRANSPORT_SOCKET &&
+        polybar_socket_encode(message, frame, sizeof(frame)) == 0) {
+        metrics_count(METRIC_IPC_FAILURES, 1);
+        return FALSE;
+    }
+
+    // Drop the oldest message if the bar is too far behind. If it was already
+    // sent, the requests waiting for an acknowledgement are sent again on a
+    // new connection.
+    if (endpoint->num_of_pending == IPC_MAX_PENDING) {
+        if (endpoint->num_of_in_flight > 0) close_endpoint(endpoint);
+        endpoint_forget(endpoint, endpoint->pending[endpoint->pending_head]);
+        endpoint_pop(endpoint);
+        metrics_count(METRIC_IPC_FAILURES, 1);
+    }
+
+    const size_t tail = (endpoint->pending_head + endpoint->num_of_pending) %
+                        IPC_MAX_PENDING;
+    char *slot = endpoint->pending[tail];
+
+    memcpy(slot, message, len);
+    slot[len] = '\n';
+    slot[len + 1] = '\0';
+    endpoint->pending_origin_us[tail] = origin_us;
+    endpoint->num_of_pending++;
+
+    return TRUE;
+}
+
+/**
+ * Check whether the next pending messages of an endpoint can be written now
+ *
+ * @returns EndpointResult ENDPOINT_READY if they can, otherwise why not
+ */
+static EndpointResult endpoint_prepare(PolybarEndpoint *endpoint) {
+    // Acknowledgements can only be read from an open connection
+    if (endpoint->transport == IPC_TRANSPORT_SOCKET && endpoint->fd != -1)
+        socket_read_acks(endpoint);
+
+    if (endpoint->num_of_pending == 0) return ENDPOINT_IDLE;
+
+    if (!endpoint_open(endpoint)) {
+        // ENXIO (FIFO) or ECONNREFUSED (socket) means nobody is reading
+        if (errno == ENOENT || !endpoint_alive(endpoint)) return ENDPOINT_DEAD;
+        return ENDPOINT_BLOCKED;
+    }
+
+    const EndpointResult result =
+        TRANSPORTS[endpoint->transport].prepare(endpoint);
+    if (result == ENDPOINT_READY) endpoint->stalled = FALSE;
+
+    return result;
+}
+
+/**
+ * Write the next pending messages of each of the specified endpoints
+ *
+ * @param size_t* ready The indexes of the endpoints
+ * @param size_t num_of_ready The number of endpoints
+ * @param ssize_t* results Set to the result of each write, or -errno
+ */
+static void write_endpoints(const size_t ready[], const size_t num_of_ready,
+                            ssize_t results[]) {
+    IpcWrite writes[num_of_ready];
+
+    for (size_t r = 0; r < num_of_ready; r++) {
+        const PolybarEndpoint *endpoint = &endpoints[ready[r]];
+
+        writes[r].fd = endpoint->fd;
+        writes[r].file_slot = endpoint->file_slot;
+        writes[r].buf = endpoint->out;
+        writes[r].len = endpoint->out_len;
+
+        PROBE3(ipc_write_entry, endpoint->path,
+               (const char *)endpoint->pending[endpoint->pending_head],
+               writes[r].len);
+    }
+
+    // Writes of at most PIPE_BUF bytes are atomic, so a message is never
+    // split across reads
+    if (use_io_uring && !ipc_uring_write(writes, num_of_ready)) {
+        // Writes that were not submitted stay queued
+        log_record(LOG_LEVEL_WARN, "io_uring failed, falling back to write()",
+                   NULL);
+        ipc_use_io_uring(FALSE);
+    } else if (!use_io_uring) {
+        for (size_t r = 0; r < num_of_ready; r++) {
+            writes[r].result =
+                write(writes[r].fd, writes[r].buf, writes[r].len);
+            if (writes[r].result == -1) writes[r].result = -errno;
+        }
+    }
+
+    for (size_t r = 0; r < num_of_ready; r++) {
+        PROBE2(ipc_write_return, endpoints[ready[r]].path, writes[r].result);
+        results[r] = writes[r].result;
+    }
+}
+
+/**
+ * Write the pending messages of every endpoint, waiting for bars to read (or
+ * acknowledge) each message with an exponential backoff between checks, until
+ * every bar is done or IPC_DRAIN_TIMEOUT_US has elapsed. Bars that miss the
+ * deadline are marked stalled and are not waited for again until they catch
+ * up. Their messages stay queued for the caller to retry later.
+ *
+ * Every pass writes the next message of every bar that read its previous one
+ * at once, which is a single io_uring submission with the io_uring backend.
+ */
+static void flush_endpoints() {
+    long waited = 0;
+    long delay = IPC_DRAIN_MIN_DELAY_US;
+
+    while (num_of_endpoints > 0) {
+        EndpointResult results[num_of_endpoints];
+        size_t ready[num_of_endpoints];
+        ssize_t written[num_of_endpoints];
+        size_t num_of_ready = 0;
+        dbus_bool_t waiting = FALSE;
+
+        for (size_t p = 0; p < num_of_endpoints; p++) {
+            results[p] = endpoint_prepare(&endpoints[p]);
+            if (results[p] == ENDPOINT_READY) ready[num_of_ready++] = p;
+        }
+
+        if (num_of_ready > 0) write_endpoints(ready, num_of_ready, written);
+
+        for (size_t r = 0; r < num_of_ready; r++) {
+            PolybarEndpoint *endpoint = &endpoints[ready[r]];
+            results[ready[r]] =
+                TRANSPORTS[endpoint->transport].complete(endpoint, written[r]);
+        }
+
+        // Go backwards, since removing an endpoint moves the last one into
+        // its place
+        for (size_t p = num_of_endpoints; p-- > 0;) {
+            PolybarEndpoint *endpoint = &endpoints[p];
+
+            if (results[p] == ENDPOINT_DEAD) {
+                // Remove the stale FIFO left behind by a crashed polybar
+                log_record(LOG_LEVEL_INFO, "Removing stale IPC file", "bar=%s",
+                           endpoint->path);
+                metrics_count(METRIC_IPC_FAILURES, endpoint->num_of_pending);
+                unlink(endpoint->path);
+                remove_endpoint_at(p);
+                continue;
+            }
+
+            // Only wait for bars that still have messages to be sent
+            if (results[p] == ENDPOINT_BUSY && endpoint->num_of_pending > 0 &&
+                !endpoint->stalled)
+                waiting = TRUE;
+        }
+
+        if (!waiting) return;
+
+        if (waited >= IPC_DRAIN_TIMEOUT_US) {
+            for (size_t p = 0; p < num_of_endpoints; p++) {
+                if (endpoints[p].num_of_pending > 0)
+                    endpoints[p].stalled = TRUE;
+            }
+            return;
+        }
+
+        sleep_us(delay);
+        waited += delay;
+        if (delay < IPC_DRAIN_MAX_DELAY_US) delay *= 2;
+    }
+}
+
+dbus_bool_t ipc_send_messages(const char *messages[], size_t num_of_msgs,
+                              unsigned int refresh, long long origin_us) {
+    dbus_bool_t success = TRUE;
+
+    for (size_t p = 0; p < num_of_endpoints; p++) {
+        PolybarEndpoint *endpoint = &endpoints[p];
+
+        // What the bar shows is only tracked for the transport that is used
+        if (endpoint_superseded(endpoint)) {
+            endpoint->num_of_modules = 0;
+            continue;
+        }
+
+        for (size_t m = 0; m < num_of_msgs; m++) {
+            ModuleState *module = endpoint_module(endpoint, messages[m], TRUE);
+            const uint64_t hash = hash_message(messages[m]);
+
+            // The module already shows the message, so polybar would only
+            // re-run its hook for nothing
+            if (module != NULL && module->message_hash == hash &&
+                !(refresh & (1u << m))) {
+                metrics_count(METRIC_HOOKS_AVOIDED, 1);
+                continue;
+            }
+
+            if (!endpoint_queue(endpoint, messages[m], origin_us)) {
+                if (module != NULL) module->message_hash = 0;
+                success = FALSE;
+                continue;
+            }
+
+            if (module != NULL) module->message_hash = hash;
+        }
+    }
+
+    // Messages that can't be written now stay queued for the next call
+    flush_endpoints();
+
+    return success;
+}
+
+size_t ipc_endpoints_pending() {
+    size_t num_of_pending = 0;
+
+    for (size_t p = 0; p < num_of_endpoints; p++)
+        num_of_pending += endpoints[p].num_of_pending;
+
+    return num_of_pending;
+}
+
+void ipc_endpoints_free() {
+    if (inotify_fd != -1) close(inotify_fd);
+    inotify_fd = -1;
+
+    clear_endpoints();
+    free(endpoints);
+    endpoints = NULL;
+    endpoints_capacity = 0;
+
+    for (size_t d = 0; d < num_of_directories; d++) free(directories[d].path);
+    num_of_directories = 0;
+
+    needs_rescan = TRUE;
+}
@@ -0,0 +1,132 @@
+#include "../include/polybar-socket.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/utils.h"
+
+static const char POLYBAR_SOCKET_MAGIC[] = "polyipc";
+#define POLYBAR_SOCKET_MAGIC_LEN 7
+#define POLYBAR_SOCKET_VERSION 0
+
+static const char *HOOK_PREFIX = "hook:module/";
+static const char *ACTION_PREFIX = "action:";
+static const char *CMD_PREFIX = "cmd:";
+
+char *polybar_socket_dir() {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char buf[64];
+
+    if (runtime_dir != NULL && *runtime_dir != '\0')
+        return join_path(runtime_dir, "polybar");
+
+    snprintf(buf, sizeof(buf), "/tmp/polybar-%u", (unsigned int)getuid());
+    return strdup(buf);
+}
+
+int polybar_socket_connect(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Connecting to a Unix socket completes right away unless the backlog of
+    // the bar is full, in which case it is retried later
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+static size_t encode(const PolybarSocketType type, const char *payload,
+                     const size_t payload_len, char *frame, const size_t size) {
+    const uint32_t len = payload_len;
+
+    if (POLYBAR_SOCKET_HEADER_LEN + payload_len > size) return 0;
+
+    // The length is in the byte order of the host, like polybar-msg sends it
+    memcpy(frame, POLYBAR_SOCKET_MAGIC, POLYBAR_SOCKET_MAGIC_LEN);
+    frame[POLYBAR_SOCKET_MAGIC_LEN] = POLYBAR_SOCKET_VERSION;
+    memcpy(frame + POLYBAR_SOCKET_MAGIC_LEN + 1, &len, sizeof(len));
+    frame[POLYBAR_SOCKET_HEADER_LEN - 1] = (char)type;
+    memcpy(frame + POLYBAR_SOCKET_HEADER_LEN, payload, payload_len);
+
+    return POLYBAR_SOCKET_HEADER_LEN + payload_len;
+}
+
+size_t polybar_socket_encode(const char *message, char *frame, size_t size) {
+    size_t len = strlen(message);
+
+    if (len > 0 && message[len - 1] == '\n') len--;
+
+    if (strncmp(message, ACTION_PREFIX, strlen(ACTION_PREFIX)) == 0)
+        return encode(POLYBAR_SOCKET_ACTION, message + strlen(ACTION_PREFIX),
+                      len - strlen(ACTION_PREFIX), frame, size);
+
+    if (strncmp(message, CMD_PREFIX, strlen(CMD_PREFIX)) == 0)
+        return encode(POLYBAR_SOCKET_CMD, message + strlen(CMD_PREFIX),
+                      len - strlen(CMD_PREFIX), frame, size);
+
+    if (strncmp(message, HOOK_PREFIX, strlen(HOOK_PREFIX)) != 0) return 0;
+
+    // The hook index is the number at the end of the module name, and starts
+    // at 1 while the index of the hook action starts at 0
+    const char *name = message + strlen(HOOK_PREFIX);
+    const char *end = message + len;
+    const char *digits = end;
+
+    while (digits > name && digits[-1] >= '0' && digits[-1] <= '9') digits--;
+    if (digits == name || digits == end) return 0;
+
+    const long index = strtol(digits, NULL, 10);
+    if (index < 1) return 0;
+
+    char action[256];
+    const int action_len = snprintf(action, sizeof(action), "#%.*s.hook.%ld",
+                                    (int)(digits - name), name, index - 1);
+    if (action_len < 0 || (size_t)action_len >= sizeof(action)) return 0;
+
+    return encode(POLYBAR_SOCKET_ACTION, action, action_len, frame, size);
+}
+
+ssize_t polybar_socket_decode(const char *buf, size_t len,
+                              PolybarSocketType *type, const char **payload,
+                              size_t *payload_len) {
+    uint32_t size;
+
+    if (len < POLYBAR_SOCKET_HEADER_LEN) return 0;
+
+    if (memcmp(buf, POLYBAR_SOCKET_MAGIC, POLYBAR_SOCKET_MAGIC_LEN) != 0 ||
+        buf[POLYBAR_SOCKET_MAGIC_LEN] != POLYBAR_SOCKET_VERSION)
+        return -1;
+
+    memcpy(&size, buf + POLYBAR_SOCKET_MAGIC_LEN + 1, sizeof(size));
+    if (len < POLYBAR_SOCKET_HEADER_LEN + (size_t)size) return 0;
+
+    *type =
+        (PolybarSocketType)(unsigned char)buf[POLYBAR_SOCKET_HEADER_LEN - 1];
+    *payload = buf + POLYBAR_SOCKET_HEADER_LEN;
+    *payload_len = size;
+
+    return POLYBAR_SOCKET_HEADER_LEN + size;
+}
@@ -0,0 +1,146 @@
+#include "../include/snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Number of times a reader retries while the snapshot is being written before
+// falling back to DBus
+const int SNAPSHOT_READ_RETRIES = 1000;
+
+// Mapping of the snapshot file owned by the listener, NULL if not open
+static StatusSnapshot *published = NULL;
+
+dbus_bool_t snapshot_path(char *path, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        len = snprintf(path, size, "%s/spotify-listener.snapshot",
+                       runtime_dir);
+    } else {
+        len = snprintf(path, size, "/dev/shm/spotify-listener-%u.snapshot",
+                       (unsigned int)getuid());
+    }
+
+    return len > 0 && (size_t)len < size;
+}
+
+dbus_bool_t snapshot_writer_open() {
+    char path[PATH_MAX];
+
+    if (!snapshot_path(path, sizeof(path))) return FALSE;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return FALSE;
+
+    if (ftruncate(fd, sizeof(StatusSnapshot)) == -1) {
+        close(fd);
+        return FALSE;
+    }
+
+    void *addr = mmap(NULL, sizeof(StatusSnapshot), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) return FALSE;
+
+    published = addr;
+
+    // A previous listener may have been killed in the middle of an update
+    unsigned int seq = __atomic_load_n(&published->seq, __ATOMIC_RELAXED);
+    if (seq & 1) seq++;
+
+    // Invalidate the snapshot for readers while the header is written
+    __atomic_store_n(&published->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    published->magic = SNAPSHOT_MAGIC;
+    published->version = SNAPSHOT_VERSION;
+    published->writer_pid = getpid();
+    published->running = FALSE;
+    track_state_clear(&published->track);
+
+    __atomic_store_n(&published->seq, seq + 2, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+void snapshot_publish(const TrackState *track, dbus_bool_t running) {
+    if (published == NULL) return;
+
+    const unsigned int seq =
+        __atomic_load_n(&published->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&published->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    published->running = running;
+    memcpy(&published->track, track, sizeof(TrackState));
+
+    __atomic_store_n(&published->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void snapshot_writer_close() {
+    char path[PATH_MAX];
+
+    if (published == NULL) return;
+
+    munmap(published, sizeof(StatusSnapshot));
+    published = NULL;
+
+    if (snapshot_path(path, sizeof(path))) unlink(path);
+}
+
+dbus_bool_t snapshot_read(StatusSnapshot *snapshot) {
+    char path[PATH_MAX];
+    struct stat st;
+    dbus_bool_t consistent = FALSE;
+
+    if (!snapshot_path(path, sizeof(path))) return FALSE;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return FALSE;
+
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(StatusSnapshot)) {
+        close(fd);
+        return FALSE;
+    }
+
+    const StatusSnapshot *shared =
+        mmap(NULL, sizeof(StatusSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shared == MAP_FAILED) return FALSE;
+
+    for (int i = 0; i < SNAPSHOT_READ_RETRIES && !consistent; i++) {
+        const unsigned int seq =
+            __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+
+        // The listener is writing the snapshot
+        if (seq & 1) continue;
+
+        memcpy(snapshot, shared, sizeof(StatusSnapshot));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = __atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq;
+    }
+
+    munmap((void *)shared, sizeof(StatusSnapshot));
+
+    if (!consistent || snapshot->magic != SNAPSHOT_MAGIC ||
+        snapshot->version != SNAPSHOT_VERSION)
+        return FALSE;
+
+    // The listener was killed without removing the snapshot
+    if (kill(snapshot->writer_pid, 0) == -1 && errno == ESRCH) return FALSE;
+
+    return TRUE;
+}
@@ -1,77 +1,508 @@
 #include "../include/spotify-listener.h"
 
 #include <dbus-1.0/dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../include/event-loop.h"
+#include "../include/format.h"
+#include "../include/ipc-writer.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/mpris.h"
+#include "../include/polybar-ipc.h"
+#include "../include/probes.h"
+#include "../include/snapshot.h"
+#include "../include/trace.h"
 #include "../include/utils.h"
 
-#ifdef VERBOSE
-const dbus_bool_t VERBOSE = TRUE;
-#else
-const dbus_bool_t VERBOSE = FALSE;
-#endif
-
+// Directory polybar creates its IPC FIFOs in
 const char *POLYBAR_IPC_DIRECTORY = "/tmp";
 
-// Used to check if track has changed
-char *last_trackid = NULL;
+// Directory polybar 3.6+ creates its IPC sockets in, NULL for the default of
+// polybar
+const char *POLYBAR_SOCKET_DIRECTORY = NULL;
+
+// Write to every bar with a single io_uring submission when it is available
+dbus_bool_t IPC_USE_IO_URING = TRUE;
+
+// Last known state of the player. Also used to check if track has changed.
+TrackState current_track;
 
 // Used to identify spotify for Play/Pause
-char *dbus_senderid = NULL;
+char dbus_senderid[DBUS_MAXIMUM_NAME_LENGTH + 1] = "";
 
 // Current state of spotify
-typedef enum { PLAYING, PAUSED, EXITED } SpotifyState;
-SpotifyState CURRENT_SPOTIFY_STATE = EXITED;
+SpotifyState CURRENT_SPOTIFY_STATE = UNKNOWN;
+
+// If TRUE, the listener renders the status itself and sends it to the spotify
+// module instead of making polybar run `spotifyctl status`
+dbus_bool_t PUSH_STATUS = FALSE;
+
+// Status format options, see spotifyctl
+int STATUS_MAX_ARTIST_LENGTH = INT_MAX;
+int STATUS_MAX_TITLE_LENGTH = INT_MAX;
+int STATUS_MAX_LENGTH = INT_MAX;
+const char *STATUS_FORMAT = "%artist%: %title%";
+const char *STATUS_TRUNC = "...";
+
+// Prefix of the message that sets the text of the spotify module
+const char *STATUS_ACTION_PREFIX = "action:#spotify.send.";
+
+// Message that makes polybar run `spotifyctl status` for the spotify module
+const char *STATUS_HOOK = "hook:module/spotify2";
+
+// If TRUE, messages are only sent to the modules they would change
+dbus_bool_t HOOK_DIFF = TRUE;
+
+// Track that the bars were last told to show with STATUS_HOOK
+char status_hook_trackid[TRACK_ID_SIZE] = "";
+
+// Compiled from the status format options at startup
+StatusFormat status_format;
+
+// Indexes of the artist and title of current_track, kept between renders
+FormatCache status_cache;
+
+// Last message sent to update the spotify module
+char status_message[IPC_MAX_MSG_LEN] = "";
+
+// Milliseconds to wait for more signals before updating polybar. Spotify sends
+// several signals within a few milliseconds when skipping tracks.
+long COALESCE_WINDOW_MS = 20;
+
+// Changes merged within the current coalescing window
+dbus_bool_t has_pending_update = FALSE;
+SpotifyState pending_spotify_state = EXITED;
+dbus_bool_t pending_track_change = FALSE;
+unsigned long pending_events = 0;
+long long coalesce_deadline_ms = 0;
+// Milliseconds to wait before closing a coalescing window again when the queue
+// of the IPC writer thread is full
+const long IPC_WRITER_RETRY_MS = 1;
+// Monotonic time at which the first change of the window was received
+long long pending_origin_us = 0;
+
+// Monotonic time at which the message being dispatched was received
+long long message_received_us = 0;
+// Monotonic time of the event that caused the update being sent to polybar, 0
+// if unknown
+long long update_origin_us = 0;
+
+ListenerStats listener_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+
+const char *SPOTIFY_BUS_NAME = "org.mpris.MediaPlayer2.spotify";
 
-// DBus signals to listen for
-const char *PROPERTIES_CHANGED_MATCH =
-    "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
-    "path='/org/mpris/MediaPlayer2'";
+// DBus signals to listen for. The PropertiesChanged match is only armed while
+// spotify is running and is restricted to the unique name that owns
+// SPOTIFY_BUS_NAME, so other MPRIS players never wake up the listener.
+const char *PROPERTIES_CHANGED_MATCH_FORMAT =
+    "type='signal',sender='%s',interface='org.freedesktop.DBus.Properties',"
+    "member='PropertiesChanged',path='/org/mpris/MediaPlayer2',"
+    "arg0='org.mpris.MediaPlayer2.Player'";
 const char *NAME_OWNER_CHANGED_MATCH =
-    "interface='org.freedesktop.DBus',member='NameOwnerChanged',path='/org/"
-    "freedesktop/DBus'";
+    "type='signal',sender='org.freedesktop.DBus',"
+    "interface='org.freedesktop.DBus',member='NameOwnerChanged',"
+    "path='/org/freedesktop/DBus',arg0='org.mpris.MediaPlayer2.spotify'";
 
+// GetAll call sent when spotify was launched, NULL if none is in flight
+DBusPendingCall *launch_call = NULL;
+// Monotonic time at which spotify was launched
+long long launch_time_us = 0;
 
-dbus_bool_t update_last_trackid(const char *trackid) {
-    if (trackid != NULL) {
-        // +1 for null char
-        size_t size = strlen(trackid) + 1;
+// The currently armed PropertiesChanged match, empty if none is armed
+char properties_changed_match[512] = "";
 
-        last_trackid = (char *)realloc(last_trackid, size);
-        last_trackid[0] = '\0';
+// Trace file to record the messages handled by the listener to, NULL if none
+const char *RECORD_PATH = NULL;
 
-        strcpy(last_trackid, trackid);
+// Trace file to feed through the handlers instead of connecting to DBus, NULL
+// if none
+const char *REPLAY_PATH = NULL;
 
+// If TRUE, a trace is replayed as fast as possible instead of at the speed it
+// was recorded at
+dbus_bool_t REPLAY_FAST = FALSE;
+
+// File to periodically write metrics to in the Prometheus text format, NULL if
+// none
+const char *METRICS_PATH = NULL;
+long METRICS_INTERVAL_MS = 10000;
+long long metrics_deadline_ms = 0;
+
+// Timer closing the current coalescing window
+int coalesce_timer_fd = -1;
+
+// Signals that make the listener exit
+sigset_t termination_signals;
+
+
+void print_stats() {
+    log_record(LOG_LEVEL_DEBUG, "Stats",
+               "wakeups=%lu parsed=%lu events=%lu collapsed=%lu updates=%lu",
+               listener_stats.wakeups, listener_stats.parsed,
+               listener_stats.events, listener_stats.collapsed,
+               listener_stats.updates);
+}
+
+dbus_bool_t spotify_watch_owner(DBusConnection *connection,
+                                const char *owner) {
+    // Disarm the match of the previous owner. There is no connection while
+    // replaying a trace.
+    if (properties_changed_match[0] != '\0') {
+        if (connection != NULL)
+            dbus_bus_remove_match(connection, properties_changed_match, NULL);
+        properties_changed_match[0] = '\0';
+    }
+
+    if (owner == NULL || owner[0] == '\0') {
+        dbus_senderid[0] = '\0';
         return TRUE;
-    } else {
+    }
+
+    spotify_update_sender(owner);
+
+    snprintf(properties_changed_match, sizeof(properties_changed_match),
+             PROPERTIES_CHANGED_MATCH_FORMAT, owner);
+
+    // Without an error, this does not block waiting for the bus to reply, so
+    // it can be called from a handler
+    if (connection != NULL)
+        dbus_bus_add_match(connection, properties_changed_match, NULL);
+
+    log_record(LOG_LEVEL_DEBUG, "Watching spotify", "owner=%s", owner);
+
+    return TRUE;
+}
+
+dbus_bool_t spotify_resolve_owner(DBusConnection *connection) {
+    DBusError err;
+    const char *owner = NULL;
+
+    dbus_error_init(&err);
+
+    DBusMessage *msg = dbus_message_new_method_call(
+        DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "GetNameOwner");
+    dbus_message_append_args(msg, DBUS_TYPE_STRING, &SPOTIFY_BUS_NAME,
+                             DBUS_TYPE_INVALID);
+
+    DBusMessage *reply =
+        dbus_connection_send_with_reply_and_block(connection, msg, 1000, &err);
+    dbus_message_unref(msg);
+
+    // NameHasNoOwner error means spotify is not running
+    if (reply != NULL) {
+        dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID);
+    }
+
+    spotify_watch_owner(connection, owner);
+
+    if (reply != NULL) dbus_message_unref(reply);
+    dbus_error_free(&err);
+
+    return owner != NULL;
+}
+
+SpotifyState spotify_state_from_status(const char *status) {
+    if (strcmp(status, "Playing") == 0) return PLAYING;
+    if (strcmp(status, "Paused") == 0) return PAUSED;
+    return UNKNOWN;
+}
+
+dbus_bool_t spotify_set_state(SpotifyState state) {
+    switch (state) {
+        case PLAYING:
+            return spotify_playing();
+        case PAUSED:
+            return spotify_paused();
+        case EXITED:
+            return spotify_exited();
+        default:
+            return FALSE;
+    }
+}
+
+dbus_bool_t spotify_apply_player_state(DBusMessage *reply) {
+    DBusMessageIter iter;
+    SpotifyState state = UNKNOWN;
+
+    track_state_clear(&current_track);
+    if (dbus_message_iter_init(reply, &iter))
+        mpris_decode_properties(&iter, &current_track);
+
+    // Spotify is running, but without a known status the play/pause buttons
+    // can't be shown correctly, so treat it as paused
+    if (current_track.fields & TRACK_HAS_STATUS)
+        state = spotify_state_from_status(current_track.status);
+    if (state == UNKNOWN) state = PAUSED;
+
+    // Publish before polybar is told to refresh the modules
+    snapshot_publish(&current_track, TRUE);
+
+    return spotify_set_state(state);
+}
+
+void spotify_launch_reply(DBusPendingCall *pending, void *user_data) {
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+
+    dbus_pending_call_unref(launch_call);
+    launch_call = NULL;
+
+    if (reply == NULL) return;
+
+    trace_record(reply);
+
+    update_origin_us = launch_time_us;
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        // Spotify may not have exported its player yet, in which case its
+        // first PropertiesChanged signal will update polybar instead
+        log_record(LOG_LEVEL_WARN, "Failed to get spotify state", "error=%s",
+                   dbus_message_get_error_name(reply));
+    } else if (spotify_apply_player_state(reply)) {
+        const long long latency_us = get_monotonic_us() - launch_time_us;
+
+        listener_stats.updates++;
+        listener_stats.launches++;
+        listener_stats.last_launch_latency_us = latency_us;
+        if (latency_us > listener_stats.max_launch_latency_us)
+            listener_stats.max_launch_latency_us = latency_us;
+
+        log_record(LOG_LEVEL_INFO, "Spotify launched",
+                   "visible_after_us=%lld max_us=%lld", latency_us,
+                   listener_stats.max_launch_latency_us);
+    }
+
+    update_origin_us = 0;
+    dbus_message_unref(reply);
+}
+
+static void cancel_launch_query() {
+    if (launch_call != NULL) {
+        dbus_pending_call_cancel(launch_call);
+        dbus_pending_call_unref(launch_call);
+        launch_call = NULL;
+    }
+}
+
+dbus_bool_t spotify_query_launch(DBusConnection *connection) {
+    // Spotify was restarted before the previous launch was answered
+    cancel_launch_query();
+
+    // While replaying a trace, the recorded reply is replayed instead
+    if (connection == NULL) return FALSE;
+
+    DBusMessage *msg = mpris_new_get_all_call(dbus_senderid);
+    if (msg == NULL) return FALSE;
+
+    dbus_bool_t sent =
+        dbus_connection_send_with_reply(connection, msg, &launch_call, 1000) &&
+        launch_call != NULL &&
+        dbus_pending_call_set_notify(launch_call, spotify_launch_reply, NULL,
+                                     NULL);
+    dbus_message_unref(msg);
+
+    if (!sent) cancel_launch_query();
+
+    return sent;
+}
+
+dbus_bool_t spotify_sync_state(DBusConnection *connection) {
+    DBusError err;
+
+    // Spotify is not running, so hide the modules
+    if (dbus_senderid[0] == '\0') {
+        snapshot_publish(&current_track, FALSE);
+        return spotify_set_state(EXITED);
+    }
+
+    dbus_error_init(&err);
+
+    DBusMessage *msg = mpris_new_get_all_call(dbus_senderid);
+    if (msg == NULL) return FALSE;
+
+    DBusMessage *reply =
+        dbus_connection_send_with_reply_and_block(connection, msg, 1000, &err);
+    dbus_message_unref(msg);
+
+    if (reply == NULL) {
+        log_record(LOG_LEVEL_WARN, "Failed to get spotify state",
+                   "error=\"%s\"", err.message);
+        dbus_error_free(&err);
         return FALSE;
     }
+
+    trace_record(reply);
+
+    const dbus_bool_t updated = spotify_apply_player_state(reply);
+    dbus_message_unref(reply);
+
+    return updated;
 }
 
-dbus_bool_t spotify_update_track(const char *current_trackid) {
-    // If trackid didn't change
-    if (last_trackid != NULL && strcmp(current_trackid, last_trackid) != 0) {
-        puts("Track Changed");
-        // Send message to update track name
-        if (send_ipc_polybar(1, "hook:module/spotify2")) return TRUE;
+DBusHandlerResult wakeup_counter(DBusConnection *connection,
+                                 DBusMessage *message, void *user_data) {
+    message_received_us = get_monotonic_us();
+    listener_stats.wakeups++;
+
+    if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+        metrics_count(METRIC_SIGNALS_RECEIVED, 1);
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Count a signal as handled or filtered along with the time taken to get to
+ * that decision since it was received
+ */
+static void count_signal(const dbus_bool_t handled) {
+    metrics_count(handled ? METRIC_SIGNALS_HANDLED : METRIC_SIGNALS_FILTERED,
+                  1);
+    metrics_record(METRIC_HANDLER_TIME,
+                   get_monotonic_us() - message_received_us);
+}
+
+DBusHandlerResult unhandled_counter(DBusConnection *connection,
+                                    DBusMessage *message, void *user_data) {
+    if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+        count_signal(FALSE);
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+DBusHandlerResult trace_recorder(DBusConnection *connection,
+                                 DBusMessage *message, void *user_data) {
+    // Only record the signals that the handlers act on
+    if (dbus_message_is_signal(message, DBUS_INTERFACE_PROPERTIES,
+                               "PropertiesChanged") ||
+        dbus_message_is_signal(message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged"))
+        trace_record(message);
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+const char *spotify_status_message() {
+    if (!PUSH_STATUS) return STATUS_HOOK;
+
+    const size_t prefix_len = strlen(STATUS_ACTION_PREFIX);
+    memcpy(status_message, STATUS_ACTION_PREFIX, prefix_len);
+
+    // Leave room for the newline added when the message is sent
+    format_render(&status_format, &current_track, &status_cache,
+                  status_message + prefix_len,
+                  sizeof(status_message) - prefix_len - 1);
+
+    // A newline would end the message early
+    for (char *c = status_message; *c != '\0'; c++) {
+        if (*c == '\n' || *c == '\r') *c = ' ';
     }
+
+    return status_message;
+}
+
+dbus_bool_t spotify_update_track() {
+    log_record(LOG_LEVEL_INFO, "Track changed", NULL);
+    // Send message to update track name
+    if (send_ipc_polybar(1, spotify_status_message())) return TRUE;
     return FALSE;
 }
 
-dbus_bool_t spotify_update_sender(const char *senderid) {
-    if (senderid != NULL) {
-        // +1 for null char
-        size_t size = strlen(senderid) + 1;
+static void coalesce_begin() {
+    // First change in this window
+    if (!has_pending_update) {
+        has_pending_update = TRUE;
+        pending_spotify_state = CURRENT_SPOTIFY_STATE;
+        pending_track_change = FALSE;
+        pending_events = 0;
+        coalesce_deadline_ms = get_monotonic_ms() + COALESCE_WINDOW_MS;
+        pending_origin_us = message_received_us;
+    }
 
-        dbus_senderid = (char *)realloc(dbus_senderid, size);
-        dbus_senderid[0] = '\0';
+    pending_events++;
+    listener_stats.events++;
+}
+
+void coalesce_state(SpotifyState state) {
+    coalesce_begin();
+    pending_spotify_state = state;
+}
+
+void coalesce_track_change() {
+    coalesce_begin();
+    pending_track_change = TRUE;
+}
+
+int coalesce_flush_due() {
+    if (!has_pending_update) return -1;
+
+    const long long remaining = coalesce_deadline_ms - get_monotonic_ms();
+    if (remaining > 0) return remaining;
+
+    // The writer thread is behind, so keep merging changes until it catches
+    // up rather than dropping an update
+    if (ipc_writer_full()) return IPC_WRITER_RETRY_MS;
+
+    has_pending_update = FALSE;
+
+    // Play/pause updates already refresh the track, so only send the track
+    // change on its own if the state did not change
+    PROBE2(coalesce_flush, pending_events, pending_origin_us);
+
+    dbus_bool_t updated = FALSE;
+    update_origin_us = pending_origin_us;
+    if (pending_spotify_state != CURRENT_SPOTIFY_STATE) {
+        updated = spotify_set_state(pending_spotify_state);
+    } else if (pending_track_change && CURRENT_SPOTIFY_STATE != EXITED) {
+        updated = spotify_update_track();
+    }
+
+    update_origin_us = 0;
 
-        strcpy(dbus_senderid, senderid);
+    if (updated) listener_stats.updates++;
+    listener_stats.collapsed += pending_events - 1;
+
+    if (pending_events > 1) {
+        log_record(LOG_LEVEL_DEBUG, "Coalesced events into one update",
+                   "events=%lu", pending_events);
+    }
+    print_stats();
+
+    return -1;
+}
+
+int metrics_write_due() {
+    if (METRICS_PATH == NULL) return -1;
+
+    const long long remaining = metrics_deadline_ms - get_monotonic_ms();
+    if (remaining > 0) return remaining;
+
+    if (!metrics_write_prometheus(METRICS_PATH))
+        log_record(LOG_LEVEL_WARN, "Failed to write metrics", "path=%s",
+                   METRICS_PATH);
+
+    metrics_deadline_ms = get_monotonic_ms() + METRICS_INTERVAL_MS;
+    return METRICS_INTERVAL_MS;
+}
+
+dbus_bool_t spotify_update_sender(const char *senderid) {
+    if (senderid != NULL) {
+        strncpy(dbus_senderid, senderid, DBUS_MAXIMUM_NAME_LENGTH);
+        dbus_senderid[DBUS_MAXIMUM_NAME_LENGTH] = '\0';
 
         return TRUE;
     } else {
@@ -81,11 +512,11 @@ dbus_bool_t spotify_update_sender(const char *senderid) {
 
 dbus_bool_t spotify_playing() {
     if (CURRENT_SPOTIFY_STATE != PLAYING) {
-        puts("Song is playing");
+        log_record(LOG_LEVEL_INFO, "Song is playing", NULL);
         // Show pause, next, and previous button on polybar
         if (send_ipc_polybar(4, "hook:module/playpause2",
                              "hook:module/previous2", "hook:module/next2",
-                             "hook:module/spotify2")) {
+                             spotify_status_message())) {
             CURRENT_SPOTIFY_STATE = PLAYING;
             return TRUE;
         }
@@ -95,11 +526,11 @@ dbus_bool_t spotify_playing() {
 
 dbus_bool_t spotify_paused() {
     if (CURRENT_SPOTIFY_STATE != PAUSED) {
-        puts("Song is paused");
+        log_record(LOG_LEVEL_INFO, "Song is paused", NULL);
         // Show play, next, and previous button on polybar
         if (send_ipc_polybar(4, "hook:module/playpause3",
                              "hook:module/previous2", "hook:module/next2",
-                             "hook:module/spotify2")) {
+                             spotify_status_message())) {
             CURRENT_SPOTIFY_STATE = PAUSED;
             return TRUE;
         }
@@ -121,46 +552,47 @@ dbus_bool_t spotify_exited() {
 }
 
 dbus_bool_t send_ipc_polybar(int numOfMsgs, ...) {
-    char **paths;
-    size_t num_of_paths;
+    const char *messages[numOfMsgs];
     va_list args;
 
-    // Pass address of pointer to array of strings
-    get_polybar_ipc_paths(POLYBAR_IPC_DIRECTORY, &paths, &num_of_paths);
+    va_start(args, numOfMsgs);
+    for (int m = 0; m < numOfMsgs; m++) messages[m] = va_arg(args, char *);
+    va_end(args);
 
-    for (size_t p = 0; p < num_of_paths; p++) {
-        FILE *fp;
+    unsigned int refresh = HOOK_DIFF ? 0 : IPC_REFRESH_ALL;
+    dbus_bool_t sends_status_hook = FALSE;
 
-        va_start(args, numOfMsgs);
-        for (int m = 0; m < numOfMsgs; m++) {
-            const char *message = va_arg(args, char *);
+    // The bars only skip messages their modules already show, but the output
+    // of spotifyctl status changes with the track while its hook stays the
+    // same
+    for (int m = 0; m < numOfMsgs; m++) {
+        if (strcmp(messages[m], STATUS_HOOK) != 0) continue;
 
-            fp = fopen(paths[p], "w");
-            fputs(message, fp);
-            printf("%s%s%s%s%s\n", "Sending the message '", message, "' to '",
-                   paths[p], "'");
-
-            fclose(fp);
+        sends_status_hook = TRUE;
+        if (!(current_track.fields & TRACK_HAS_TRACKID) ||
+            strcmp(current_track.trackid, status_hook_trackid) != 0)
+            refresh |= 1u << m;
+    }
 
-            // Without sleep, requests are sometimes ignored
-            msleep(10);
-        }
-        va_end(args);
+    // Delivered by the writer thread, so a slow bar never delays reading the
+    // next signal
+    if (!ipc_writer_send(messages, numOfMsgs, refresh, update_origin_us))
+        return FALSE;
 
-        free(paths[p]);
+    if (sends_status_hook) {
+        strcpy(status_hook_trackid, (current_track.fields & TRACK_HAS_TRACKID)
+                                        ? current_track.trackid
+                                        : "");
     }
 
-    free(paths);
-
     return TRUE;
 }
 
-DBusHandlerResult properties_changed_handler(DBusConnection *connection,
-                                             DBusMessage *message,
-                                             void *user_data) {
-    if (VERBOSE) puts("Running properties_changed_handler");
+static DBusHandlerResult handle_properties_changed(DBusConnection *connection,
+                                                   DBusMessage *message) {
+    log_record(LOG_LEVEL_DEBUG, "Running properties_changed_handler", NULL);
     DBusMessageIter iter;
-    DBusMessageIter sub_iter;
+    TrackState changed;
     dbus_bool_t is_spotify = FALSE;
     dbus_message_iter_init(message, &iter);
 
@@ -188,94 +620,82 @@ DBusHandlerResult properties_changed_handler(DBusConnection *connection,
      *
      */
 
-    char *interface_name = iter_get_string(&iter);
+    StringView interface_name;
 
     // Check if interface is correct
-    if (interface_name != NULL &&
-        strcmp(interface_name, "org.mpris.MediaPlayer2.Player") != 0) {
-        if (VERBOSE)
-            puts(
-                "Interface of PropertiesChanged signal not "
-                "org.mpris.MediaPlayer2.Player");
-        free(interface_name);
+    if (iter_get_string_view(&iter, &interface_name) &&
+        !string_view_equals(&interface_name,
+                            "org.mpris.MediaPlayer2.Player")) {
+        log_record(LOG_LEVEL_DEBUG,
+                   "Interface of PropertiesChanged signal not "
+                   "org.mpris.MediaPlayer2.Player",
+                   NULL);
         return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
-    free(interface_name);
 
     dbus_message_iter_next(&iter);
 
-    // Recurse into array
-    if (!(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
-          // Go to value with Metadata key
-          iter_try_step_to_key(&sub_iter, "Metadata") &&
-          // Step into variant value
-          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
-          // Step into array of metadata
-          iter_try_step_into_signature(&sub_iter, "a{sv}") &&
-          // Go to value with key mpris:trackid
-          iter_try_step_to_key(&sub_iter, "mpris:trackid") &&
-          // Step into container
-          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
-          // Verify string type
-          dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING) &&
-
-          !(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
-          // Go to value with Metadata key
-          iter_try_step_to_key(&sub_iter, "PlaybackStatus") &&
-          // Step into variant value
-          iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
-          // Verify string type
-          dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING)) {
+    listener_stats.parsed++;
+
+    // Decode every changed property in a single walk of the array
+    track_state_clear(&changed);
+    if (!mpris_decode_properties(&iter, &changed) ||
+        !(changed.fields & (TRACK_HAS_TRACKID | TRACK_HAS_STATUS))) {
         return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
 
     // Make sure trackid begins with spotify
-    char *trackid = iter_get_string(&sub_iter);
-    if (trackid != NULL && strncmp(trackid, "/com/spotify", 12) == 0) {
+    if ((changed.fields & TRACK_HAS_TRACKID) &&
+        strncmp(changed.trackid, "/com/spotify", 12) == 0) {
         spotify_update_sender(dbus_message_get_sender(message));
-        spotify_update_track(trackid);
-        update_last_trackid(trackid);
+        if ((current_track.fields & TRACK_HAS_TRACKID) &&
+            strcmp(changed.trackid, current_track.trackid) != 0)
+            coalesce_track_change();
         is_spotify = TRUE;
 
-        if (VERBOSE) puts("Spotify Detected");
+        log_record(LOG_LEVEL_DEBUG, "Spotify detected", NULL);
     }
 
-    free(trackid);
-
-    if (!is_spotify && dbus_senderid && strcmp(dbus_senderid, dbus_message_get_sender(message)) == 0) {
+    if (!is_spotify && dbus_senderid[0] != '\0' &&
+        strcmp(dbus_senderid, dbus_message_get_sender(message)) == 0) {
         is_spotify = TRUE;
     }
 
     if (is_spotify) {
-        // Recurse into array
-        if (!(recurse_iter_of_type(&iter, &sub_iter, DBUS_TYPE_ARRAY) &&
-              // Step to PlaybackStatus key
-              iter_try_step_to_key(&sub_iter, "PlaybackStatus") &&
-              // Recurse into variant value
-              iter_try_step_into_type(&sub_iter, DBUS_TYPE_VARIANT) &&
-              // Verify string type
-              dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING)) {
-            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-        }
+        track_state_merge(&current_track, &changed);
+        snapshot_publish(&current_track, TRUE);
 
         // Update polybar modules
-        char *status = iter_get_string(&sub_iter);
-        if (strcmp(status, "Paused") == 0) {
-            spotify_paused();
-        } else if (strcmp(status, "Playing") == 0) {
-            spotify_playing();
+        if (changed.fields & TRACK_HAS_STATUS) {
+            const SpotifyState state =
+                spotify_state_from_status(changed.status);
+            if (state != UNKNOWN) coalesce_state(state);
         }
 
-        free(status);
+        count_signal(TRUE);
+        return DBUS_HANDLER_RESULT_HANDLED;
     }
 
-    return DBUS_HANDLER_RESULT_HANDLED;
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
-DBusHandlerResult name_owner_changed_handler(DBusConnection *connection,
+DBusHandlerResult properties_changed_handler(DBusConnection *connection,
                                              DBusMessage *message,
                                              void *user_data) {
-    if (VERBOSE) puts("Starting handler for name owner changed");
+    PROBE1(properties_changed_entry, message);
+
+    const DBusHandlerResult res =
+        handle_properties_changed(connection, message);
+
+    PROBE1(properties_changed_return, res);
+
+    return res;
+}
+
+static DBusHandlerResult handle_name_owner_changed(DBusConnection *connection,
+                                                   DBusMessage *message) {
+    log_record(LOG_LEVEL_DEBUG, "Starting handler for name owner changed",
+               NULL);
 
     const char *name;
     const char *old_owner;
@@ -296,24 +716,459 @@ DBusHandlerResult name_owner_changed_handler(DBusConnection *connection,
         return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
 
-    // If name matches spotify and new owner is "", spotify disconnected
-    if (strcmp(name, "org.mpris.MediaPlayer2.spotify") == 0 &&
-        strcmp(new_owner, "") == 0) {
-        puts("Spotify disconnected");
-        spotify_exited();
-        return DBUS_HANDLER_RESULT_HANDLED;
+    if (strcmp(name, SPOTIFY_BUS_NAME) != 0)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    // Follow spotify to its new unique name, or stop listening to it if it
+    // exited
+    spotify_watch_owner(connection, new_owner);
+
+    // If new owner is "", spotify disconnected
+    if (strcmp(new_owner, "") == 0) {
+        log_record(LOG_LEVEL_INFO, "Spotify disconnected", NULL);
+        cancel_launch_query();
+        snapshot_publish(&current_track, FALSE);
+        coalesce_state(EXITED);
+    } else {
+        // Spotify was launched, so show its state without waiting for it to
+        // send a signal
+        launch_time_us = message_received_us;
+        spotify_query_launch(connection);
     }
 
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    count_signal(TRUE);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+DBusHandlerResult name_owner_changed_handler(DBusConnection *connection,
+                                             DBusMessage *message,
+                                             void *user_data) {
+    PROBE1(name_owner_changed_entry, message);
+
+    const DBusHandlerResult res =
+        handle_name_owner_changed(connection, message);
+
+    PROBE1(name_owner_changed_return, res);
+
+    return res;
+}
+
+/**
+ * Feed a recorded message through the handlers in the same order as
+ * dbus_connection_dispatch() would
+ */
+static void replay_message(DBusMessage *message) {
+    const DBusHandleMessageFunction filters[] = {
+        wakeup_counter, properties_changed_handler,
+        name_owner_changed_handler, unhandled_counter};
+
+    switch (dbus_message_get_type(message)) {
+        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+            // Reply to the GetAll call made at startup or at launch
+            if (spotify_apply_player_state(message)) listener_stats.updates++;
+            break;
+        case DBUS_MESSAGE_TYPE_SIGNAL:
+            for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+                if (filters[f](NULL, message, NULL) ==
+                    DBUS_HANDLER_RESULT_HANDLED)
+                    break;
+            }
+            break;
+    }
+}
+
+/**
+ * Wait until the monotonic time until_us, closing the coalescing windows that
+ * end before then like the timeout of the dispatch loop does
+ */
+static void replay_wait(const long long until_us) {
+    const struct timespec until = {until_us / (1000 * 1000),
+                                   until_us % (1000 * 1000) * 1000};
+    int flush_ms;
+
+    while ((flush_ms = coalesce_flush_due()) >= 0 &&
+           get_monotonic_us() + flush_ms * 1000LL < until_us)
+        msleep(flush_ms);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+           EINTR)
+        ;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    const long long x = *(const long long *)a;
+    const long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_replay_report(long long latencies[], const size_t num,
+                                const long long elapsed_us) {
+    long long sum = 0;
+
+    printf("%s%zu%s%.3f%s%.0f%s\n", "Replayed ", num, " messages in ",
+           elapsed_us / 1e6, " s (",
+           elapsed_us > 0 ? num * 1e6 / elapsed_us : 0.0, " messages/s)");
+
+    if (num == 0) return;
+
+    qsort(latencies, num, sizeof(long long), compare_latencies);
+    for (size_t i = 0; i < num; i++) sum += latencies[i];
+
+    printf("%s%.1f%s%lld%s%lld%s%lld%s\n", "Latency per message: avg ",
+           (double)sum / num, " us, p50 ", latencies[num / 2], " us, p99 ",
+           latencies[num * 99 / 100], " us, max ", latencies[num - 1], " us");
+}
+
+int replay_trace(const char *path) {
+    TraceReader reader;
+    DBusMessage *message;
+    char ipc_dir[] = "/tmp/spotify-listener-replay.XXXXXX";
+    char fifo_path[PATH_MAX];
+    long long *latencies = NULL;
+    size_t num_of_messages = 0;
+    size_t capacity = 0;
+    long long time_us;
+    long long first_us = -1;
+
+    if (!trace_reader_open(&reader, path)) {
+        fprintf(stderr, "%s%s%s\n", "Failed to read trace '", path, "'");
+        return 1;
+    }
+
+    // Send polybar messages to a FIFO of our own instead of the running bars
+    if (mkdtemp(ipc_dir) == NULL) {
+        fputs("Failed to create replay IPC directory\n", stderr);
+        trace_reader_close(&reader);
+        return 1;
+    }
+
+    snprintf(fifo_path, sizeof(fifo_path), "%s/polybar_mqueue.%d", ipc_dir,
+             (int)getpid());
+
+    // Opening a FIFO for reading and writing does not block, and keeps it
+    // readable until the reader is stopped
+    const int fifo_fd =
+        mkfifo(fifo_path, 0600) == 0 ? open(fifo_path, O_RDWR) : -1;
+    if (fifo_fd == -1) {
+        fputs("Failed to create replay IPC file\n", stderr);
+        rmdir(ipc_dir);
+        trace_reader_close(&reader);
+        return 1;
+    }
+
+    // Read every message as soon as it is sent, like polybar does
+    fflush(stdout);
+    const pid_t reader_pid = fork();
+    if (reader_pid == 0) {
+        char buf[IPC_MAX_MSG_LEN];
+
+        while (read(fifo_fd, buf, sizeof(buf)) != 0 || errno == EINTR)
+            ;
+        _exit(0);
+    }
+    close(fifo_fd);
+
+    ipc_use_io_uring(IPC_USE_IO_URING);
+    ipc_endpoints_init(ipc_dir, NULL);
+    ipc_writer_start();
+
+    const long long start_us = get_monotonic_us();
+
+    while ((message = trace_reader_next(&reader, &time_us)) != NULL) {
+        if (first_us == -1) first_us = time_us;
+
+        if (!REPLAY_FAST) replay_wait(start_us + time_us - first_us);
+
+        const long long message_start_us = get_monotonic_us();
+
+        replay_message(message);
+        coalesce_flush_due();
+
+        if (num_of_messages == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            latencies =
+                (long long *)realloc(latencies, capacity * sizeof(long long));
+        }
+        latencies[num_of_messages++] = get_monotonic_us() - message_start_us;
+
+        dbus_message_unref(message);
+    }
+
+    // Close the last coalescing window
+    int flush_ms;
+    while ((flush_ms = coalesce_flush_due()) >= 0) msleep(flush_ms);
+
+    // Include the time taken to deliver the queued updates
+    ipc_writer_stop();
+
+    const long long elapsed_us = get_monotonic_us() - start_us;
+
+    // Keep the report after the records logged while replaying
+    log_flush();
+    print_replay_report(latencies, num_of_messages, elapsed_us);
+    printf("%s%lu%s%lu%s%zu%s%d%s%lu%s%lu%s%lu%s\n", "Sent ",
+           listener_stats.updates, " updates for ", listener_stats.events,
+           " events, max queue depth ", ipc_writer_max_depth(), " of ",
+           IPC_QUEUE_SIZE, ", ",
+           (unsigned long)metrics_get(METRIC_UPDATES_DROPPED),
+           " updates dropped, ",
+           (unsigned long)metrics_get(METRIC_HOOKS_SENT), " hooks sent, ",
+           (unsigned long)metrics_get(METRIC_HOOKS_AVOIDED), " hooks avoided");
+
+    // Write the metrics of the whole replay
+    metrics_deadline_ms = 0;
+    metrics_write_due();
+
+    if (reader_pid > 0) {
+        kill(reader_pid, SIGTERM);
+        waitpid(reader_pid, NULL, 0);
+    }
+
+    ipc_endpoints_free();
+    ipc_use_io_uring(FALSE);
+    unlink(fifo_path);
+    rmdir(ipc_dir);
+    trace_reader_close(&reader);
+    free(latencies);
+
+    return 0;
 }
 
 void free_user_data(void *memory) {}
 
-int main() {
+void messages_dispatched(DBusConnection *connection) {
+    log_record(LOG_LEVEL_DEBUG, "Dispatched messages", NULL);
+    event_loop_arm_timer(coalesce_timer_fd, coalesce_flush_due(), 0);
+}
+
+void coalesce_timer_expired(int fd, uint32_t events, void *user_data) {
+    // Rearmed if the window could not be closed yet
+    event_loop_arm_timer(fd, coalesce_flush_due(), 0);
+}
+
+void metrics_timer_expired(int fd, uint32_t events, void *user_data) {
+    event_loop_arm_timer(fd, metrics_write_due(), 0);
+}
+
+void bars_changed(int fd, uint32_t events, void *user_data) {
+    // The endpoints belong to the IPC writer thread, which reads the events
+    ipc_writer_refresh();
+}
+
+void ipc_retry_timer_expired(int fd, uint32_t events, void *user_data) {
+    // Rearmed by the IPC writer if bars still don't accept their messages
+    ipc_writer_refresh();
+}
+
+void termination_requested(int fd, uint32_t events, void *user_data) {
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info)) return;
+
+    log_record(LOG_LEVEL_INFO, "Exiting", "signal=%u", info.ssi_signo);
+    event_loop_stop();
+}
+
+void print_usage() {
+    puts("usage: spotify-listener [options]");
+    puts("");
+    puts("  Options:");
+    puts("    --coalesce-ms             The number of milliseconds to wait for");
+    puts("                              more signals from spotify before");
+    puts("                              updating polybar. All changes within");
+    puts("                              this window are merged into a single");
+    puts("                              update. 0 updates polybar right away.");
+    puts("                                Default: 20");
+    puts("    --push                    Render the status and send it to the");
+    puts("                              spotify module directly instead of");
+    puts("                              making polybar run spotifyctl status.");
+    puts("                              The spotify module must be a");
+    puts("                              custom/ipc module (polybar 3.6+).");
+    puts("                              Passing any of the options below");
+    puts("                              implies --push.");
+    puts("    --max-artist-length       See spotifyctl help");
+    puts("    --max-title-length        See spotifyctl help");
+    puts("    --max-length              See spotifyctl help");
+    puts("    --format                  See spotifyctl help");
+    puts("    --trunc                   See spotifyctl help");
+    puts("    --ipc-dir DIR             The directory to look for polybar IPC");
+    puts("                              FIFOs in");
+    puts("                                Default: /tmp");
+    puts("    --ipc-socket-dir DIR      The directory to look for polybar IPC");
+    puts("                              sockets in (polybar 3.6+). Bars with");
+    puts("                              a socket are sent messages through it");
+    puts("                              instead of their FIFO.");
+    puts("                                Default: $XDG_RUNTIME_DIR/polybar");
+    puts("    --no-hook-diff            Send every hook on every update, even");
+    puts("                              to modules that already show it. Use");
+    puts("                              this if the spotifyctl status format");
+    puts("                              of the spotify module has %status%.");
+    puts("    --ipc-backend BACKEND     How to write to the bars: io_uring");
+    puts("                              submits the writes to every bar at");
+    puts("                              once, write writes to one bar at a");
+    puts("                              time. io_uring falls back to write");
+    puts("                              if the kernel doesn't support it.");
+    puts("                                Default: io_uring");
+    puts("    --metrics FILE            Periodically write counters and latency");
+    puts("                              percentiles of the listener to a file");
+    puts("                              in the Prometheus text format");
+    puts("    --metrics-interval-ms     The number of milliseconds between");
+    puts("                              writes of the metrics file");
+    puts("                                Default: 10000");
+    puts("    --log-level LEVEL         The most verbose level of messages to");
+    puts("                              log: error, warn, info or debug");
+    puts("                                Default: info");
+    puts("    --record FILE             Record every message handled by the");
+    puts("                              listener to a trace file");
+    puts("    --replay FILE             Feed a recorded trace through the");
+    puts("                              listener at the speed it was recorded");
+    puts("                              at without connecting to DBus or");
+    puts("                              polybar, and report the throughput");
+    puts("                              and latency per message");
+    puts("    --replay-fast             Replay the trace as fast as possible");
+    puts("    help                      Show this message");
+}
+
+int main(int argc, char *argv[]) {
+    const long long start_us = get_monotonic_us();
     DBusConnection *connection;
     DBusError err;
 
+#ifdef VERBOSE
+    // Verbose builds log everything unless told otherwise
+    log_set_level(LOG_LEVEL_DEBUG);
+#endif
+
+    // Parse commandline options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--coalesce-ms") == 0 && i + 1 < argc) {
+            char *end;
+            COALESCE_WINDOW_MS = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || COALESCE_WINDOW_MS < 0) {
+                fputs("Coalescing window must be a non-negative integer!\n",
+                      stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--push") == 0) {
+            PUSH_STATUS = TRUE;
+        } else if (strcmp(argv[i], "--max-artist-length") == 0 &&
+                   i + 1 < argc) {
+            STATUS_MAX_ARTIST_LENGTH = atoi(argv[++i]);
+            PUSH_STATUS = TRUE;
+            if (STATUS_MAX_ARTIST_LENGTH <= 0) {
+                fputs("Artist length must be a positive integer!\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-title-length") == 0 && i + 1 < argc) {
+            STATUS_MAX_TITLE_LENGTH = atoi(argv[++i]);
+            PUSH_STATUS = TRUE;
+            if (STATUS_MAX_TITLE_LENGTH <= 0) {
+                fputs("Title length must be a positive integer!\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-length") == 0 && i + 1 < argc) {
+            STATUS_MAX_LENGTH = atoi(argv[++i]);
+            PUSH_STATUS = TRUE;
+            if (STATUS_MAX_LENGTH <= 0) {
+                fputs("Max length must be a positive integer!\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            STATUS_FORMAT = argv[++i];
+            PUSH_STATUS = TRUE;
+        } else if (strcmp(argv[i], "--trunc") == 0 && i + 1 < argc) {
+            STATUS_TRUNC = argv[++i];
+            PUSH_STATUS = TRUE;
+        } else if (strcmp(argv[i], "--ipc-dir") == 0 && i + 1 < argc) {
+            POLYBAR_IPC_DIRECTORY = argv[++i];
+        } else if (strcmp(argv[i], "--ipc-socket-dir") == 0 && i + 1 < argc) {
+            POLYBAR_SOCKET_DIRECTORY = argv[++i];
+        } else if (strcmp(argv[i], "--no-hook-diff") == 0) {
+            HOOK_DIFF = FALSE;
+        } else if (strcmp(argv[i], "--ipc-backend") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            if (strcmp(backend, "io_uring") == 0) {
+                IPC_USE_IO_URING = TRUE;
+            } else if (strcmp(backend, "write") == 0) {
+                IPC_USE_IO_URING = FALSE;
+            } else {
+                fputs("IPC backend must be io_uring or write!\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            METRICS_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval-ms") == 0 &&
+                   i + 1 < argc) {
+            char *end;
+            METRICS_INTERVAL_MS = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || METRICS_INTERVAL_MS <= 0) {
+                fputs("Metrics interval must be a positive integer!\n",
+                      stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], &level)) {
+                fputs("Log level must be error, warn, info or debug!\n",
+                      stderr);
+                return 1;
+            }
+            log_set_level(level);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            RECORD_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            REPLAY_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--replay-fast") == 0) {
+            REPLAY_FAST = TRUE;
+        } else if (strcmp(argv[i], "help") == 0) {
+            print_usage();
+            return 0;
+        } else {
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            fputs("Try 'spotify-listener help' for more information\n",
+                  stderr);
+            return 1;
+        }
+    }
+
+    // The status is rendered long after startup, so fail now rather than
+    // pushing a broken status later
+    if (!format_compile(&status_format, STATUS_FORMAT,
+                        STATUS_MAX_ARTIST_LENGTH, STATUS_MAX_TITLE_LENGTH,
+                        STATUS_MAX_LENGTH, STATUS_TRUNC)) {
+        fputs(
+            "Invalid status format! Make sure every %[ is closed by a %], "
+            "segments are nested at most 8 deep and the trunc string is not "
+            "longer than the max lengths.\n",
+            stderr);
+        return 1;
+    }
+
     dbus_error_init(&err);
+    track_state_clear(&current_track);
+
+    if (REPLAY_PATH != NULL) {
+        signal(SIGPIPE, SIG_IGN);
+        log_start();
+        const int res = replay_trace(REPLAY_PATH);
+        log_stop();
+        return res;
+    }
+
+    // Termination signals are read from a signalfd by the event loop, so that
+    // the listener exits cleanly. They must be blocked before any thread is
+    // started, or they would be delivered to that thread instead.
+    sigemptyset(&termination_signals);
+    sigaddset(&termination_signals, SIGINT);
+    sigaddset(&termination_signals, SIGTERM);
+    sigaddset(&termination_signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &termination_signals, NULL);
+
+    // Write log records in the background, so a slow reader of the output
+    // (e.g. journald) never delays polybar updates. If the thread can't be
+    // started, records are written right away instead.
+    log_start();
 
     // Connect to session bus
     if (!(connection = dbus_bus_get(DBUS_BUS_SESSION, &err))) {
@@ -321,21 +1176,73 @@ int main() {
         return 1;
     }
 
-    // Receive messages for PropertiesChanged signal to detect track changes
-    // or spotify launching
-    dbus_bus_add_match(connection, PROPERTIES_CHANGED_MATCH, &err);
+    // Clean up (e.g. write the metrics) when the bus goes away instead of
+    // exiting right away
+    dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+    // Receive messages for NameOwnerChanged signal to detect spotify
+    // launching, restarting or exiting
+    dbus_bus_add_match(connection, NAME_OWNER_CHANGED_MATCH, &err);
     if (dbus_error_is_set(&err)) {
         fputs(err.message, stderr);
         return 1;
     }
 
-    // Receive messages for NameOwnerChanged signal to detect spotify exiting
-    dbus_bus_add_match(connection, NAME_OWNER_CHANGED_MATCH, &err);
-    if (dbus_error_is_set(&err)) {
-        fputs(err.message, stderr);
+    // Count every message that wakes up the listener
+    if (!dbus_connection_add_filter(connection, wakeup_counter, NULL,
+                                    free_user_data)) {
+        fputs("Failed to add wakeup counter", stderr);
         return 1;
     }
 
+    // Record messages before any of them are handled
+    if (RECORD_PATH != NULL) {
+        if (!trace_writer_open(RECORD_PATH) ||
+            !dbus_connection_add_filter(connection, trace_recorder, NULL,
+                                        free_user_data)) {
+            fprintf(stderr, "%s%s%s\n", "Failed to record to '", RECORD_PATH,
+                    "'");
+            return 1;
+        }
+    }
+
+    // A bar exiting while its FIFO is held open must not kill the listener
+    signal(SIGPIPE, SIG_IGN);
+
+    if (IPC_USE_IO_URING && !ipc_use_io_uring(TRUE)) {
+        log_record(LOG_LEVEL_INFO, "io_uring is not available, using write()",
+                   NULL);
+    }
+
+    // Keep track of polybar IPC files without rescanning the directories
+    char *socket_dir = POLYBAR_SOCKET_DIRECTORY != NULL
+                           ? strdup(POLYBAR_SOCKET_DIRECTORY)
+                           : polybar_socket_dir();
+    if (!ipc_endpoints_init(POLYBAR_IPC_DIRECTORY, socket_dir)) {
+        fputs("Failed to read polybar IPC directory\n", stderr);
+    }
+    free(socket_dir);
+
+    // Deliver updates in the background. If the thread can't be started,
+    // updates are delivered by the dispatch loop instead.
+    ipc_writer_start();
+
+    // Let spotifyctl read the status without a DBus round trip
+    if (!snapshot_writer_open()) {
+        fputs("Failed to create status snapshot\n", stderr);
+    }
+
+    // Receive messages for PropertiesChanged signal from spotify to detect
+    // track changes if spotify is already running
+    spotify_resolve_owner(connection);
+
+    // Show the current state right away instead of waiting for a signal
+    if (spotify_sync_state(connection)) {
+        listener_stats.updates++;
+        log_record(LOG_LEVEL_INFO, "Synced polybar with spotify",
+                   "after_startup_us=%lld", get_monotonic_us() - start_us);
+    }
+
     // Register handler for PropertiesChanged signal
     if (!dbus_connection_add_filter(connection, properties_changed_handler,
                                     NULL, free_user_data)) {
@@ -350,11 +1257,74 @@ int main() {
         return 1;
     }
 
-    // Read messages and call handlers when neccessary
-    while (dbus_connection_read_write_dispatch(connection, -1)) {
-        if (VERBOSE) puts("In dispatch loop");
+    // Count the signals that none of the handlers above wanted
+    if (!dbus_connection_add_filter(connection, unhandled_counter, NULL,
+                                    free_user_data)) {
+        fputs("Failed to add unhandled signal counter", stderr);
+        return 1;
     }
 
+    // Wait for DBus messages, coalescing, metrics and IPC retry timers, bars
+    // being started or stopped and termination signals in a single
+    // epoll_wait()
+    if (!event_loop_init() ||
+        !event_loop_attach_dbus(connection, messages_dispatched)) {
+        fputs("Failed to create event loop\n", stderr);
+        return 1;
+    }
+
+    coalesce_timer_fd = event_loop_add_timer(coalesce_timer_expired, NULL);
+    if (coalesce_timer_fd == -1) {
+        fputs("Failed to create coalescing timer\n", stderr);
+        return 1;
+    }
+
+    if (METRICS_PATH != NULL) {
+        const int metrics_timer_fd =
+            event_loop_add_timer(metrics_timer_expired, NULL);
+        if (metrics_timer_fd == -1) {
+            fputs("Failed to create metrics timer\n", stderr);
+            return 1;
+        }
+        event_loop_arm_timer(metrics_timer_fd, metrics_write_due(), 0);
+    }
+
+    const int ipc_retry_timer_fd =
+        event_loop_add_timer(ipc_retry_timer_expired, NULL);
+    if (ipc_retry_timer_fd == -1) {
+        fputs("Failed to create IPC retry timer\n", stderr);
+        return 1;
+    }
+    ipc_writer_set_retry_timer(ipc_retry_timer_fd);
+
+    // Without inotify, the endpoints are rescanned on every update instead
+    if (ipc_endpoints_fd() != -1 &&
+        !event_loop_add_fd(ipc_endpoints_fd(), EPOLLIN | EPOLLET, bars_changed,
+                           NULL)) {
+        fputs("Failed to watch polybar IPC directory\n", stderr);
+    }
+
+    if (event_loop_add_signals(&termination_signals, termination_requested,
+                               NULL) == -1) {
+        fputs("Failed to handle termination signals\n", stderr);
+        return 1;
+    }
+
+    const int res = event_loop_run() ? 0 : 1;
+    if (res != 0) log_record(LOG_LEVEL_WARN, "Disconnected from DBus", NULL);
+
+    // Stop the IPC writer first, since it arms the retry timer of the loop
+    ipc_writer_stop();
+    ipc_writer_set_retry_timer(-1);
+    event_loop_free();
+    metrics_deadline_ms = 0;
+    metrics_write_due();
+    trace_writer_close();
+    snapshot_writer_close();
+    ipc_endpoints_free();
+    format_free(&status_format);
+    ipc_use_io_uring(FALSE);
     dbus_connection_unref(connection);
-    return 0;
+    log_stop();
+    return res;
 }
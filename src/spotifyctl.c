@@ -5,17 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../include/mpris.h"
+#include "../include/probes.h"
+#include "../include/snapshot.h"
 #include "../include/utils.h"
 
 /*************** Constants for DBus ***************/
 const char *DESTINATION = "org.mpris.MediaPlayer2.spotify";
 const char *PATH = "/org/mpris/MediaPlayer2";
 
-const char *STATUS_IFACE = "org.freedesktop.DBus.Properties";
-const char *STATUS_METHOD = "Get";
-const char *STATUS_METHOD_ARG_IFACE_NAME = "org.mpris.MediaPlayer2.Player";
-const char *STATUS_METHOD_ARG_PROPERTY_NAME = "Metadata";
-
 const char *PLAYER_IFACE = "org.mpris.MediaPlayer2.Player";
 const char *PLAYER_METHOD_PLAY = "Play";
 const char *PLAYER_METHOD_PAUSE = "Pause";
@@ -23,9 +21,6 @@ const char *PLAYER_METHOD_PLAYPAUSE = "PlayPause";
 const char *PLAYER_METHOD_NEXT = "Next";
 const char *PLAYER_METHOD_PREVIOUS = "Previous";
 
-const char *METADATA_TITLE_KEY = "xesam:title";
-const char *METADATA_ARTIST_KEY = "xesam:artist";
-
 /*** Program Mode ***/
 typedef enum {
     MODE_NONE,
@@ -41,176 +36,40 @@ typedef enum {
 // running and the status is requested
 dbus_bool_t SUPPRESS_ERRORS = 0;
 
-char *get_song_title_from_metadata(DBusMessage *msg) {
-    DBusMessageIter iter;
-
-    dbus_message_iter_init(msg, &iter);
-
-    char *title = NULL;
-
-    // The message looks like this:
-    // string "org.mpris.MediaPlayer2.Player"
-    // array [
-    //    dict entry(
-    //       string "Metadata"
-    //       variant             array [
-    //          .
-    //          .
-    //          .
-    //             dict entry(
-    //                string "xesam:title"
-    //                variant               string "{track title}"
-    //             )
-    //       ]
-    //    )
-    // ]
-    // The track title is at the path:
-    // variant->array[xesam:title]->variant->string
-
-    if (iter_try_step_into_type(&iter, DBUS_TYPE_VARIANT) &&
-        iter_try_step_into_type(&iter, DBUS_TYPE_ARRAY) &&
-        iter_try_step_to_key(&iter, METADATA_TITLE_KEY) &&
-        iter_try_step_into_type(&iter, DBUS_TYPE_VARIANT)) {
-        title = iter_get_string(&iter);
-    }
-
-    return title;
-}
-
-char *get_song_artist_from_metadata(DBusMessage *msg) {
-    DBusMessageIter iter;
-
-    dbus_message_iter_init(msg, &iter);
-
-    char *artist = NULL;
-
-    // The message looks like this:
-    // string "org.mpris.MediaPlayer2.Player"
-    // array [
-    //    dict entry(
-    //       string "Metadata"
-    //       variant             array [
-    //          .
-    //          .
-    //          .
-    //             dict entry(
-    //                string "xesam:artist"
-    //                variant               string "{track artist}"
-    //             )
-    //       ]
-    //    )
-    // ]
-    // The track title is at the path:
-    // variant->array[xesam:artist]->variant->string
-
-    if (iter_try_step_into_type(&iter, DBUS_TYPE_VARIANT) &&
-        iter_try_step_into_type(&iter, DBUS_TYPE_ARRAY) &&
-        iter_try_step_to_key(&iter, METADATA_ARTIST_KEY) &&
-        iter_try_step_into_type(&iter, DBUS_TYPE_VARIANT) &&
-        iter_try_step_into_type(&iter, DBUS_TYPE_ARRAY)) {
-        artist = iter_get_string(&iter);
-    }
-
-    return artist;
-}
-
-char *format_output(const char *artist, const char *title,
-                    const int max_artist_length, const int max_title_length,
-                    const int max_length, const char *format,
-                    const char *trunc) {
-    // Get total number of each token
-    const int NUM_OF_ARTIST_TOK = num_of_matches(format, "%artist%");
-    const int NUM_OF_TITLE_TOK = num_of_matches(format, "%title%");
-
-    // Get length difference caused by a single replacement
-    const int ARTIST_REPL_DIFF = strlen(artist) - strlen("%artist%");
-    const int TITLE_REPL_DIFF = strlen(title) - strlen("%title%");
-
-    // Calculate the total untruncated length of the output
-    const int TOTAL_UNTRUNC_LENGTH = strlen(format) +
-                                     NUM_OF_ARTIST_TOK * ARTIST_REPL_DIFF +
-                                     NUM_OF_TITLE_TOK * TITLE_REPL_DIFF;
-
-    char *output;
-
-    // Truncate artist and title only if total untruncated length > max_length
-    // and max_length was specified
-    if (max_length == INT_MAX || TOTAL_UNTRUNC_LENGTH > max_length) {
-        char *trunc_title;
-        char *trunc_artist;
-
-        // Truncate artist and track title using the truncation string
-        if (!(trunc_title = str_trunc(title, max_title_length, trunc))) {
-            if (!SUPPRESS_ERRORS) {
-                fputs(
-                    "Failed to truncate title. Please make sure the trunc "
-                    "string is smaller than the max title length.\n",
-                    stderr);
-                exit(1);
-            }
-        }
-
-        if (!(trunc_artist = str_trunc(artist, max_artist_length, trunc))) {
-            if (!SUPPRESS_ERRORS) {
-                fputs(
-                    "Failed to truncate artist. Please make sure the trunc "
-                    "string is smaller than the max artist length.\n",
-                    stderr);
-            }
-            exit(1);
-        }
-
-        // Replace all tokens with their values
-        char *temp = str_replace_all(format, "%artist%", trunc_artist);
-        char *temp2 = str_replace_all(temp, "%title%", trunc_title);
-
-        // Truncate output to max length
-        if (!(output = str_trunc(temp2, max_length, trunc))) {
-            if (!SUPPRESS_ERRORS) {
-                fputs(
-                    "Failed to truncate output. Please make sure the trunc "
-                    "string is smaller than the max output length.\n",
-                    stderr);
-            }
-            exit(1);
-        }
+dbus_bool_t get_status_from_snapshot(const StatusFormat *format) {
+    StatusSnapshot snapshot;
+    char output[FORMAT_OUTPUT_SIZE];
 
-        free(temp);
-        free(temp2);
-        free(trunc_title);
-        free(trunc_artist);
-    } else {
-        // Replace all tokens with their values
-        char *temp = str_replace_all(format, "%artist%", artist);
-        output = str_replace_all(temp, "%title%", title);
+    // Let the DBus path report that spotify is not running
+    if (!snapshot_read(&snapshot) || !snapshot.running) return FALSE;
 
-        free(temp);
-    }
+    format_render(format, &snapshot.track, NULL, output, sizeof(output));
+    puts(output);
 
-    return output;
+    return TRUE;
 }
 
-void get_status(DBusConnection *connection, const int max_artist_length,
-                const int max_title_length, const int max_length,
-                const char *format, const char *trunc) {
+void get_status(DBusConnection *connection, const StatusFormat *format) {
     DBusError err;
+    DBusMessageIter iter;
+    TrackState track;
+    char output[FORMAT_OUTPUT_SIZE];
+
     dbus_error_init(&err);
 
-    // Send a message requesting the properties
-    DBusMessage *msg = dbus_message_new_method_call(
-        DESTINATION, PATH, STATUS_IFACE, STATUS_METHOD);
+    // Request all properties of the player, which include the Metadata and the
+    // PlaybackStatus
+    DBusMessage *msg = mpris_new_get_all_call(DESTINATION);
 
-    // Message looks like this:
-    // string "org.mpris.MediaPlayer2.Player"
-    // string "Metadata"
-    dbus_message_append_args(
-        msg, DBUS_TYPE_STRING, &STATUS_METHOD_ARG_IFACE_NAME, DBUS_TYPE_STRING,
-        &STATUS_METHOD_ARG_PROPERTY_NAME, DBUS_TYPE_INVALID);
+    PROBE1(get_status_call_entry, msg);
 
     // Send and receive reply
     DBusMessage *reply;
     reply =
         dbus_connection_send_with_reply_and_block(connection, msg, 10000, &err);
+
+    PROBE1(get_status_call_return, reply);
+
     dbus_message_unref(msg);
 
     if (dbus_error_is_set(&err)) {
@@ -218,18 +77,13 @@ void get_status(DBusConnection *connection, const int max_artist_length,
         exit(1);
     }
 
-    char *title = get_song_title_from_metadata(reply);
-    char *artist = get_song_artist_from_metadata(reply);
-
-    char *output = format_output(artist, title, max_artist_length,
-                                 max_title_length, max_length, format, trunc);
+    track_state_clear(&track);
+    if (dbus_message_iter_init(reply, &iter))
+        mpris_decode_properties(&iter, &track);
 
+    format_render(format, &track, NULL, output, sizeof(output));
     puts(output);
 
-    free(output);
-    free(title);
-    free(artist);
-
     dbus_message_unref(reply);
 }
 
@@ -241,8 +95,15 @@ void spotify_player_call(DBusConnection *connection, const char *method) {
     DBusMessage *msg =
         dbus_message_new_method_call(DESTINATION, PATH, PLAYER_IFACE, method);
 
-    dbus_connection_send_with_reply_and_block(connection, msg, 10000, &err);
+    PROBE1(player_call_entry, method);
+
+    DBusMessage *reply =
+        dbus_connection_send_with_reply_and_block(connection, msg, 10000, &err);
+
+    PROBE1(player_call_return, reply);
+
     dbus_message_unref(msg);
+    if (reply != NULL) dbus_message_unref(reply);
 
     if (dbus_error_is_set(&err)) {
         if (!SUPPRESS_ERRORS) fputs(err.message, stderr);
@@ -279,19 +140,26 @@ void print_usage() {
     puts("                              the status command. This value works");
     puts("                              best as the sum of the max artist and");
     puts("                              max title length if those are");
-    puts("                              specified.");
+    puts("                              specified. Lengths are in columns,");
+    puts("                              with wide characters counting as 2.");
     puts("                              Default: No limit");
     puts("    --format                  The format to display the status in.");
-    puts("                              The %artist% and %title% tokens will");
-    puts("                              be replaced by the artist name and");
+    puts("                              The %artist%, %title%, %album%,");
+    puts("                              %tracknumber%, %length% and %status%");
+    puts("                              tokens will be replaced by the track's");
+    puts("                              values. Text between %[ and %] is left");
+    puts("                              out if any token inside it is empty.");
     puts("                                Default: '%artist%: %title%'");
-    puts("                              track title, respectively.");
     puts("    --trunc                   The string to use to show that the");
     puts("                              artist name, track title, or output");
     puts("                              was longer than the max length");
     puts("                              specified. This will count towards");
     puts("                              the max lengths. This can be blank.");
     puts("                                Default: '...'");
+    puts("    --no-snapshot             Always get the status from spotify");
+    puts("                              over DBus instead of reading the");
+    puts("                              status published by");
+    puts("                              spotify-listener.");
     puts("    -q                        Hide errors");
     puts("");
     puts("  Examples:");
@@ -330,6 +198,8 @@ int main(int argc, char *argv[]) {
     int max_length = INT_MAX;
     char *status_format = "%artist%: %title%";
     char *trunc = "...";
+    dbus_bool_t use_snapshot = TRUE;
+    StatusFormat format = {0};
 
     // Parse commandline options
     for (size_t i = 1; i < argc; i++) {
@@ -357,6 +227,8 @@ int main(int argc, char *argv[]) {
             status_format = argv[++i];
         } else if (strcmp(argv[i], "--trunc") == 0) {
             trunc = argv[++i];
+        } else if (strcmp(argv[i], "--no-snapshot") == 0) {
+            use_snapshot = FALSE;
         } else if (strcmp(argv[i], "status") == 0) {
             prog_mode = MODE_STATUS;
         } else if (strcmp(argv[i], "play") == 0) {
@@ -380,6 +252,28 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Parse the format once, before anything is printed
+    if (prog_mode == MODE_STATUS &&
+        !format_compile(&format, status_format, max_artist_length,
+                        max_title_length, max_length, trunc)) {
+        if (!SUPPRESS_ERRORS) {
+            fputs(
+                "Invalid status format. Please make sure every %[ is closed "
+                "by a %], segments are nested at most 8 deep and the trunc "
+                "string is smaller than the max lengths.\n",
+                stderr);
+        }
+        return 1;
+    }
+
+    // Read the status published by spotify-listener, which does not need a
+    // DBus connection at all
+    if (prog_mode == MODE_STATUS && use_snapshot &&
+        get_status_from_snapshot(&format)) {
+        format_free(&format);
+        return 0;
+    }
+
     dbus_error_init(&err);
 
     // Connect to session bus
@@ -397,8 +291,7 @@ int main(int argc, char *argv[]) {
             return 1;
 
         case MODE_STATUS:
-            get_status(connection, max_artist_length, max_title_length,
-                       max_length, status_format, trunc);
+            get_status(connection, &format);
             break;
 
         case MODE_PLAY:
@@ -423,6 +316,7 @@ int main(int argc, char *argv[]) {
     }
 
     dbus_connection_unref(connection);
+    format_free(&format);
 
     return 0;
 }
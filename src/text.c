@@ -0,0 +1,315 @@
+#include "../include/text.h"
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    unsigned int first;
+    unsigned int last;
+} CodepointRange;
+
+// Combining marks, joiners, variation selectors, emoji modifiers and other
+// characters that take up no columns of their own
+static const CodepointRange ZERO_WIDTH[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0900, 0x0902},
+    {0x093A, 0x093A},   {0x093C, 0x093C},   {0x0941, 0x0948},
+    {0x094D, 0x094D},   {0x0951, 0x0957},   {0x0962, 0x0963},
+    {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},
+    {0x1160, 0x11FF},   {0x1AB0, 0x1AFF},   {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F},   {0x2028, 0x202E},   {0x2060, 0x2064},
+    {0x20D0, 0x20FF},   {0xFE00, 0xFE0F},   {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF},   {0x1F3FB, 0x1F3FF}, {0xE0020, 0xE007F},
+    {0xE0100, 0xE01EF}};
+
+// East Asian wide and fullwidth characters and emoji presented as emoji
+static const CodepointRange WIDE[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}};
+
+static dbus_bool_t in_ranges(const unsigned int cp,
+                             const CodepointRange ranges[],
+                             const size_t num_of_ranges) {
+    size_t low = 0;
+    size_t high = num_of_ranges;
+
+    if (cp < ranges[0].first || cp > ranges[num_of_ranges - 1].last)
+        return FALSE;
+
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+
+        if (cp < ranges[mid].first) {
+            high = mid;
+        } else if (cp > ranges[mid].last) {
+            low = mid + 1;
+        } else {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static int codepoint_width(const unsigned int cp) {
+    // Control characters
+    if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) return 0;
+    if (cp < 0x300) return 1;
+
+    // CJK ideographs and Hangul syllables, the most common wide characters
+    if ((cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xAC00 && cp <= 0xD7A3))
+        return 2;
+
+    if (in_ranges(cp, ZERO_WIDTH, sizeof(ZERO_WIDTH) / sizeof(ZERO_WIDTH[0])))
+        return 0;
+    if (in_ranges(cp, WIDE, sizeof(WIDE) / sizeof(WIDE[0]))) return 2;
+
+    return 1;
+}
+
+/**
+ * Decode the character at the start of str into cp. Returns the number of
+ * bytes it takes up. An invalid byte is decoded as a single character.
+ */
+static size_t utf8_decode(const unsigned char *str, const size_t len,
+                          unsigned int *cp) {
+    size_t n;
+
+    if (str[0] < 0x80) {
+        *cp = str[0];
+        return 1;
+    } else if ((str[0] & 0xE0) == 0xC0) {
+        *cp = str[0] & 0x1F;
+        n = 2;
+    } else if ((str[0] & 0xF0) == 0xE0) {
+        *cp = str[0] & 0x0F;
+        n = 3;
+    } else if ((str[0] & 0xF8) == 0xF0) {
+        *cp = str[0] & 0x07;
+        n = 4;
+    } else {
+        *cp = str[0];
+        return 1;
+    }
+
+    if (n > len) {
+        *cp = str[0];
+        return 1;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        if ((str[i] & 0xC0) != 0x80) {
+            *cp = str[0];
+            return 1;
+        }
+        *cp = (*cp << 6) | (str[i] & 0x3F);
+    }
+
+    return n;
+}
+
+/**
+ * Check if all 8 bytes of word are printable ASCII, which are one column wide
+ * each. See "Determine if a word has a byte less than n" in Bit Twiddling
+ * Hacks.
+ */
+static dbus_bool_t is_printable_word(const uint64_t word) {
+    const uint64_t ONES = 0x0101010101010101ULL;
+    const uint64_t HIGHS = 0x8080808080808080ULL;
+    // Non-ASCII bytes and bytes below 0x20
+    const uint64_t below = (word - ONES * 0x20) | word;
+    // DEL bytes
+    const uint64_t del = word ^ (ONES * 0x7F);
+
+    return ((below | ((del - ONES) & ~del)) & HIGHS) == 0;
+}
+
+/**
+ * Get the length of the printable ASCII prefix of a string, checking a word at
+ * a time
+ */
+static size_t printable_prefix(const unsigned char *s, const size_t len) {
+    size_t i = 0;
+
+    while (i + 8 <= len) {
+        uint64_t word;
+
+        memcpy(&word, s + i, sizeof(word));
+        if (!is_printable_word(word)) break;
+        i += 8;
+    }
+
+    while (i < len && s[i] >= 0x20 && s[i] < 0x7F) i++;
+
+    return i;
+}
+
+int utf8_width(const char *str, const size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0;
+    int width = 0;
+
+    while (i < len) {
+        unsigned int cp;
+
+        // Printable ASCII, a word at a time
+        if (i + 8 <= len) {
+            uint64_t word;
+
+            memcpy(&word, s + i, sizeof(word));
+            if (is_printable_word(word)) {
+                width += 8;
+                i += 8;
+                continue;
+            }
+        }
+
+        // Printable ASCII
+        if (s[i] >= 0x20 && s[i] < 0x7F) {
+            width++;
+            i++;
+            continue;
+        }
+
+        i += utf8_decode(s + i, len - i, &cp);
+        width += codepoint_width(cp);
+    }
+
+    return width;
+}
+
+TextCut utf8_cut(const char *str, const size_t len, const int max_width) {
+    const unsigned char *s = (const unsigned char *)str;
+    TextCut cut = {0, 0};
+    size_t i = 0;
+
+    if (max_width < 0) return cut;
+
+    while (i < len) {
+        unsigned int cp;
+        size_t n;
+        int width;
+
+        // Printable ASCII
+        if (s[i] >= 0x20 && s[i] < 0x7F) {
+            if (cut.width == max_width) break;
+
+            cut.len = ++i;
+            cut.width++;
+            continue;
+        }
+
+        n = utf8_decode(s + i, len - i, &cp);
+        width = codepoint_width(cp);
+
+        if (cut.width + width > max_width) break;
+
+        // Zero-width characters always fit, so they stay with the character
+        // before them
+        i += n;
+        cut.len = i;
+        cut.width += width;
+    }
+
+    return cut;
+}
+
+void text_index_build(TextIndex *index, const char *str, const size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    // Too long for the tables, cut by scanning instead
+    const dbus_bool_t fill_tables = len <= (unsigned short)-1;
+    // Printable ASCII is one byte and one column wide, so a string of it, which
+    // is most titles, is cut at byte offsets without filling the tables
+    size_t i = printable_prefix(s, len);
+    int width = i;
+
+    index->str = str;
+    index->len = len;
+    index->width = width;
+    index->ascii = TRUE;
+    index->num_of_cuts = 0;
+
+    if (i == len) return;
+
+    for (int w = 0; fill_tables && w < width && w <= TEXT_INDEX_MAX_WIDTH;
+         w++) {
+        index->cut_len[w] = w;
+        index->cut_width[w] = w;
+    }
+
+    while (i < len) {
+        unsigned int cp;
+        size_t n = 1;
+        int cp_width = 1;
+
+        if (s[i] < 0x20 || s[i] >= 0x7F) {
+            n = utf8_decode(s + i, len - i, &cp);
+            cp_width = codepoint_width(cp);
+        }
+
+        // Every width up to the end of this character is cut before it, after
+        // the zero-width characters that precede it
+        for (int w = width; fill_tables && w < width + cp_width &&
+                            w <= TEXT_INDEX_MAX_WIDTH;
+             w++) {
+            index->cut_len[w] = i;
+            index->cut_width[w] = width;
+        }
+
+        i += n;
+        width += cp_width;
+    }
+
+    // A character is never wider than its length in bytes, and only as wide
+    // if it is a single byte taking up one column. If that holds for every
+    // character, cuts are at byte offsets and the tables are not needed.
+    index->width = width;
+    index->ascii = (size_t)width == len;
+
+    if (fill_tables)
+        index->num_of_cuts =
+            width < TEXT_INDEX_MAX_WIDTH ? width : TEXT_INDEX_MAX_WIDTH;
+}
+
+TextCut text_index_cut(const TextIndex *index, const int max_width) {
+    TextCut cut = {0, 0};
+
+    if (max_width < 0) return cut;
+
+    if (max_width >= index->width) {
+        cut.len = index->len;
+        cut.width = index->width;
+    } else if (index->ascii) {
+        cut.len = max_width;
+        cut.width = max_width;
+    } else if (max_width < index->num_of_cuts) {
+        cut.len = index->cut_len[max_width];
+        cut.width = index->cut_width[max_width];
+    } else {
+        cut = utf8_cut(index->str, index->len, max_width);
+    }
+
+    return cut;
+}
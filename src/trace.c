@@ -0,0 +1,105 @@
+#include "../include/trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/utils.h"
+
+// Trace being recorded to, NULL if none
+static FILE *recording = NULL;
+// Monotonic time at which the trace being recorded to was opened
+static long long recording_start_us = 0;
+
+dbus_bool_t trace_writer_open(const char *path) {
+    const TraceHeader header = {TRACE_MAGIC, TRACE_VERSION};
+
+    recording = fopen(path, "wb");
+    if (recording == NULL) return FALSE;
+
+    if (fwrite(&header, sizeof(header), 1, recording) != 1 ||
+        fflush(recording) != 0) {
+        fclose(recording);
+        recording = NULL;
+        return FALSE;
+    }
+
+    recording_start_us = get_monotonic_us();
+
+    return TRUE;
+}
+
+dbus_bool_t trace_record(DBusMessage *msg) {
+    TraceRecordHeader record;
+    char *marshalled;
+    int len;
+
+    if (recording == NULL) return FALSE;
+
+    // Don't write uninitialized padding to the file
+    memset(&record, 0, sizeof(record));
+    record.time_us = get_monotonic_us() - recording_start_us;
+
+    if (!dbus_message_marshal(msg, &marshalled, &len)) return FALSE;
+
+    record.len = len;
+
+    const dbus_bool_t written =
+        fwrite(&record, sizeof(record), 1, recording) == 1 &&
+        fwrite(marshalled, len, 1, recording) == 1 && fflush(recording) == 0;
+
+    dbus_free(marshalled);
+
+    return written;
+}
+
+void trace_writer_close() {
+    if (recording == NULL) return;
+
+    fclose(recording);
+    recording = NULL;
+}
+
+dbus_bool_t trace_reader_open(TraceReader *reader, const char *path) {
+    TraceHeader header;
+
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) return FALSE;
+
+    if (fread(&header, sizeof(header), 1, reader->file) != 1 ||
+        header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        trace_reader_close(reader);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+DBusMessage *trace_reader_next(TraceReader *reader, long long *time_us) {
+    TraceRecordHeader record;
+    DBusMessage *msg;
+
+    if (fread(&record, sizeof(record), 1, reader->file) != 1 ||
+        record.len == 0 || record.len > TRACE_MAX_MESSAGE_LEN)
+        return NULL;
+
+    char *marshalled = (char *)malloc(record.len);
+    if (marshalled == NULL) return NULL;
+
+    if (fread(marshalled, record.len, 1, reader->file) != 1) {
+        free(marshalled);
+        return NULL;
+    }
+
+    // Returns NULL if the message is corrupt
+    msg = dbus_message_demarshal(marshalled, record.len, NULL);
+    free(marshalled);
+
+    *time_us = record.time_us;
+
+    return msg;
+}
+
+void trace_reader_close(TraceReader *reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    reader->file = NULL;
+}
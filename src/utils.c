@@ -7,6 +7,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "../include/text.h"
+
 void print_string_iter(DBusMessageIter *iter) {
     int type = dbus_message_iter_get_arg_type(iter);
 
@@ -17,6 +19,28 @@ void print_string_iter(DBusMessageIter *iter) {
     }
 }
 
+dbus_bool_t iter_get_string_view(DBusMessageIter *iter, StringView *view) {
+    int type = dbus_message_iter_get_arg_type(iter);
+
+    // Make sure it is a string-like type
+    if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ||
+        type == DBUS_TYPE_SIGNATURE) {
+        DBusBasicValue value;
+        dbus_message_iter_get_basic(iter, &value);
+
+        view->str = value.str;
+        view->len = strlen(value.str);
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+dbus_bool_t string_view_equals(const StringView *view, const char *str) {
+    return strncmp(view->str, str, view->len) == 0 && str[view->len] == '\0';
+}
+
 char *iter_get_string(DBusMessageIter *iter) {
     int type = dbus_message_iter_get_arg_type(iter);
 
@@ -52,46 +76,159 @@ dbus_bool_t recurse_iter_of_type(DBusMessageIter *iter,
     return FALSE;
 }
 
+/**
+ * Skip over a single complete type in a signature. Returns a pointer to the
+ * character after the type, or NULL if the signature is malformed.
+ */
+static const char *signature_skip_type(const char *signature) {
+    switch (*signature) {
+        case DBUS_TYPE_ARRAY:
+            return signature_skip_type(signature + 1);
+
+        case DBUS_STRUCT_BEGIN_CHAR:
+        case DBUS_DICT_ENTRY_BEGIN_CHAR: {
+            const char end = *signature == DBUS_STRUCT_BEGIN_CHAR
+                                 ? DBUS_STRUCT_END_CHAR
+                                 : DBUS_DICT_ENTRY_END_CHAR;
+
+            signature++;
+            while (signature != NULL && *signature != end)
+                signature = signature_skip_type(signature);
+
+            return signature != NULL ? signature + 1 : NULL;
+        }
+
+        case DBUS_TYPE_INVALID:
+            return NULL;
+
+        default:
+            return signature + 1;
+    }
+}
+
+/**
+ * Get the type code that dbus_message_iter_get_arg_type() returns for a type
+ * in a signature.
+ */
+static int signature_type_code(const char *signature) {
+    switch (*signature) {
+        case DBUS_STRUCT_BEGIN_CHAR:
+            return DBUS_TYPE_STRUCT;
+        case DBUS_DICT_ENTRY_BEGIN_CHAR:
+            return DBUS_TYPE_DICT_ENTRY;
+        default:
+            return *signature;
+    }
+}
+
+/**
+ * Match the value pointed to by iter against the single complete type at the
+ * start of signature. Returns a pointer to the character after the matched
+ * type, or NULL if the value does not match.
+ */
+static const char *iter_match_type(DBusMessageIter *iter,
+                                   const char *signature) {
+    const int type = dbus_message_iter_get_arg_type(iter);
+    DBusMessageIter sub_iter;
+
+    switch (*signature) {
+        case DBUS_TYPE_ARRAY:
+            // The element type code is known without walking the array
+            if (type != DBUS_TYPE_ARRAY ||
+                dbus_message_iter_get_element_type(iter) !=
+                    signature_type_code(signature + 1))
+                return NULL;
+
+            dbus_message_iter_recurse(iter, &sub_iter);
+
+            // An empty array has no element to walk, so only the element type
+            // code can be checked
+            if (dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_INVALID)
+                return signature_skip_type(signature + 1);
+
+            // Arrays are homogeneous, so the first element is enough
+            return iter_match_type(&sub_iter, signature + 1);
+
+        case DBUS_STRUCT_BEGIN_CHAR:
+        case DBUS_DICT_ENTRY_BEGIN_CHAR: {
+            const char end = *signature == DBUS_STRUCT_BEGIN_CHAR
+                                 ? DBUS_STRUCT_END_CHAR
+                                 : DBUS_DICT_ENTRY_END_CHAR;
+
+            if (type != signature_type_code(signature)) return NULL;
+
+            dbus_message_iter_recurse(iter, &sub_iter);
+
+            // Match every member of the container. Stepping past a member
+            // skips its value, so it is only done if another one must follow.
+            signature++;
+            while ((signature = iter_match_type(&sub_iter, signature)) !=
+                       NULL &&
+                   *signature != end)
+                dbus_message_iter_next(&sub_iter);
+
+            if (signature == NULL) return NULL;
+
+            // A struct must not have more members than the signature, while
+            // libdbus only accepts dict entries of a key and a value
+            if (end == DBUS_STRUCT_END_CHAR &&
+                dbus_message_iter_has_next(&sub_iter))
+                return NULL;
+
+            return signature + 1;
+        }
+
+        case DBUS_TYPE_INVALID:
+            return NULL;
+
+        default:
+            // Basic types and variants match by their type code
+            return type == *signature ? signature + 1 : NULL;
+    }
+}
+
+dbus_bool_t iter_has_signature(DBusMessageIter *iter, const char *signature) {
+    const char *end = iter_match_type(iter, signature);
+
+    // Signature must be a single complete type
+    return end != NULL && *end == DBUS_TYPE_INVALID;
+}
+
 dbus_bool_t recurse_iter_of_signature(DBusMessageIter *iter,
                                       DBusMessageIter *subiter,
                                       const char *signature) {
-    char *iter_signature = dbus_message_iter_get_signature(iter);
-
     // Check if iter signature matches
-    if (strcmp(iter_signature, signature) == 0) {
+    if (iter_has_signature(iter, signature)) {
         // Initialize subiter in container pointer to by iter
         dbus_message_iter_recurse(iter, subiter);
-        dbus_free(iter_signature);
         return TRUE;
-    } else {
-        dbus_free(iter_signature);
-        return FALSE;
     }
+
+    return FALSE;
 }
 
 dbus_bool_t iter_go_to_key(DBusMessageIter *element_iter,
                            DBusMessageIter *entry_iter, const char *key) {
-    const int iter_type = dbus_message_iter_get_arg_type(element_iter);
-    char *iter_signature = dbus_message_iter_get_signature(element_iter);
-
-    // Make sure iter is on dict entry and signature matches string-variant
-    // entry
-    if (iter_type != DBUS_TYPE_DICT_ENTRY ||
-        strcmp(iter_signature, "{sv}") != 0) {
-        dbus_free(iter_signature);
+    // Make sure iter is on dict entry
+    if (dbus_message_iter_get_arg_type(element_iter) != DBUS_TYPE_DICT_ENTRY)
         return FALSE;
-    }
 
-    dbus_free(iter_signature);
+    dbus_bool_t is_first_entry = TRUE;
 
-    int current_type;
-
-    // Iterate through dict elements
-    while ((current_type = dbus_message_iter_get_arg_type(element_iter)) !=
-           DBUS_TYPE_INVALID) {
+    // Iterate through dict elements. The string-variant signature is checked
+    // by type code while walking the entries rather than by formatting the
+    // signature of the entry.
+    while (dbus_message_iter_get_arg_type(element_iter) != DBUS_TYPE_INVALID) {
         // Try to recurse into dict container
         recurse_iter_of_type(element_iter, entry_iter, DBUS_TYPE_DICT_ENTRY);
 
+        // Every entry of a dict has the same signature, so only the key of the
+        // first entry has to be checked
+        if (is_first_entry &&
+            dbus_message_iter_get_arg_type(entry_iter) != DBUS_TYPE_STRING)
+            return FALSE;
+        is_first_entry = FALSE;
+
         // Get dict entry key
         DBusBasicValue value;
         dbus_message_iter_get_basic(entry_iter, &value);
@@ -99,9 +236,10 @@ dbus_bool_t iter_go_to_key(DBusMessageIter *element_iter,
 
         // Check if dict key matches key argument
         if (strcmp(k, key) == 0) {
-            // Move iter to value of dict entry and return
+            // Move iter to value of dict entry and make sure it is a variant
             dbus_message_iter_next(entry_iter);
-            return TRUE;
+            return dbus_message_iter_get_arg_type(entry_iter) ==
+                   DBUS_TYPE_VARIANT;
         }
 
         // Go to next dict entry
@@ -171,6 +309,22 @@ dbus_bool_t msleep(const long milliseconds) {
     return TRUE;
 }
 
+long long get_monotonic_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
+}
+
+long long get_monotonic_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
 char *join_path(const char *p1, const char *p2) {
     const size_t len1 = strlen(p1);
     const size_t len2 = strlen(p2);
@@ -204,8 +358,8 @@ char *join_path(const char *p1, const char *p2) {
     }
 }
 
-dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, char **ptr_paths[],
-                                  size_t *num_of_paths) {
+dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, const char *prefix,
+                                  char **ptr_paths[], size_t *num_of_paths) {
     DIR *d;
     struct dirent *dir;
     size_t i = 0;
@@ -222,11 +376,10 @@ dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, char **ptr_paths[],
         while ((dir = readdir(d)) != NULL) {
             const char *name = dir->d_name;
 
-            // Check if filename starts with polybar_mqueue
-            if (strncmp(name, "polybar_mqueue", 14) == 0) {
+            // Check if filename starts with the prefix
+            if (strncmp(name, prefix, strlen(prefix)) == 0) {
                 // Join filename with parent path
                 char *path = join_path(ipc_path, name);
-                size_t len = strlen(path) + 1;  // +1 for null char
 
                 if (i >= *num_of_paths) {
                     // Reallocate 3 additional paths
@@ -245,7 +398,7 @@ dbus_bool_t get_polybar_ipc_paths(const char *ipc_path, char **ptr_paths[],
         // Assign address of array to pointer to array
         *ptr_paths = paths;
     } else {
-        closedir(d);
+        free(paths);
         return FALSE;
     }
 
@@ -321,19 +474,20 @@ char *str_replace_all(const char *str, const char *find, const char *repl) {
 char *str_trunc(const char *str, const int max_len, const char *trunc) {
     const size_t len = strlen(str);
     const size_t trunc_len = strlen(trunc);
+    const int trunc_width = utf8_width(trunc, trunc_len);
     char *new_str;
 
-    if (trunc_len > max_len) return NULL;
+    if (trunc_width > max_len) return NULL;
 
-    if (len > max_len) {
-        // New size is max_len + null char
-        const size_t new_str_size = max_len + 1;
+    if (utf8_width(str, len) > max_len) {
+        // Copy as many whole characters of str as fit, leaving room for trunc
+        const TextCut cut = utf8_cut(str, len, max_len - trunc_width);
 
-        new_str = (char *)calloc(new_str_size, sizeof(char));
+        // +1 for null char
+        new_str = (char *)calloc(cut.len + trunc_len + 1, sizeof(char));
 
-        // Copy str, leaving room for trunc
-        strncpy(new_str, str, max_len - trunc_len);
-        strcat(new_str, trunc);
+        memcpy(new_str, str, cut.len);
+        memcpy(new_str + cut.len, trunc, trunc_len);
     } else {
         // +1 for null char
         const size_t new_str_size = len + 1;